@@ -0,0 +1,169 @@
+#!/bin/sh
+# End-to-end benchmark: runs zmodopipe against fakedvr on this host and reports
+# throughput, CPU per channel, snapshot latency and drop rates.
+#
+# Usage: bench.sh -f <file.h264> [-n channels] [-t seconds] [-r fps] [-k kbps] [-- zmodopipe options]
+#
+# Build first:  gcc -Wall zmodopipe.c -o zmodopipe -pthread && gcc -Wall fakedvr.c -o fakedvr
+# JPEGs land in /var/www/html as usual, ffmpeg must be on the PATH unless -j is given.
+# Snapshot latency is from the DVR sending a keyframe to the next JPEG of that
+# channel being written, so it includes the snapshot period.
+# The start code scanner on its own is measured by nalbench.c.
+
+FAKEDVR=${FAKEDVR:-./fakedvr}
+ZMODOPIPE=${ZMODOPIPE:-./zmodopipe}
+PORT=${PORT:-9100}
+JPEGDIR=/var/www/html
+WARMUP=6		# a little over zmodopipe's STATS_INTERVAL
+
+file=""
+channels=4
+seconds=30
+fps=25
+kbps=0
+
+while getopts "f:n:t:r:k:h" opt; do
+    case $opt in
+        f) file=$OPTARG ;;
+        n) channels=$OPTARG ;;
+        t) seconds=$OPTARG ;;
+        r) fps=$OPTARG ;;
+        k) kbps=$OPTARG ;;
+        *) sed -n '5p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ -z "$file" ] || [ ! -f "$file" ]; then
+    sed -n '5p' "$0"
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+dvrPid=""
+pipePid=""
+
+cleanup()
+{
+    [ -n "$pipePid" ] && kill "$pipePid" 2>/dev/null && wait "$pipePid" 2>/dev/null
+    [ -n "$dvrPid" ] && kill "$dvrPid" 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+# CPU ticks used by zmodopipe, its ffmpeg children and the ones it has reaped
+# (utime, stime, cutime and cstime are fields 12-15 once the pid and command are cut off)
+cpuTicks()
+{
+    {
+        sed 's/^.*) //' /proc/"$pipePid"/stat | awk '{ print $12 + $13 + $14 + $15 }'
+        for pid in $(ps -o pid= --ppid "$pipePid"); do
+            sed 's/^.*) //' /proc/"$pid"/stat 2>/dev/null | awk '{ print $12 + $13 }'
+        done
+    } | awk '{ t += $1 } END { print t + 0 }'
+}
+
+# Sum of a metric over every channel
+metric()
+{
+    awk -v name="zmodopipe_$2" '$1 ~ "^" name "{" { s += $2 } END { print s + 0 }' "$1"
+}
+
+chanArgs=""
+i=1
+while [ "$i" -le "$channels" ]; do
+    chanArgs="$chanArgs -c $i"
+    rm -f "$JPEGDIR/$i.jpg"
+    i=$((i + 1))
+done
+
+dvrArgs="-p $PORT -f $file -r $fps -l $tmp/keys"
+[ "$kbps" -gt 0 ] && dvrArgs="$dvrArgs -k $kbps"
+
+$FAKEDVR $dvrArgs > "$tmp/fakedvr.log" 2>&1 &
+dvrPid=$!
+sleep 0.5
+
+# shellcheck disable=SC2086
+$ZMODOPIPE -e -s 127.0.0.1 -p "$PORT" $chanArgs -m "$tmp/metrics" "$@" > "$tmp/zmodopipe.log" 2>&1 &
+pipePid=$!
+
+sleep "$WARMUP"
+if [ ! -f "$tmp/metrics" ]; then
+    echo "zmodopipe isn't writing metrics, see its output:"
+    cat "$tmp/zmodopipe.log"
+    exit 1
+fi
+cp "$tmp/metrics" "$tmp/metrics.0"
+start=$(stat -c %.6Y "$tmp/metrics.0")
+cpu0=$(cpuTicks)
+cpuStart=$(date +%s.%N)
+
+# Note every new JPEG while the benchmark runs
+end=$(( $(date +%s) + seconds ))
+while [ "$(date +%s)" -lt "$end" ]; do
+    i=1
+    while [ "$i" -le "$channels" ]; do
+        m=$(stat -c %.6Y "$JPEGDIR/$i.jpg" 2>/dev/null)
+        eval "last=\$last$i"
+        if [ -n "$m" ] && [ "$m" != "$last" ]; then
+            echo "$i $m" >> "$tmp/jpegs"
+            eval "last$i=$m"
+        fi
+        i=$((i + 1))
+    done
+    sleep 0.1
+done
+
+cpu1=$(cpuTicks)
+cpuEnd=$(date +%s.%N)
+
+# Wait for a metrics file written after the run
+while [ "$(stat -c %.6Y "$tmp/metrics")" = "$start" ]; do
+    sleep 0.5
+done
+cp "$tmp/metrics" "$tmp/metrics.1"
+finish=$(stat -c %.6Y "$tmp/metrics.1")
+
+hz=$(getconf CLK_TCK)
+touch "$tmp/jpegs"
+
+awk -v channels="$channels" \
+    -v span="$(awk "BEGIN { print $finish - $start }")" \
+    -v cpuSpan="$(awk "BEGIN { print $cpuEnd - $cpuStart }")" \
+    -v ticks="$((cpu1 - cpu0))" -v hz="$hz" \
+    -v bytes="$(( $(metric "$tmp/metrics.1" received_bytes_total) - $(metric "$tmp/metrics.0" received_bytes_total) ))" \
+    -v frames="$(( $(metric "$tmp/metrics.1" frames_total) - $(metric "$tmp/metrics.0" frames_total) ))" \
+    -v dropBytes="$(( $(metric "$tmp/metrics.1" dropped_bytes_total) - $(metric "$tmp/metrics.0" dropped_bytes_total) ))" \
+    -v dropFrames="$(( $(metric "$tmp/metrics.1" dropped_frames_total) - $(metric "$tmp/metrics.0" dropped_frames_total) ))" \
+    -v connects="$(( $(metric "$tmp/metrics.1" connects_total) - $(metric "$tmp/metrics.0" connects_total) ))" \
+    -v restarts="$(( $(metric "$tmp/metrics.1" ffmpeg_starts_total) - $(metric "$tmp/metrics.0" ffmpeg_starts_total) ))" '
+    FILENAME == ARGV[1] { keys[$1, ++nKeys[$1]] = $2; next }
+    {
+        # Latest keyframe sent before this JPEG was written
+        k = 0
+        for( i = nKeys[$1]; i > 0; i-- )
+            if( keys[$1, i] <= $2 ) { k = keys[$1, i]; break }
+        if( k ) { lat[++n] = $2 - k; sum += $2 - k }
+    }
+    END {
+        cpu = ticks / hz / cpuSpan * 100
+        printf "Channels:           %d\n", channels
+        printf "Measured over:      %.1f s\n", span
+        printf "Throughput:         %.2f MB/s (%.2f MB/s per channel)\n", bytes / span / 1e6, bytes / span / 1e6 / channels
+        printf "Frames:             %.1f /s (%.1f /s per channel)\n", frames / span, frames / span / channels
+        printf "CPU:                %.1f%% of a core (%.2f%% per channel, about %d channels per core)\n", cpu, cpu / channels, (cpu > 0 ? 100 / (cpu / channels) : 0)
+        printf "Dropped:            %.3f%% of bytes, %d frames (%.3f%%)\n", bytes ? dropBytes * 100 / bytes : 0, dropFrames, frames ? dropFrames * 100 / frames : 0
+        printf "Reconnects:         %d, ffmpeg restarts: %d\n", connects, restarts
+        if( n )
+        {
+            # Insertion sort, there are only a few JPEGs per channel
+            for( i = 2; i <= n; i++ )
+                for( j = i; j > 1 && lat[j-1] > lat[j]; j-- ) { t = lat[j]; lat[j] = lat[j-1]; lat[j-1] = t }
+            p95 = int(n * 0.95 + 0.5)
+            if( p95 < 1 ) p95 = 1
+            printf "Snapshot latency:   avg %.3f s, p50 %.3f s, p95 %.3f s, max %.3f s (%d JPEGs)\n", sum / n, lat[int((n + 1) / 2)], lat[p95], lat[n], n
+        }
+        else
+            printf "Snapshot latency:   no JPEGs written\n"
+    }' "$tmp/keys" "$tmp/jpegs"
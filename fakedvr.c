@@ -0,0 +1,450 @@
+// Compile: gcc -Wall fakedvr.c -o fakedvr
+//
+// Stand-in for a Zmodo DVR, for load testing zmodopipe without cameras.
+// Answers the login and stream request zmodopipe sends and replays a raw
+// H.264 (Annex-B) file to every channel in the request's mask, one DVR
+// message per picture, looping at the end of the file.
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define MAX_CHANNELS 32		// one bit each in the stream request mask
+#define HDR_SIZE 24
+#define REQUEST_SIZE 4096	// largest request message accepted
+#define TYPE_LOGIN 0x0101	// bytes 8-9 of the first login packet
+#define TYPE_SETUP 0x0403	// bytes 8-9 of the second login packet
+#define TYPE_STREAM 0x0201	// bytes 8-9 of the stream request
+#define TYPE_MEDIA 0x0002	// what the stream is sent as
+
+struct globalArgs_t {
+    bool verbose;		// -v
+    unsigned short port;	// -p port to listen on
+    char *filename;		// -f H.264 file to replay
+    double fps;			// -r pictures per second per channel
+    int kbps;			// -k bitrate per channel, paces by size instead of -r
+    char *keyLog;		// -l append "channel seconds" for every keyframe sent
+} globalArgs;
+
+// A picture in the file: its NALs, including any SPS/PPS/SEI in front
+struct frame_t {
+    size_t offset;
+    size_t len;
+    bool key;
+};
+
+const unsigned char *g_file;
+size_t g_fileLen;
+struct frame_t *g_frames;
+int g_frameCount;
+int g_keyLogFd = -1;
+
+void display_usage(char *name)
+{
+    printf("Usage: %s -f <file.h264> [options]\n\n", name);
+    printf("Where [options] is one of:\n\n"
+           "    -f <file>\tRaw H.264 file to replay to every requested channel\n"
+           "    -p <int>\tPort to listen on (default 9000)\n"
+           "    -r <float>\tPictures per second per channel (default 25)\n"
+           "    -k <int>\tkbit/s per channel, pictures are paced by size instead of -r\n"
+           "    -l <file>\tAppend \"channel time\" to <file> for every keyframe sent\n"
+           "    -v\t\tVerbose output\n"
+           "\n");
+}
+
+int printMessage(bool verbose, const char *message, ...)
+{
+    int ret = 0;
+    va_list argptr;
+    
+    if( verbose && !globalArgs.verbose )
+        return 0;
+    
+    va_start(argptr, message);
+    printf("fakedvr %i: ", (int)getpid());
+    ret = vprintf(message, argptr);
+    va_end(argptr);
+    fflush(stdout);
+    return ret;
+}
+
+static uint32_t readLE32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void writeLE32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void makeHeader(unsigned char *hdr, unsigned int type, int channel, uint32_t bodyLen)
+{
+    memset(hdr, 0, HDR_SIZE);
+    memset(hdr, 0x31, 4);
+    writeLE32(hdr + 4, bodyLen + HDR_SIZE - 8);
+    hdr[8] = type & 0xff;
+    hdr[9] = (type >> 8) & 0xff;
+    writeLE32(hdr + 12, channel);
+    writeLE32(hdr + 16, 1);
+    writeLE32(hdr + 20, bodyLen);
+}
+
+// Split the file into pictures. A picture starts at the first non-VCL NAL
+// after a slice, or at a slice whose first_mb_in_slice is 0 unless only
+// non-VCL NALs came before it.
+int indexFrames(void)
+{
+    size_t pos, nalStart;
+    int size = 0;
+    bool haveSlice = false;	// Current picture has a slice already
+    
+    g_frameCount = 0;
+    
+    for( pos = 0; pos + 4 < g_fileLen; pos++ )
+    {
+        int nalType;
+        bool vcl, starts;
+        
+        if( g_file[pos] || g_file[pos+1] || g_file[pos+2] != 1 )
+            continue;
+        
+        nalStart = (pos > 0 && !g_file[pos-1]) ? pos - 1 : pos;
+        nalType = g_file[pos+3] & 0x1f;
+        vcl = (nalType >= 1 && nalType <= 5);
+        starts = haveSlice && (!vcl || (g_file[pos+4] & 0x80));
+        
+        if( starts || !g_frameCount )
+        {
+            if( g_frameCount == size )
+            {
+                size = size ? size * 2 : 1024;
+                g_frames = realloc(g_frames, size * sizeof(*g_frames));
+                if( !g_frames )
+                    return -1;
+            }
+            if( g_frameCount )
+                g_frames[g_frameCount-1].len = nalStart - g_frames[g_frameCount-1].offset;
+            g_frames[g_frameCount].offset = g_frameCount ? nalStart : 0;
+            g_frames[g_frameCount].key = false;
+            g_frameCount++;
+            haveSlice = false;
+        }
+        
+        if( nalType == 5 || nalType == 7 )
+            g_frames[g_frameCount-1].key = true;
+        if( vcl )
+            haveSlice = true;
+        pos += 3;
+    }
+    
+    if( !g_frameCount )
+        return -1;
+    
+    g_frames[g_frameCount-1].len = g_fileLen - g_frames[g_frameCount-1].offset;
+    return 0;
+}
+
+static int sendAll(int sockFd, struct iovec *iov, int count)
+{
+    ssize_t sent;
+    
+    while( count > 0 )
+    {
+        sent = writev(sockFd, iov, count);
+        if( sent == -1 )
+        {
+            if( errno == EINTR )
+                continue;
+            return -1;
+        }
+        
+        while( count > 0 && (size_t)sent >= iov->iov_len )
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if( count > 0 )
+        {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+static int sendReply(int sockFd, unsigned int type)
+{
+    unsigned char msg[HDR_SIZE + 8];
+    struct iovec iov = { msg, sizeof(msg) };
+    
+    makeHeader(msg, type, 0, 8);
+    memset(msg + HDR_SIZE, 0, 8);
+    return sendAll(sockFd, &iov, 1);
+}
+
+// Read requests until the stream request, answering the login packets.
+// Returns the channel mask, or 0 if the client went away. The same file is
+// replayed whichever stream is asked for, 'subMask' is only reported.
+uint32_t readLogin(int sockFd, uint32_t *subMask)
+{
+    unsigned char buf[REQUEST_SIZE];
+    size_t have = 0;
+    ssize_t got;
+    
+    while( (got = recv(sockFd, buf + have, sizeof(buf) - have, 0)) > 0 )
+    {
+        have += got;
+        
+        while( have >= HDR_SIZE )
+        {
+            size_t msgLen = readLE32(buf + 4) + 8;
+            unsigned int type = buf[8] | (buf[9] << 8);
+            
+            if( readLE32(buf) != 0x31313131 || msgLen < HDR_SIZE || msgLen > sizeof(buf) )
+            {
+                printMessage(false, "Bad request, dropping client\n");
+                return 0;
+            }
+            if( have < msgLen )
+                break;
+            
+            if( type == TYPE_STREAM )
+            {
+                *subMask = (msgLen >= 44) ? readLE32(buf + 40) : 0;
+                return (msgLen >= 40) ? readLE32(buf + 36) : 0;
+            }
+            
+            if( (type == TYPE_LOGIN || type == TYPE_SETUP) && sendReply(sockFd, type) != 0 )
+                return 0;
+            
+            memmove(buf, buf + msgLen, have - msgLen);
+            have -= msgLen;
+        }
+    }
+    return 0;
+}
+
+static void logKeyframe(int channel, const struct timespec *ts)
+{
+    char line[64];
+    int len;
+    
+    if( g_keyLogFd == -1 )
+        return;
+    
+    // One write() per line keeps lines from several clients whole
+    len = snprintf(line, sizeof(line), "%i %lld.%06ld\n", channel+1, (long long)ts->tv_sec, ts->tv_nsec / 1000);
+    if( write(g_keyLogFd, line, len) != len )
+        perror("Failed to log keyframe\n");
+}
+
+static void addTime(struct timespec *ts, double seconds)
+{
+    long nsec = (long)(seconds * 1e9);
+    
+    ts->tv_sec += nsec / 1000000000L;
+    ts->tv_nsec += nsec % 1000000000L;
+    if( ts->tv_nsec >= 1000000000L )
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+void serveClient(int sockFd)
+{
+    unsigned char hdrs[MAX_CHANNELS][HDR_SIZE];
+    struct iovec iov[MAX_CHANNELS * 2];
+    struct timespec next, now;
+    uint32_t mask, subMask = 0;
+    int channels[MAX_CHANNELS];
+    int chCount = 0;
+    int frameIdx, loopIdx, n;
+    
+    mask = readLogin(sockFd, &subMask);
+    if( !mask )
+        return;
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        if( mask & (1u << loopIdx) )
+            channels[chCount++] = loopIdx;
+    }
+    
+    printMessage(false, "Streaming channel mask 0x%x, sub stream 0x%x\n", mask, subMask & mask);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    
+    for( frameIdx = 0; ; frameIdx = (frameIdx + 1) % g_frameCount )
+    {
+        const struct frame_t *frame = &g_frames[frameIdx];
+        
+        // All channels get the picture in one writev()
+        for( loopIdx=0, n=0;loopIdx<chCount;loopIdx++ )
+        {
+            makeHeader(hdrs[loopIdx], TYPE_MEDIA, channels[loopIdx], frame->len);
+            iov[n].iov_base = hdrs[loopIdx];
+            iov[n++].iov_len = HDR_SIZE;
+            iov[n].iov_base = (void*)(g_file + frame->offset);
+            iov[n++].iov_len = frame->len;
+        }
+        
+        if( frame->key && g_keyLogFd != -1 )
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            for( loopIdx=0;loopIdx<chCount;loopIdx++ )
+                logKeyframe(channels[loopIdx], &now);
+        }
+        
+        if( sendAll(sockFd, iov, n) != 0 )
+        {
+            printMessage(false, "Client went away\n");
+            return;
+        }
+        
+        if( globalArgs.kbps )
+            addTime(&next, frame->len * 8.0 / (globalArgs.kbps * 1000.0));
+        else
+            addTime(&next, 1.0 / globalArgs.fps);
+        
+        while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR );
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr;
+    struct stat st;
+    int listenFd, sockFd, fd;
+    int flag = true;
+    int opt;
+    
+    globalArgs.port = 9000;
+    globalArgs.fps = 25;
+    
+    while( (opt = getopt(argc, argv, "vp:f:r:k:l:h?")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'v':
+                globalArgs.verbose = true;
+                break;
+            case 'p':
+                globalArgs.port = atoi(optarg);
+                break;
+            case 'f':
+                globalArgs.filename = optarg;
+                break;
+            case 'r':
+                globalArgs.fps = atof(optarg);
+                break;
+            case 'k':
+                globalArgs.kbps = atoi(optarg);
+                break;
+            case 'l':
+                globalArgs.keyLog = optarg;
+                break;
+            default:
+                display_usage(argv[0]);
+                return 0;
+        }
+    }
+    
+    if( !globalArgs.filename || globalArgs.fps <= 0 || globalArgs.kbps < 0 )
+    {
+        display_usage(argv[0]);
+        return 1;
+    }
+    
+    fd = open(globalArgs.filename, O_RDONLY);
+    if( fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0 )
+    {
+        perror("Failed to open the H.264 file\n");
+        return 1;
+    }
+    
+    g_fileLen = st.st_size;
+    g_file = mmap(NULL, g_fileLen, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( g_file == MAP_FAILED )
+    {
+        perror("Failed to map the H.264 file\n");
+        return 1;
+    }
+    
+    if( indexFrames() != 0 )
+    {
+        printMessage(false, "No H.264 pictures found in %s\n", globalArgs.filename);
+        return 1;
+    }
+    printMessage(false, "%i pictures in %s\n", g_frameCount, globalArgs.filename);
+    
+    if( globalArgs.keyLog )
+    {
+        g_keyLogFd = open(globalArgs.keyLog, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if( g_keyLogFd == -1 )
+            perror("Failed to open the keyframe log\n");
+    }
+    
+    listenFd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag));
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(globalArgs.port);
+    
+    if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0 )
+    {
+        perror("Failed to listen\n");
+        return 1;
+    }
+    
+    signal(SIGCHLD, SIG_IGN);	// Clients are served by children nobody waits for
+    signal(SIGPIPE, SIG_IGN);
+    
+    while( 1 )
+    {
+        sockFd = accept(listenFd, NULL, NULL);
+        if( sockFd == -1 )
+        {
+            if( errno != EINTR )
+                perror("accept failed\n");
+            continue;
+        }
+        
+        printMessage(true, "Client connected\n");
+        
+        if( fork() == 0 )
+        {
+            close(listenFd);
+            setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag));
+            serveClient(sockFd);
+            close(sockFd);
+            _exit(0);
+        }
+        close(sockFd);
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+// Compile: gcc -O2 -Wall nalbench.c -o nalbench
+//
+// Microbenchmark for the start code scanner in nalscan.h. Each H.264 file is
+// scanned with every implementation this CPU has, in one piece and in
+// recv()-sized chunks the way zmodopipe feeds it, and the rate is reported
+// next to what a 1 Gbit/s link delivers. Every way has to find the same start
+// codes as a plain byte-at-a-time loop, or the run fails.
+//
+//     nalbench [-c chunk] [-t seconds] file.h264 ...
+//
+// Without files a synthetic stream is made up: random payload with about
+// one picture's worth of bytes between start codes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "nalscan.h"
+
+#define CHUNK_DEFAULT 2048	// zmodopipe's recvBuf
+#define SYNTHETIC_SIZE (64 * 1024 * 1024)
+#define LINK_BYTES_PER_SEC (1e9 / 8)
+
+struct bench_t {
+    const char *name;
+    uint64_t (*count)(const unsigned char *data, size_t len, int chunk);
+};
+
+int g_chunk = CHUNK_DEFAULT;
+double g_seconds = 1;
+
+static double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What the stream stages did before nalscan.h, one byte at a time
+static uint64_t countBytewise(const unsigned char *data, size_t len, int chunk)
+{
+    uint64_t found = 0;
+    int zeros = 0;
+    size_t i;
+    
+    for( i=0;i<len;i++ )
+    {
+        if( data[i] == 0x00 )
+        {
+            if( zeros < 3 )
+                zeros++;
+            continue;
+        }
+        if( data[i] == 0x01 && zeros >= 2 )
+            found++;
+        zeros = 0;
+    }
+    return found;
+}
+
+// The whole file in one go with one of the scanners
+static uint64_t countWith(int (*find)(const unsigned char*, int, int), const unsigned char *data, size_t len)
+{
+    uint64_t found = 0;
+    int i;
+    
+    for( i=0;(i = find(data, i, (int)len)) < (int)len;i++ )
+        found++;
+    return found;
+}
+
+static uint64_t countScalar(const unsigned char *data, size_t len, int chunk)
+{
+    return countWith(nalScanScalar, data, len);
+}
+
+#ifdef NALSCAN_X86
+static uint64_t countSse2(const unsigned char *data, size_t len, int chunk)
+{
+    return countWith(nalScanSse2, data, len);
+}
+
+static uint64_t countAvx2(const unsigned char *data, size_t len, int chunk)
+{
+    return countWith(nalScanAvx2, data, len);
+}
+#endif
+
+// nalScan() on recv()-sized chunks, carrying the zeros between them
+static uint64_t countChunked(const unsigned char *data, size_t len, int chunk)
+{
+    uint64_t found = 0;
+    size_t pos;
+    int zeros = 0;
+    int n, i;
+    
+    for( pos=0;pos<len;pos+=n )
+    {
+        n = (len - pos < (size_t)chunk) ? (int)(len - pos) : chunk;
+        for( i=0;(i = nalScan(data + pos, i, n, &zeros)) < n;i++ )
+        {
+            found++;
+            zeros = 0;
+        }
+    }
+    return found;
+}
+
+static void runFile(const char *name, const unsigned char *data, size_t len)
+{
+    struct bench_t benches[] = {
+        { "byte at a time", countBytewise },
+        { "scalar", countScalar },
+#ifdef NALSCAN_X86
+        { "SSE2", countSse2 },
+        { "AVX2", countAvx2 },
+#endif
+        { "nalScan() chunked", countChunked },
+    };
+    uint64_t expect = 0, found;
+    double start, elapsed, rate;
+    char label[64];
+    int loopIdx, runs;
+    
+    printf("%s: %.1f MB\n", name, len / 1e6);
+    
+    for( loopIdx=0;loopIdx<(int)(sizeof(benches) / sizeof(benches[0]));loopIdx++ )
+    {
+#ifdef NALSCAN_X86
+        if( benches[loopIdx].count == countAvx2 && !__builtin_cpu_supports("avx2") )
+            continue;
+#endif
+        
+        start = now();
+        runs = 0;
+        do
+        {
+            found = benches[loopIdx].count(data, len, g_chunk);
+            runs++;
+            elapsed = now() - start;
+        }
+        while( elapsed < g_seconds );
+        
+        if( loopIdx == 0 )
+            expect = found;
+        else if( found != expect )
+        {
+            printf("    %s found %llu start codes instead of %llu\n", benches[loopIdx].name, (unsigned long long)found, (unsigned long long)expect);
+            exit(1);
+        }
+        
+        rate = (double)len * runs / elapsed;
+        if( benches[loopIdx].count == countChunked )
+            snprintf(label, sizeof(label), "%s (%i)", benches[loopIdx].name, g_chunk);
+        else
+            snprintf(label, sizeof(label), "%s", benches[loopIdx].name);
+        printf("    %-24s %7.2f GB/s  %6.0fx 1 Gbit/s  %llu start codes\n", label, rate / 1e9, rate / LINK_BYTES_PER_SEC, (unsigned long long)found);
+    }
+}
+
+// Random bytes with a start code and NAL header every few KB, and the odd
+// zero run the way CABAC data has them
+static unsigned char *makeSynthetic(size_t len)
+{
+    unsigned char *data = malloc(len);
+    size_t pos = 0;
+    
+    if( !data )
+        return NULL;
+    
+    srand(1);
+    while( pos < len )
+    {
+        data[pos++] = rand() & 0xff;
+        if( data[pos-1] == 0x00 && pos < len && (rand() & 3) == 0 )
+            data[pos++] = 0x00;
+        if( (rand() % 6000) == 0 && pos + 5 < len )
+        {
+            memcpy(data + pos, "\x00\x00\x00\x01\x41", 5);
+            pos += 5;
+        }
+    }
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    struct stat st;
+    unsigned char *data;
+    int opt, fd;
+    
+    while( (opt = getopt(argc, argv, "c:t:h?")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'c':
+                g_chunk = atoi(optarg);
+                break;
+            case 't':
+                g_seconds = atof(optarg);
+                break;
+            default:
+                printf("Usage: %s [-c chunk] [-t seconds] [file.h264 ...]\n", argv[0]);
+                return 1;
+        }
+    }
+    
+    if( g_chunk < 1 || g_seconds <= 0 )
+    {
+        printf("Usage: %s [-c chunk] [-t seconds] [file.h264 ...]\n", argv[0]);
+        return 1;
+    }
+    
+    if( optind == argc )
+    {
+        data = makeSynthetic(SYNTHETIC_SIZE);
+        if( !data )
+            return 1;
+        runFile("synthetic", data, SYNTHETIC_SIZE);
+        free(data);
+        return 0;
+    }
+    
+    for( ;optind<argc;optind++ )
+    {
+        fd = open(argv[optind], O_RDONLY);
+        if( fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0 )
+        {
+            perror(argv[optind]);
+            return 1;
+        }
+        if( st.st_size > INT_MAX )
+        {
+            printf("%s: Files over 2 GB aren't supported\n", argv[optind]);
+            return 1;
+        }
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if( data == MAP_FAILED )
+        {
+            perror(argv[optind]);
+            return 1;
+        }
+        runFile(argv[optind], data, st.st_size);
+        munmap(data, st.st_size);
+    }
+    return 0;
+}
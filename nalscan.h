@@ -0,0 +1,133 @@
+// Annex-B start code scanner, shared by zmodopipe and nalbench.
+//
+// nalScan() looks for the next 00 00 01 in a chunk of H.264. The zero bytes
+// the chunk ended with are carried over, so a start code may be split across
+// recv() chunks:
+//
+//     int zeros = 0;			// Kept with the rest of the stream state
+//     int i = 0;
+//
+//     while( (i = nalScan(data, i, len, &zeros)) < len )
+//     {
+//         ...				// data[i] is the 0x01, zeros is 2 or 3
+//         zeros = 0;
+//         i++;				// The NAL header, if it is in this chunk
+//     }
+//
+// x86-64 compares 16 bytes at a time with SSE2, or 32 with AVX2 on CPUs that
+// have it. Anything else gets a scalar loop that looks at every third byte.
+
+#ifndef NALSCAN_H
+#define NALSCAN_H
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NALSCAN_X86
+#endif
+
+// Index of the 0x01 of the first start code wholly inside data[from..len), or len
+static inline int nalScanScalar(const unsigned char *data, int from, int len)
+{
+    int j = from;		// First byte of the three being looked at
+    
+    // A byte above 1 can't be in a start code, so none ends in the next three
+    while( j + 2 < len )
+    {
+        if( data[j+2] > 1 )
+            j += 3;
+        else if( data[j+2] == 1 && data[j+1] == 0 && data[j] == 0 )
+            return j + 2;
+        else
+            j++;
+    }
+    return len;
+}
+
+#ifdef NALSCAN_X86
+static inline int nalScanSse2(const unsigned char *data, int from, int len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a, b, c;
+    int j, mask;
+    
+    for( j=from;j + 2 + 16 <= len;j+=16 )
+    {
+        a = _mm_loadu_si128((const __m128i*)(data + j));
+        b = _mm_loadu_si128((const __m128i*)(data + j + 1));
+        c = _mm_loadu_si128((const __m128i*)(data + j + 2));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)), _mm_cmpeq_epi8(c, one)));
+        if( mask )
+            return j + __builtin_ctz(mask) + 2;
+    }
+    return nalScanScalar(data, j, len);
+}
+
+__attribute__ ((target("avx2")))
+static inline int nalScanAvx2(const unsigned char *data, int from, int len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i a, b, c;
+    int j;
+    unsigned int mask;
+    
+    for( j=from;j + 2 + 32 <= len;j+=32 )
+    {
+        a = _mm256_loadu_si256((const __m256i*)(data + j));
+        b = _mm256_loadu_si256((const __m256i*)(data + j + 1));
+        c = _mm256_loadu_si256((const __m256i*)(data + j + 2));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)), _mm256_cmpeq_epi8(c, one)));
+        if( mask )
+            return j + __builtin_ctz(mask) + 2;
+    }
+    return nalScanSse2(data, j, len);
+}
+#endif
+
+// Best of the above for this CPU
+static inline int nalScanFind(const unsigned char *data, int from, int len)
+{
+#ifdef NALSCAN_X86
+    if( __builtin_cpu_supports("avx2") )
+        return nalScanAvx2(data, from, len);
+    return nalScanSse2(data, from, len);
+#else
+    return nalScanScalar(data, from, len);
+#endif
+}
+
+// Zero bytes right in front of data[end], at most 3. 'zeros' came before data[from].
+static inline int nalScanZeros(const unsigned char *data, int from, int end, int zeros)
+{
+    int n = 0;
+    
+    while( n < 3 && end - n > from && data[end - n - 1] == 0x00 )
+        n++;
+    if( end - n == from )
+        n += zeros;
+    return (n < 3) ? n : 3;
+}
+
+// Find the next start code in data[from..len). Returns the index of its 0x01
+// with *zeros set to the zero bytes in front of it (2 or 3), or len with
+// *zeros set to those the chunk ends with, for the next call.
+static inline int nalScan(const unsigned char *data, int from, int len, int *zeros)
+{
+    int end;
+    
+    // The first two bytes may finish one begun in the previous chunk
+    if( from < len && data[from] == 0x01 && *zeros >= 2 )
+        return from;
+    if( from + 1 < len && data[from+1] == 0x01 && data[from] == 0x00 && *zeros >= 1 )
+    {
+        *zeros = (*zeros < 2) ? 2 : 3;
+        return from + 1;
+    }
+    
+    end = nalScanFind(data, from, len);
+    *zeros = nalScanZeros(data, from, end, *zeros);
+    return end;
+}
+
+#endif
@@ -0,0 +1,74 @@
+// Compile: gcc -Wall ringcat.c -o ringcat
+//
+// Copies a channel's H.264 from the shared-memory ring of zmodopipe -q to
+// stdout, starting at the latest keyframe. Any number can run at once:
+//
+//     ringcat 1 | ffmpeg -f h264 -i - ...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include "zmodoring.h"
+
+int main(int argc, char **argv)
+{
+    struct zmRing_t ring;
+    struct zmFrame_t frame;
+    bool verbose = false;
+    int channel, ret;
+    
+    if( argc > 2 && strcmp(argv[1], "-v") == 0 )
+    {
+        verbose = true;
+        argv++;
+        argc--;
+    }
+    
+    if( argc != 2 || (channel = atoi(argv[1])) < 1 )
+    {
+        fprintf(stderr, "Usage: %s [-v] <channel>\n", argv[0]);
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_DFL);
+    
+    while( zmRingOpen(&ring, channel) != 0 )
+    {
+        if( verbose )
+            perror("Waiting for the ring");
+        sleep(1);
+    }
+    
+    while( 1 )
+    {
+        ret = zmRingNext(&ring, &frame);
+        
+        if( ret == 0 )
+        {
+            // Gone means zmodopipe was restarted with another ring size
+            if( zmRingWait(&ring, 1000) == -1 )
+            {
+                zmRingClose(&ring);
+                while( zmRingOpen(&ring, channel) != 0 )
+                    sleep(1);
+            }
+            continue;
+        }
+        
+        if( ret == -1 )
+        {
+            if( verbose )
+                fprintf(stderr, "Fell behind, skipping to the latest keyframe\n");
+            continue;
+        }
+        
+        // Written straight from the ring, so a slow stdout can let the writer catch up
+        if( fwrite(frame.data, 1, frame.len, stdout) != frame.len )
+            return 1;
+        if( !zmRingValid(&ring, &frame) && verbose )
+            fprintf(stderr, "Frame %llu was overwritten while being copied\n", (unsigned long long)frame.seq);
+        fflush(stdout);
+    }
+    return 0;
+}
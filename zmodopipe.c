@@ -1,4 +1,8 @@
-// Compile: gcc -Wall zmodopipe.c -o zmodopipe
+// Compile: gcc -Wall zmodopipe.c -o zmodopipe -pthread
+// With the built-in snapshot engine (-j):
+//          gcc -Wall -DBUILTIN_SNAPSHOT zmodopipe.c -o zmodopipe -lavcodec -lavutil -lswscale -ljpeg -pthread
+
+#define _GNU_SOURCE		// splice(), pipe2()
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,29 +25,652 @@
 #include <stdarg.h>
 #include <time.h>
 #include <utime.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include "zmodoring.h"
+#include "nalscan.h"
+#ifdef BUILTIN_SNAPSHOT
+#include <setjmp.h>
+#include <sys/eventfd.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <jpeglib.h>
+#endif
 
 
 
-#define MAX_CHANNELS 8		// maximum channels to support (I've only seen max of 16).
+#define MAX_CHANNELS 256	// maximum channels to support, across every DVR in the -C file
+#define DVR_CHANNELS 32		// channels per DVR, one bit each in the stream request mask
+#define MAX_DVRS 64		// DVRs in the -C file
+#define CONFIG_WORKERS_MAX 64	// -C worker processes
+#define MAX_CONNS (2 * MAX_CHANNELS)	// DVR connections, a -S channel can have one for each stream
+#define MAX_EVENTS 32		// epoll events handled per wakeup in event loop mode
+#define MAX_RECV_BURST 16	// recv() calls per channel per wakeup, keeps one busy camera from starving the rest
+#define SPLICE_CHUNK 65536	// bytes moved per splice() call, the default pipe capacity
+#define NAL_PARAM_MAX 256	// largest SPS/PPS kept for replay in front of keyframes
+#define WATCHDOG_INTERVAL 1	// seconds between output health checks
+#define SNAPSHOT_WIDTH 390	// JPEG size, same as ffmpeg's -s 390x220
+#define SNAPSHOT_HEIGHT 220
+#define SNAPSHOT_PERIOD 2	// seconds between JPEGs, same as ffmpeg's -r 1/2
+#define SNAPSHOT_QUALITY 75
+#define SNAPSHOT_MAX_SIZE (4 * 1024 * 1024)	// Larger files from ffmpeg aren't taken as JPEGs
+#define SNAPSHOT_MAX_PICTURE (4 * 1024 * 1024)	// larger keyframes are skipped
+#define SNAPSHOT_WORKERS_DEFAULT 4	// -j decoder threads when -y isn't given, fewer on smaller hosts
+#define SNAPSHOT_WORKERS_MAX 16
+#define RING_SIZE_DEFAULT 1024	// KB of stream queued per channel while ffmpeg catches up
+#define RING_SIZE_MIN 32	// KB, the largest chunk queued at once (a -f receive buffer) has to fit
+#define RING_MAX_FRAMES 1024	// frame starts remembered per ring, older ones are forgotten
+#define FILTER_BUF_SIZE (2048 + 2 * (NAL_PARAM_MAX + 4) + 64)	// recvBuf plus room for inserted SPS/PPS
+#define DVR_HDR_SIZE 24		// Every message starts with this header
+#define DVR_MAX_MESSAGE (4 * 1024 * 1024)	// Larger lengths mean we lost sync with the stream
+#define DVR_SYNC_LIMIT 65536	// Bytes without a header before the stream is taken to be bare H.264
+#define DVR_LOGIN_REPLIES 2	// Messages the DVR answers the login with, ahead of the stream
+#define CONNECT_TIMEOUT 5	// seconds allowed for each connection attempt
+#define STREAM_TIMEOUT 10	// seconds without data before the connection is dropped
+#define BACKOFF_MAX 30		// longest wait between connection attempts
+#define STATS_INTERVAL 5	// seconds between rewrites of the -m metrics file
+#define RECORD_SEGMENT_SIZE (64 * 1024 * 1024)	// -r starts a new file at the first keyframe past this size
+#define RECORD_SEGMENTS_DEFAULT 24	// -r files kept per channel, the oldest is overwritten
+#define RECORD_WRITE_SIZE (256 * 1024)	// -r data is written in blocks of this size
+#define HTTP_MAX_CLIENTS 64	// -w viewers served at once
+#define HTTP_RING_DEFAULT 4096	// KB of frames kept per channel for -w when -q isn't given
+#define HTTP_REQUEST_TIMEOUT 10	// seconds a -w viewer has to send its request
+#define HTTP_SNDBUF (256 * 1024)	// Socket buffer per viewer, the backlog beyond it is kept in the ring
+#define HTTP_SKIPS_MAX 4	// times a viewer is moved to the latest keyframe in one go
+#define ACTIVITY_THRESHOLD 200	// P-frames this % of the quiet level count as motion
+#define ACTIVITY_FLOOR 1024	// bytes, P-frames of a static scene are taken to be at least this big
+#define ACTIVITY_WARMUP 25	// P-frames scored before a channel can be taken to be static
+#define ACTIVITY_HOLD 10	// seconds a channel stays active after the last motion
+#define ACTIVITY_IDLE_PERIOD 20	// seconds between JPEGs of a static scene with -l, under the watchdog's 30
+#define ACTIVITY_SNAPSHOT_PERIOD 1	// seconds between JPEGs while there is motion with -l
+#define HANDOFF_MAGIC 0x334f485a	// "ZHO3", changed whenever struct handoffMsg_t is
+#define HANDOFF_TIMEOUT 2	// seconds to bring the streams to a message boundary for -i
+#define HANDOFF_MAX (MAX_CONNS + MAX_CHANNELS + 2)	// Messages in a handoff: connections, channels, -w socket
+#define URING_ENTRIES 256	// -f submission queue entries, a receive and two writes per channel at most
+#define URING_CQ_ENTRIES 4096	// -f completions queued before the kernel holds them back
+#define URING_PIPE_CHUNK 65536	// -f bytes in flight to each pipe, the default pipe capacity
+#define URING_BUF_COUNT 256	// -f receive buffers shared by every camera socket, a power of two
+#define URING_BUF_SIZE 16384
+#define LOG_SLOTS 1024		// Messages queued for the log writer thread, a power of two
+#define LOG_LINE 240		// Longer messages are cut
+#define LOG_FLUSH_MS 50		// How often the log writer wakes up
+#define LOG_RATE_EVENTS 256	// Messages tracked for rate limiting, by call site and channel
+#define LOG_RATE_BURST 10	// Copies of a message printed per LOG_RATE_PERIOD, the rest are counted
+#define LOG_RATE_PERIOD 10	// seconds
+#define BATCH_CHUNK 2048		// -d data is fed through the pipeline in pieces the size of a recv()
+#define BATCH_MAX_FLOWS 64	// TCP connections from the DVR followed per pcap file
+#define TS_PACKET_SIZE 188
+#define TS_PID_PMT 0x1000
+#define TS_PID_VIDEO 0x100
 
 struct globalArgs_t {
     bool verbose;			// -v duh
+    bool eventLoop;			// -e run all channels from a single process
+    bool zeroCopy;			// -z splice() socket data into the pipe
+    int keyframeInterval;		// -k only pass every Nth keyframe to ffmpeg (0 = pass everything)
+    bool builtinSnapshot;		// -j decode and write JPEGs in-process instead of running ffmpeg
+    int snapshotWorkers;		// -y threads decoding -j keyframes in event loop mode (-1 = one per core, 0 = none)
+    int ringSize;			// -b KB queued per channel when ffmpeg falls behind (0 = discard)
+    bool multiplex;			// -x stream every channel over one DVR connection
+    char *statsFile;			// -m write per-channel metrics here in Prometheus text format
+    char *recordDir;			// -r record each channel's H.264 into this directory
+    int recordSegments;			// -g number of recording files kept per channel
+    int frameRingSize;			// -q KB of each channel's frames published in shared memory (0 = off)
+    unsigned short httpPort;		// -w serve the channels to HTTP viewers on this port
+    bool adaptiveSnapshot;		// -l JPEGs follow the activity score, fast with motion and slow without
+    bool eventRecord;			// -o only record while there is motion
+    char *handoffPath;			// -i Unix socket to take over from and hand over to another instance
+    bool uring;				// -f receive and write through io_uring
+    char *batchDir;			// -d process capture files instead of a DVR, writing under this directory
+    char *configFile;			// -C read the DVRs and channels from this file
+    int workers;			// -C "workers": processes the DVRs are shared out between (0 = one per core)
+    char *pipeDir;			// -C "pipes": where the FIFOs to ffmpeg are made
     bool channel[MAX_CHANNELS];
     char *hostname;			// -s hostname to connect to
     unsigned short port;		// -p port number
 } globalArgs = {0};
 
 extern char *optarg;
-const char *optString = "vn:c:p:s:m:u:a:t:h?";
+const char *optString = "evxzjlofC:S:d:i:y:k:b:m:r:g:q:w:n:c:p:s:u:a:t:h?";
 int g_childPids[MAX_CHANNELS] = {0};
 int g_cleanUp = false;
 char g_errBuf[256];	// This will contain the error message for perror calls
 int g_processCh = -1;	// Channel this process will be in charge of (-1 means parent)
+int g_worker = -1;	// -C worker this process is, -1 if it isn't one
+pid_t g_workerParent;	// The -C parent, its pid goes into the workers' FIFO names
+
+// A DVR from the -C file, or the one given with -s and -p
+struct dvr_t {
+    char host[128];
+    unsigned short port;
+    struct sockaddr_in addr;
+    int channels;		// Channels streamed from it
+    int worker;			// -C worker streaming it
+};
+
+// Where a channel comes from and where its JPEG goes. Channels are numbered
+// across all the DVRs, in the order the -C file lists them.
+struct chConfig_t {
+    bool streamed;		// By this process or another worker, globalArgs.channel is this one's share
+    int dvr;			// Index into g_dvrs
+    int dvrChannel;		// Zero based channel on that DVR
+    bool sub;			// -S: snapshots from the DVR's sub stream
+    char jpeg[200];		// Where the JPEG goes, "" for /var/www/html/<channel>.jpg
+    char size[16];		// ffmpeg's -s, "" for 390x220
+};
+
+struct dvr_t g_dvrs[MAX_DVRS];
+int g_dvrCount = 0;
+struct chConfig_t g_chConfig[MAX_CHANNELS];
+cpu_set_t g_cpusAllowed;	// CPUs there were before a worker pinned itself, ffmpeg gets them back
+
+// Annex-B scanner used by -k. Only IDR pictures get through, each one
+// preceded by the most recent SPS and PPS. State carries over between
+// calls so start codes and NAL units may be split across recv() chunks.
+struct nalFilter_t {
+    int zeros;			// Zero bytes seen but not written yet, may be the start of a start code
+    int nalType;		// Type of the NAL being scanned, -1 before the first start code, -2 awaiting header
+    int nalBytes;		// Bytes of the current NAL seen so far
+    unsigned char nalHeader;
+    bool forward;		// Current NAL is being passed on
+    bool passPicture;		// Current IDR picture was selected
+    bool inPicture;		// Slices of a passed picture are being written
+    int pictureEnd;		// Output offset where a passed picture ended in the last call, -1 if none
+    int capture;		// 7 or 8 while copying a SPS/PPS into captureBuf
+    int captureLen;
+    unsigned char captureBuf[NAL_PARAM_MAX];
+    int spsLen;
+    int ppsLen;
+    unsigned char sps[NAL_PARAM_MAX];
+    unsigned char pps[NAL_PARAM_MAX];
+    unsigned int keyframes;	// IDR pictures seen
+    unsigned int interval;	// Pass every Nth IDR picture
+    bool hold;			// Pass no IDR pictures for now (-l on a static scene)
+    int overflow;		// Bytes of passed NALs that didn't fit in 'out' during the last call
+};
+
+#ifdef BUILTIN_SNAPSHOT
+// In-process replacement for the ffmpeg child (-j). The keyframe filter hands
+// over whole IDR pictures, which are decoded with libavcodec, scaled with
+// libswscale and compressed with libjpeg(-turbo).
+struct snapshot_t {
+    AVCodecContext *codec;
+    AVPacket *pkt;
+    AVFrame *frame;
+    struct SwsContext *sws;
+    unsigned char *rgb;		// Scaled picture, SNAPSHOT_WIDTH x SNAPSHOT_HEIGHT RGB24
+    unsigned char *picture;	// Keyframe being collected from the filter
+    int pictureLen;
+    int pictureSize;
+    time_t nextJpeg;		// Keyframes before this time aren't decoded
+    // Handed between the event loop and the -y workers under g_snapPool.lock
+    unsigned char *pending;	// Newest keyframe waiting for a worker, swapped with picture
+    int pendingLen;		// 0 when nothing is waiting
+    int pendingSize;
+    unsigned char *work;	// Keyframe a worker is decoding
+    int workLen;
+    int workSize;
+    int64_t deadline;		// Monotonic microseconds the pending keyframe is due as a JPEG
+    bool busy;			// A worker has the decoder
+    bool reset;			// The worker closes the decoder before its next keyframe
+    struct snapshotJpeg_t *done;	// Made by a worker, published by the event loop
+};
+
+// Threads decoding -j keyframes for the event loop. Each channel has one
+// slot: a newer keyframe replaces one still waiting, and idle workers take
+// the slot with the earliest deadline, so an overloaded host writes JPEGs
+// less often rather than falling further behind.
+struct snapshotPool_t {
+    pthread_t threads[SNAPSHOT_WORKERS_MAX];
+    int workers;		// Running, 0 decodes in the event loop
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool quit;
+    int eventFd;		// Counts JPEGs waiting to be published
+};
+#endif
+
+// A minimal io_uring, driven with the raw system calls
+struct uring_t {
+    int fd;
+    unsigned char *ringMap;	// Both rings, mapped once (IORING_FEAT_SINGLE_MMAP)
+    size_t ringMapSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned sqEntries;
+    unsigned sqNext;		// Tail once the SQEs being filled in are submitted
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+// The -f backend. Every camera socket has a multishot receive, taking
+// buffers from one shared ring, and the event loop polls the io_uring like
+// a socket. The pipe and recording writes the completions produce go out
+// together in one submission at the end of the wakeup.
+struct uringIo_t {
+    bool active;
+    struct uring_t ring;
+    int recordWrites;		// In flight, waited for before exit
+    struct io_uring_buf_ring *bufRing;
+    uint16_t bufTail;
+    unsigned char *bufs;	// URING_BUF_COUNT buffers of URING_BUF_SIZE
+};
+
+struct frameMark_t {
+    uint64_t pos;		// Ring position of the frame's first start code (SPS/PPS/SEI included)
+    bool key;
+};
+
+// Bounded queue between the socket and the pipe. When it fills up whole GOPs
+// are dropped from the front, so the reader never gets half a NAL followed by
+// the middle of another, and after a complete flush the queue refuses data
+// until the next keyframe. Positions count every byte ever queued.
+struct ringBuf_t {
+    unsigned char *data;
+    size_t size;
+    uint64_t head;		// Next byte is queued here
+    uint64_t tail;		// Next byte is written (or dropped) from here
+    struct frameMark_t marks[RING_MAX_FRAMES];	// Oldest first
+    int markFirst;
+    int markCount;
+    bool skipping;		// Waiting for a keyframe before queuing again
+    int zeros;			// Scanner state, as in nalFilter_t
+    int nalType;
+    int nalBytes;
+    uint64_t scStart;		// Position of the last start code
+    uint64_t pendingStart;	// Start of the non-VCL NALs in front of the next picture, 0 if none
+    uint64_t lastKey;		// Start of the latest keyframe queued, replayed by ringRewind(), 0 if none
+    uint64_t lastPicture;	// Start of the latest picture queued
+    uint64_t droppedBytes;
+    uint64_t droppedFrames;
+};
+
+// Continuous recording (-r). The H.264 goes to a ring of preallocated files,
+// <dir>/<channel>-<slot>.h264, each starting with a keyframe. Every keyframe
+// also gets an entry in <dir>/<channel>-<slot>.idx so a clip can be found
+// without scanning the recording.
+struct recorder_t {
+    int fd;			// Segment being written, -1 if none
+    int indexFd;
+    int slot;			// Segment in use, -1 before the first one
+    unsigned char *buf;		// RECORD_WRITE_SIZE bytes, page aligned
+    int bufLen;
+    uint64_t segLen;		// Bytes of the segment written out or queued
+    unsigned char *full;	// -f: a full buffer queued for the next batch of writes
+    int fullLen;		// 0 if none
+    uint64_t fullOff;		// Where it goes in the segment
+    bool fullBusy;		// Submitted, the buffer is the kernel's until it completes
+    uint32_t seq;		// Segments opened so far, tells completions for an earlier one apart
+    bool waiting;		// Nothing is kept until the next keyframe
+    bool keyOpen;		// The last keyframe has had no P slice since
+    bool vclSeen;		// A slice has followed the last keyframe's start
+    int zeros;			// Scanner state, as in nalFilter_t
+    int nalType;
+    int scLen;			// Length of the last start code
+};
+
+// One entry of the .idx file, in host byte order
+struct recordIndex_t {
+    int64_t usec;		// Wall clock time the keyframe arrived, in microseconds
+    uint64_t offset;		// Position of its first start code in the .h264 file
+};
+
+// Writer's side of the channel's shared-memory ring (-q), see zmodoring.h
+struct frameRing_t {
+    struct zmRingHdr_t *hdr;	// NULL when not publishing
+    unsigned char *data;
+    uint64_t next;		// Stream position of the next byte
+    uint64_t start;		// Position of the frame being copied in
+    uint32_t len;
+    bool key;
+    bool active;		// A frame is being copied in
+    int64_t usec;		// Arrival time of the last frame published
+};
+
+// Motion measured without decoding anything (-l, -o). P-frames grow with the
+// amount of change in the picture, so each one is compared with the level the
+// channel sends when nothing moves. Both levels are kept times 8.
+struct activity_t {
+    uint64_t recent;		// Running average of the last few P-frames
+    uint64_t quiet;		// Follows drops at once, rises over about a minute
+    uint64_t frames;		// P-frames scored
+    time_t activeUntil;		// Motion was seen up to ACTIVITY_HOLD seconds before this
+};
+
+// MPEG-TS version of the channel for -w, muxed once into a ring of its own
+struct tsMux_t {
+    struct frameRing_t ring;
+    unsigned char ccPat;	// Continuity counters
+    unsigned char ccPmt;
+    unsigned char ccVideo;
+};
+
+// Per-channel counters. They live in shared memory so the forked channel
+// processes can update theirs while any one of them writes the -m file.
+struct chStats_t {
+    uint64_t bytes;		// Stream bytes received
+    uint64_t frames;		// DVR messages received
+    uint64_t keyframes;
+    uint64_t gop;		// Frames between the last two keyframes
+    uint64_t lastKeyframe;	// Value of frames at the last keyframe
+    uint64_t droppedBytes;	// Discarded because the reader fell behind
+    uint64_t droppedFrames;
+    uint64_t connects;		// Stream requests sent
+    uint64_t ffmpegStarts;
+    uint64_t recordedBytes;	// Written to the -r files
+    int64_t lastSnapshot;	// When a JPEG was last written, 0 if never
+    uint64_t activity;		// Size of the latest P-frames as a % of the quiet level
+    uint64_t snapshotsReplaced;	// -y keyframes replaced by a newer one before a worker took them
+    uint64_t snapshotsLate;	// -y JPEGs finished after their deadline
+} __attribute__ ((aligned(64)));	// Own cache line, one writer each
+
+struct statsShm_t {
+    int64_t nextWrite;		// When the -m file is due, claimed with a CAS
+    struct chStats_t ch[MAX_CHANNELS];
+};
+
+// One writer per channel (its process, or the event loop), so a relaxed load
+// and store is enough and the hot path never takes a lock or a locked add
+static inline void statsAdd(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t statsGet(uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// State of a DVR connection when driven by the event loop (-e)
+enum chState_t {
+    CH_WAITING,			// Idle until retryTime, then connect
+    CH_CONNECTING,		// Non-blocking connect in progress
+    CH_STREAMING		// Login and stream request sent, relaying data to ffmpeg
+};
+
+// A published JPEG, shared by the channel and the -w viewers still being sent it
+struct snapshotJpeg_t {
+    int refs;
+    size_t len;
+    char etag[24];		// Quoted hash of the contents
+    unsigned char data[];
+};
+
+struct channel_t {
+    int index;			// Zero based channel number
+    int dvrChannel;		// Zero based channel on its DVR, its bit in the stream request
+    struct dvrConn_t *conn;	// Connection carrying the channel in event loop mode, the sub stream with -S
+    struct dvrConn_t *mainConn;	// -S: connection carrying the main stream for -r and -q, NULL if conn does
+    struct chStats_t *stats;
+    int outPipe;
+    int spliceFds[2];		// Internal pipe used by -z, -1 when using the copy loop
+    pid_t ffmpegPid;
+    bool ffmpegAdopted;		// ffmpegPid was handed over with -i, it isn't our child to reap
+    time_t lastWrite;		// Last time data went into the pipe (or the pipe was made)
+    time_t lastSnapshot;	// Last time ffmpeg wrote the JPEG (or was started)
+    off_t snapshotSize;		// Size of that JPEG, checked by the watchdog
+    int snapshotWd;		// inotify watch on the JPEG's directory, -1 to poll with stat()
+    char pipename[256];
+    char fileloc[256];
+    char tmploc[256];		// ffmpeg writes here, fileloc is only ever replaced by a whole JPEG
+    struct snapshotJpeg_t *jpeg;	// Latest JPEG, served from memory by -w
+    struct nalFilter_t nalFilt;
+    char filterBuf[FILTER_BUF_SIZE];
+    struct ringBuf_t ring;
+    struct recorder_t rec;
+    struct frameRing_t pub;
+    struct tsMux_t ts;
+    struct activity_t act;
+    unsigned char *pipeOut;	// -f: URING_PIPE_CHUNK bytes taken from the ring and being written
+    size_t pipeOff, pipeLen;	// What of pipeOut has been written so far, and its end
+    bool pipeWriting;
+    bool pipeFull;		// The last write didn't get all of pipeOut in, wait for room first
+    bool pipePolling;		// Waiting for room in the pipe opened pipeSeq-th
+    uint32_t pipeSeq;		// Pipes opened so far, tells completions for an earlier one apart
+#ifdef BUILTIN_SNAPSHOT
+    struct snapshot_t snap;
+#endif
+};
+
+// Header fields of the DVR message a piece of H.264 came from. Media messages
+// are assumed to carry their zero based channel number in bytes 12-15, which
+// is how one connection (-x) is demultiplexed.
+struct dvrFrame_t {
+    unsigned int type;		// Bytes 8-9, as in the login packets
+    int channel;		// -1 when the stream isn't framed
+    uint32_t length;		// Body length
+    uint32_t offset;		// Position of this piece in the body, 0 starts a frame
+    uint64_t sequence;		// Messages seen on the connection
+};
+
+// Splits a DVR stream into messages so only the H.264 in their bodies goes
+// downstream. The header is collected a byte at a time so it may be split
+// across recv() chunks, the body is handed on as it arrives.
+struct dvrFramer_t {
+    unsigned char hdr[DVR_HDR_SIZE];
+    int hdrLen;
+    uint32_t remaining;		// Body bytes of the current message still to come
+    struct dvrFrame_t frame;	// Message being passed on
+    uint64_t messages;
+    uint64_t skipMessages;	// Leading messages whose bodies aren't passed on (login replies)
+    uint64_t resyncs;		// Bytes skipped looking for the next header
+    uint64_t lost;		// Bytes skipped since the last good header
+    bool raw;			// No headers turned up, everything is passed on
+    bool video;			// The current message's body starts with a start code
+};
+
+// Called with each piece of a message body
+typedef void (*dvrPayload_t)(void *ctx, const struct dvrFrame_t *frame, const unsigned char *data, int len);
+
+// What the data.ptr of an epoll event points at (the timer is NULL). Each of
+// these structs starts with its type.
+enum pollType_t {
+    POLL_DVR,			// struct dvrConn_t
+    POLL_HTTP_LISTEN,		// g_httpListen
+    POLL_HTTP_CLIENT,		// struct httpClient_t
+    POLL_HANDOFF,		// g_handoffListen
+    POLL_SNAPSHOT,		// g_snapReady
+    POLL_URING			// g_uringReady
+};
+
+struct dvrConn_t {
+    enum pollType_t type;
+    enum chState_t state;
+    int sockFd;
+    int failures;		// Connection attempts since data last arrived, sets the backoff
+    time_t deadline;		// Current state times out at this point (0 = never)
+    time_t retryTime;		// When to reconnect while in CH_WAITING
+    int dvr;			// Index into g_dvrs
+    uint32_t channelMask;	// Channels requested on this connection, by their number on the DVR
+    uint32_t subMask;		// Those of them requested as the DVR's sub stream
+    struct channel_t *chans[DVR_CHANNELS];	// The channel each of them feeds
+    struct channel_t *channel;	// Receives the raw stream, NULL when multiplexed
+    struct dvrFramer_t framer;	// Strips the DVR framing, and splits the stream between channels when multiplexed
+    char label[128];		// "Ch 1" or "Ch 1+2+3" for messages
+    char recvBuf[2048];
+    bool uringArmed;		// -f has a multishot receive on the socket
+    uint32_t uringGen;		// Bumped on disconnect, completions of older sockets are ignored
+};
+
+// A -w viewer. It reads the channel's ring like any other ring reader, with
+// its own cursor, so one slow viewer never holds up the camera or the others.
+struct httpClient_t {
+    enum pollType_t type;
+    int fd;			// -1 when the slot is free
+    struct channel_t *ch;	// NULL until the request has been read
+    struct frameRing_t *ring;	// H.264 or MPEG-TS ring of the channel
+    struct zmRing_t reader;
+    bool started;		// A keyframe has been sent
+    bool blocked;		// Socket full, waiting for EPOLLOUT
+    uint64_t pos;		// Ring position of the rest of the frame being sent
+    uint32_t left;		// Bytes of that frame still to send
+    uint64_t skips;		// Times the viewer fell behind and skipped to a keyframe
+    struct snapshotJpeg_t *jpeg;	// JPEG being sent instead of a stream
+    size_t jpegSent;
+    time_t deadline;		// The request must be in by then
+    int reqLen;
+    char req[1024];
+};
+
+// What a message of the -i handoff carries
+enum handoff_t {
+    HANDOFF_CONN,		// A streaming DVR connection, with its socket
+    HANDOFF_CHANNEL,		// A channel's ffmpeg, with the write end of its FIFO if open
+    HANDOFF_HTTP,		// The -w listening socket
+    HANDOFF_END
+};
+
+// One SOCK_SEQPACKET message of the handoff, carrying at most one fd. Fields
+// have fixed sizes so the old and new builds don't have to match otherwise.
+struct handoffMsg_t {
+    uint32_t magic;		// HANDOFF_MAGIC
+    uint32_t type;		// enum handoff_t
+    uint32_t channelMask;	// HANDOFF_CONN: channels requested on the connection
+    uint32_t subMask;		// HANDOFF_CONN: those of them on the sub stream
+    uint32_t dvrAddr;		// HANDOFF_CONN: the DVR's IPv4 address and port, in network byte order
+    uint16_t dvrPort;
+    uint32_t channel;		// HANDOFF_CHANNEL: zero based
+    uint64_t messages;		// HANDOFF_CONN: DVR messages seen, login replies included
+    int64_t lastSnapshot;	// HANDOFF_CHANNEL
+    int32_t ffmpegPid;		// HANDOFF_CHANNEL: -1 if none
+    uint8_t raw;		// HANDOFF_CONN: the stream has no DVR framing
+    uint8_t pipeClean;		// HANDOFF_CHANNEL: the FIFO ends on a frame boundary
+    char pipename[256];		// HANDOFF_CHANNEL
+};
+
+// Result of the periodic output health check
+enum watchdog_t {
+    WD_OK,
+    WD_SMALL_SNAPSHOT,		// JPEG too small, reconnect
+    WD_FFMPEG_LAG,		// No JPEG for too long, restart ffmpeg
+    WD_PIPE_LAG			// Nothing written to the pipe for too long, restart the pipe
+};
+
+// A message waiting in the log ring. Any thread may log, the writer thread
+// prints them in the order they were queued.
+struct logEntry_t {
+    uint64_t seq;		// Ticket it can be written at, ticket + 1 once it can be read
+    uintptr_t event;		// Call site (format string) or hash of the text, for rate limiting
+    int channel;		// From 1, 0 if none
+    int err;			// errno for printError()
+    int suppressed;		// Copies of this message dropped by the rate limit since the last one shown
+    bool error;			// From printError(), goes to stderr with strerror(err)
+    char text[LOG_LINE];
+};
+
+struct logRate_t {
+    uintptr_t key;		// event and channel, 0 while unused
+    time_t window;		// Start of the current LOG_RATE_PERIOD
+    int count;			// Messages in this window
+    int suppressed;		// Dropped since the last one shown
+};
+
+// Logging never blocks or makes a syscall in the caller, except before
+// logStart() and in forked children that haven't started their own writer.
+struct log_t {
+    struct logEntry_t slots[LOG_SLOTS];
+    uint64_t writeSeq __attribute__ ((aligned(64)));	// Next ticket handed out
+    uint64_t readSeq __attribute__ ((aligned(64)));	// Next slot the writer prints
+    uint64_t dropped;		// Lost to a full ring
+    struct logRate_t rates[LOG_RATE_EVENTS];
+    bool running;		// The writer thread is up in this process
+    uint32_t stop;		// Futex the writer sleeps on between drains
+    pthread_t thread;
+};
+
+struct channel_t g_channels[MAX_CHANNELS];
+struct dvrConn_t g_conns[MAX_CONNS];
+int g_connCount = 0;
+struct statsShm_t g_statsLocal;
+struct statsShm_t *g_stats = &g_statsLocal;	// Replaced by a shared mapping in main()
+int g_epollFd = -1;
+int g_inotifyFd = -1;	// Reports finished JPEGs to the watchdog
+time_t g_now;		// Refreshed once per wakeup/packet instead of calling time() everywhere
+int g_nullFd = -1;	// /dev/null, sink for spliced data nobody is reading
+struct httpClient_t g_clients[HTTP_MAX_CLIENTS];
+int g_httpFd = -1;
+enum pollType_t g_httpListen = POLL_HTTP_LISTEN;	// epoll tag of g_httpFd
+int g_handoffFd = -1;	// -i socket the next instance connects to
+enum pollType_t g_handoffListen = POLL_HANDOFF;	// epoll tag of g_handoffFd
+struct handoffMsg_t g_handoff[HANDOFF_MAX];	// Taken over by handoffReceive(), applied by handoffAdopt()
+int g_handoffFds[HANDOFF_MAX];
+int g_handoffCount = 0;
+#ifdef BUILTIN_SNAPSHOT
+struct snapshotPool_t g_snapPool = {.eventFd = -1};
+enum pollType_t g_snapReady = POLL_SNAPSHOT;	// epoll tag of g_snapPool.eventFd
+#endif
+struct uringIo_t g_uring = {.ring.fd = -1};
+enum pollType_t g_uringReady = POLL_URING;	// epoll tag of g_uring.ring
+struct log_t g_log;
 
 void sigHandler(int sig);
 void display_usage(char *name);
 int printMessage(bool verbose, const char *message, ...);
+void printError(const char *message);
+void logStart(void);
+void logStop(void);
 int connectStream(int sockFd, int channel);
+int sendLoginRequest(int sockFd);
+int sendStreamRequest(int sockFd, uint32_t channelMask, uint32_t subMask);
+int runEventLoop(void);
+int runWorkers(void);
+int configLoad(const char *path);
+int dvrResolve(struct dvr_t *dvr);
+int runBatch(char **files, int count);
+int backoffDelay(int *failures);
+int openSplicePipe(int spliceFds[2]);
+int spliceChunk(int sockFd, int outPipe, int spliceFds[2], int *written);
+void channelInit(struct channel_t *ch, int index);
+void channelWatchSnapshot(struct channel_t *ch);
+void readSnapshotEvents(void);
+void channelSnapshotReady(struct channel_t *ch);
+struct snapshotJpeg_t *snapshotJpegAlloc(size_t len);
+void snapshotJpegRelease(struct snapshotJpeg_t *jpeg);
+void snapshotPublish(struct channel_t *ch, struct snapshotJpeg_t *jpeg);
+enum watchdog_t channelWatchdog(struct channel_t *ch);
+void ringReset(struct ringBuf_t *r);
+void ringCut(struct ringBuf_t *r);
+void ringRewind(struct ringBuf_t *r);
+int channelRingRelay(struct channel_t *ch, int outFd, const char *data, int len);
+void recordReset(struct recorder_t *r);
+void recordWrite(struct channel_t *ch, const unsigned char *data, int len);
+void recordClose(struct recorder_t *r);
+#ifdef BUILTIN_SNAPSHOT
+void snapshotClose(struct snapshot_t *snap);
+static void snapshotFreeDecoder(struct snapshot_t *snap);
+static void snapshotPoolStart(void);
+static void snapshotPoolStop(void);
+static void snapshotPoolEvent(void);
+static bool snapshotWaiting(struct snapshot_t *snap);
+int snapshotFeed(struct channel_t *ch, const struct nalFilter_t *f, const unsigned char *data, int len);
+#endif
+int uringRecvArm(struct dvrConn_t *conn);
+void uringRecvCancel(struct dvrConn_t *conn);
+void nalFilterReset(struct nalFilter_t *f, unsigned int interval);
+void dvrFramerReset(struct dvrFramer_t *f);
+void dvrFramerParse(struct dvrFramer_t *f, const unsigned char *data, int len, dvrPayload_t payload, void *ctx);
+int dvrFramerStrip(struct dvrFramer_t *f, unsigned char *buf, int len, struct channel_t *ch);
+int frameRingOpen(struct channel_t *ch);
+bool frameRingPut(struct frameRing_t *r, const struct dvrFrame_t *frame, const unsigned char *data, int len);
+void channelPublish(struct channel_t *ch, const struct dvrFrame_t *frame, const unsigned char *data, int len);
+void httpChannelFrame(struct channel_t *ch);
+void statsFrame(struct chStats_t *st, const struct dvrFrame_t *frame, const unsigned char *data, int len);
+void activityFrame(struct channel_t *ch, const struct dvrFrame_t *frame, const unsigned char *data, int len);
+bool activityActive(const struct channel_t *ch);
+bool activityHold(const struct channel_t *ch);
+void statsWrite(void);
+int handoffReceive(void);
+int nalFilter(struct nalFilter_t *f, const unsigned char *in, int len, unsigned char *out, int outSize);
 
 void printBuffer(char *pbuf, size_t len)
 {
@@ -65,14 +692,17 @@ int main(int argc, char**argv)
     
     char pipename[256];
     char ffCmd[2048];
-    struct addrinfo hints, *server;
     struct sockaddr_in serverAddr;
     int retval = 0;
     char recvBuf[2048];
+    char filterBuf[FILTER_BUF_SIZE];
+    struct nalFilter_t nalFilt;
+    struct dvrFramer_t framer;
     struct sigaction sapipe, oldsapipe, saterm, oldsaterm, saint, oldsaint, sahup, oldsahup;
     char opt;
     int loopIdx;
     int outPipe = -1;
+    int spliceFds[2] = {-1, -1};
     pid_t ffmpegPid = -1;
 #ifdef DOMAIN_SOCKETS
     struct sockaddr_un addr;
@@ -91,6 +721,11 @@ int main(int argc, char**argv)
     
     memset(&globalArgs, 0, sizeof(globalArgs));
     
+    globalArgs.ringSize = RING_SIZE_DEFAULT;
+    globalArgs.recordSegments = RECORD_SEGMENTS_DEFAULT;
+    globalArgs.snapshotWorkers = -1;
+    globalArgs.pipeDir = "/tmp";
+    
     globalArgs.hostname = "";
     
     // Read command-line
@@ -101,8 +736,59 @@ int main(int argc, char**argv)
             case 'v':
                 globalArgs.verbose = true;
                 break;
+            case 'e':
+                globalArgs.eventLoop = true;
+                break;
+            case 'x':
+                globalArgs.multiplex = true;
+                globalArgs.eventLoop = true;
+                break;
+            case 'z':
+                globalArgs.zeroCopy = true;
+                break;
+#ifdef BUILTIN_SNAPSHOT
+            case 'j':
+                globalArgs.builtinSnapshot = true;
+                break;
+            case 'y':
+                globalArgs.snapshotWorkers = atoi(optarg);
+                if( globalArgs.snapshotWorkers > SNAPSHOT_WORKERS_MAX )
+                    globalArgs.snapshotWorkers = SNAPSHOT_WORKERS_MAX;
+                break;
+#endif
+            case 'l':
+                globalArgs.adaptiveSnapshot = true;
+                break;
+            case 'o':
+                globalArgs.eventRecord = true;
+                break;
+            case 'b':
+                globalArgs.ringSize = atoi(optarg);
+                break;
+            case 'k':
+                globalArgs.keyframeInterval = atoi(optarg);
+                if( globalArgs.keyframeInterval < 1 )
+                    globalArgs.keyframeInterval = 1;
+                break;
             case 'c':
-                globalArgs.channel[atoi(optarg) - 1] = true;
+            case 'S':
+                loopIdx = atoi(optarg);
+                if( loopIdx < 1 || loopIdx > DVR_CHANNELS )
+                {
+                    printMessage(false, "Channel must be between 1 and %i\n", DVR_CHANNELS);
+                    return 1;
+                }
+                globalArgs.channel[loopIdx - 1] = true;
+                g_chConfig[loopIdx - 1].dvrChannel = loopIdx - 1;
+                if( opt == 'S' )
+                {
+                    g_chConfig[loopIdx - 1].sub = true;
+                    globalArgs.eventLoop = true;
+                }
+                break;
+            case 'C':
+                globalArgs.configFile = optarg;
+                globalArgs.eventLoop = true;
                 break;
             case 's':
                 globalArgs.hostname = optarg;
@@ -110,6 +796,35 @@ int main(int argc, char**argv)
             case 'p':
                 globalArgs.port = atoi(optarg);
                 break;
+            case 'm':
+                globalArgs.statsFile = optarg;
+                break;
+            case 'r':
+                globalArgs.recordDir = optarg;
+                break;
+            case 'g':
+                globalArgs.recordSegments = atoi(optarg);
+                if( globalArgs.recordSegments < 2 )
+                    globalArgs.recordSegments = 2;
+                break;
+            case 'q':
+                globalArgs.frameRingSize = atoi(optarg);
+                break;
+            case 'w':
+                globalArgs.httpPort = atoi(optarg);
+                globalArgs.eventLoop = true;
+                break;
+            case 'i':
+                globalArgs.handoffPath = optarg;
+                globalArgs.eventLoop = true;
+                break;
+            case 'f':
+                globalArgs.uring = true;
+                globalArgs.eventLoop = true;
+                break;
+            case 'd':
+                globalArgs.batchDir = optarg;
+                break;
             case 'h':
                 // Fall through
             case '?':
@@ -126,6 +841,114 @@ int main(int argc, char**argv)
         globalArgs.port = 9000;
     }
     
+    if( globalArgs.configFile )
+    {
+        for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+        {
+            if( globalArgs.channel[loopIdx] )
+            {
+                printMessage(false, "-c and -S can't be used with -C, list the channels in %s\n", globalArgs.configFile);
+                return 1;
+            }
+        }
+        if( configLoad(globalArgs.configFile) != 0 )
+            return 1;
+    }
+    else
+    {
+        // The one DVR of -s and -p, its channels are numbered as they are on it
+        snprintf(g_dvrs[0].host, sizeof(g_dvrs[0].host), "%s", globalArgs.hostname);
+        g_dvrs[0].port = globalArgs.port;
+        g_dvrCount = 1;
+    }
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+        g_chConfig[loopIdx].streamed = globalArgs.channel[loopIdx];
+    
+    // A handoff or the HTTP port can't be shared between processes
+    if( globalArgs.configFile && (globalArgs.httpPort || globalArgs.handoffPath) )
+    {
+        if( globalArgs.workers > 1 )
+            printMessage(false, "-w and -i need all the channels in one process, using one worker\n");
+        globalArgs.workers = 1;
+    }
+    
+    // The built-in snapshot engine only decodes keyframes, and -l paces them
+    if( (globalArgs.builtinSnapshot || globalArgs.adaptiveSnapshot) && !globalArgs.keyframeInterval )
+        globalArgs.keyframeInterval = 1;
+    
+    // The keyframe filter has to see the data, so it can't bypass user space
+    if( globalArgs.keyframeInterval && globalArgs.zeroCopy )
+    {
+        printMessage(false, "-z can't be used with -k, copying data instead\n");
+        globalArgs.zeroCopy = false;
+    }
+    
+    // The stream has to be split between channels in user space
+    if( globalArgs.multiplex && globalArgs.zeroCopy )
+    {
+        printMessage(false, "-z can't be used with -x, copying data instead\n");
+        globalArgs.zeroCopy = false;
+    }
+    
+    if( globalArgs.batchDir && globalArgs.recordDir )
+        printMessage(false, "-r isn't used with -d, each file is recorded under the -d directory\n");
+    else if( globalArgs.eventRecord && !globalArgs.recordDir && !globalArgs.batchDir )
+        printMessage(false, "-o has no effect without -r\n");
+    
+    // The recorder needs the data in user space too
+    if( globalArgs.recordDir && globalArgs.zeroCopy )
+    {
+        printMessage(false, "-z can't be used with -r, copying data instead\n");
+        globalArgs.zeroCopy = false;
+    }
+    
+    // io_uring reads the sockets itself, and owns them until they close
+    if( globalArgs.uring && globalArgs.zeroCopy )
+    {
+        printMessage(false, "-z can't be used with -f, copying data instead\n");
+        globalArgs.zeroCopy = false;
+    }
+    if( globalArgs.uring && globalArgs.handoffPath )
+    {
+        printMessage(false, "-f can't be used with -i, using epoll instead\n");
+        globalArgs.uring = false;
+    }
+    
+    // Viewers are served from the shared-memory ring
+    if( globalArgs.httpPort && globalArgs.frameRingSize <= 0 )
+        globalArgs.frameRingSize = HTTP_RING_DEFAULT;
+    
+    // So does the shared-memory ring
+    if( globalArgs.frameRingSize > 0 && globalArgs.zeroCopy )
+    {
+        printMessage(false, "-z can't be used with -q, copying data instead\n");
+        globalArgs.zeroCopy = false;
+    }
+    
+    // Spliced data never passes through user space to be queued
+    if( globalArgs.zeroCopy || globalArgs.builtinSnapshot || globalArgs.ringSize < 0 )
+        globalArgs.ringSize = 0;
+    
+    if( globalArgs.ringSize > 0 && globalArgs.ringSize < RING_SIZE_MIN )
+    {
+        printMessage(false, "-b must be at least %i KB, using that\n", RING_SIZE_MIN);
+        globalArgs.ringSize = RING_SIZE_MIN;
+    }
+    
+    // Messages are printed by a thread of their own from here on
+    logStart();
+    
+    if( globalArgs.batchDir )
+    {
+        if( optind >= argc )
+        {
+            printMessage(false, "-d needs capture files after the options\n");
+            return 1;
+        }
+        return runBatch(argv + optind, argc - optind) == 0 ? 0 : 1;
+    }
+    
     memset(&saint, 0, sizeof(saint));
     memset(&saterm, 0, sizeof(saterm));
     memset(&sahup, 0, sizeof(sahup));
@@ -146,22 +969,61 @@ int main(int argc, char**argv)
     sahup.sa_handler = sigHandler;
     sigaction(SIGUSR2, &sahup, &oldsahup);
     
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
+    for( loopIdx=0;loopIdx<g_dvrCount;loopIdx++ )
+    {
+        if( dvrResolve(&g_dvrs[loopIdx]) != 0 )
+            return 1;
+    }
+    serverAddr = g_dvrs[0].addr;
+    
+    // Shared with the channel processes so one file can cover them all
+    g_stats = mmap(NULL, sizeof(*g_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if( g_stats == MAP_FAILED )
+    {
+        printError("Failed to map the metrics\n");
+        g_stats = &g_statsLocal;
+    }
     
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_protocol = IPPROTO_TCP;
-    retval = getaddrinfo(globalArgs.hostname, NULL, &hints, &server);
-    if( retval != 0 )
+    // From here on each worker runs the event loop for its share of the channels
+    if( globalArgs.configFile && (retval = runWorkers()) != 0 )
+        return retval < 0 ? 1 : 0;
+    
+    // Before the rings are opened, the old instance writes them until it lets go
+    if( globalArgs.handoffPath && handoffReceive() != 0 )
     {
-        printMessage(false, "getaddrinfo failed: %s\n", gai_strerror(retval));
+        printMessage(false, "Failed to take over from %s\n", globalArgs.handoffPath);
         return 1;
     }
     
-    serverAddr.sin_addr = ((struct sockaddr_in*)server->ai_addr)->sin_addr;
-    serverAddr.sin_port = htons(globalArgs.port);
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        channelInit(&g_channels[loopIdx], loopIdx);
+        
+        // Made before forking, each channel process then writes its own
+        if( globalArgs.frameRingSize > 0 && globalArgs.channel[loopIdx] == true )
+            frameRingOpen(&g_channels[loopIdx]);
+    }
     
+    if( globalArgs.eventLoop )
+    {
+        // SIGUSR1 resets every channel when they all live in this process
+        sigaction(SIGUSR1, &sahup, NULL);
+        
+        // A closed pipe only concerns its own channel, write() reports it
+        signal(SIGPIPE, SIG_IGN);
+        
+        retval = runEventLoop();
+        
+        // Restore old signal handler
+        sigaction(SIGPIPE, &oldsapipe, NULL);
+        sigaction(SIGTERM, &oldsaterm, NULL);
+        sigaction(SIGINT, &oldsaint, NULL);
+        sigaction(SIGUSR2, &oldsahup, NULL);
+        
+        if( globalArgs.verbose )
+            printMessage(true, "Exiting program: %i\n", g_cleanUp);
+        return retval;
+    }
     
     do
     {
@@ -192,6 +1054,8 @@ int main(int argc, char**argv)
                     
                     memset(g_childPids, 0, sizeof(g_childPids));
                     g_processCh = loopIdx;
+                    srand(time(0) ^ getpid());	// Or every channel backs off in step
+                    logStart();
                     break;
                 }
                 // Error
@@ -209,31 +1073,49 @@ int main(int argc, char**argv)
     {
         if( g_processCh != -1 )
         {
+            struct channel_t *ch = &g_channels[g_processCh];
+            time_t nextCheck = 0;
+            int failures = 0;
+            
             // At this point, g_processCh contains the camera number to use
-            sprintf(pipename, "/tmp/cam%irand%i", g_processCh, rand());
+            sprintf(pipename, "%s/cam%irand%i", globalArgs.pipeDir, g_processCh, rand());
             
-            tv.tv_sec = 10;		// Wait 5 seconds for socket data
+            tv.tv_sec = STREAM_TIMEOUT;		// Wait for socket data
             tv.tv_usec = 0;
             
-            char fileloc[256];
-            sprintf(fileloc, "/var/www/html/%i.jpg", g_processCh+1);
+            // ffmpeg rewrites tmploc in place, readSnapshotEvents() publishes each whole JPEG
+            char *rate = globalArgs.adaptiveSnapshot ? "1" : "1/2";
+            char* ffLCmd[] = {"ffmpeg", "-y", "-f",  "h264", "-framerate", "1", "-i", pipename,  "-s",  "390x220",  "-r",  rate,  "-update",  "1",  "-f",  "image2", ch->tmploc, NULL};
+            sprintf(ffCmd, "ffmpeg -y -f h264 -framerate 1 -i %s -s 390x220  -r %s -update 1 -f image2  %s", pipename, rate, ch->tmploc);
             
-            char* ffLCmd[] = {"ffmpeg", "-y", "-f",  "h264", "-framerate", "1", "-i", pipename,  "-s",  "390x220",  "-r",  "1/2",  "-update",  "1",  "-f",  "image2", fileloc, NULL};
-            sprintf(ffCmd, "ffmpeg -y -f h264 -framerate 1 -i %s -s 390x220  -r 1/2 -update 1 -f image2  /var/www/html/%i.jpg", pipename, g_processCh+1);
-            
-            retval = mkfifo(pipename, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+            retval = 0;
+            if( !globalArgs.builtinSnapshot )
+                retval = mkfifo(pipename, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
             
             if( retval != 0 )
             {
                 sprintf(g_errBuf, "Ch %i: Failed to create pipe\n", g_processCh+1);
-                perror(g_errBuf);
+                printError(g_errBuf);
                 
             }
             
+            ch->lastWrite = time(NULL);
+            
+            if( g_inotifyFd == -1 )
+                g_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if( ch->snapshotWd == -1 )
+                channelWatchSnapshot(ch);
+            
+            if( globalArgs.zeroCopy && spliceFds[0] == -1 && openSplicePipe(spliceFds) != 0 )
+            {
+                sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to create splice pipe, copying data instead\n");
+                printError(g_errBuf);
+            }
             
             while( !g_cleanUp )
             {
                 int flag = true;
+                struct timeval connTv = { CONNECT_TIMEOUT, 0 };
 #ifdef NON_BLOCK_READ
                 fd_set readfds;
 #endif
@@ -243,18 +1125,25 @@ int main(int argc, char**argv)
                 if( setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv)))
                 {
                     sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set socket timeout\n");
-                    perror(g_errBuf);
+                    printError(g_errBuf);
+                }
+                
+                // Also bounds connect(), which gives up with EINPROGRESS
+                if( setsockopt(sockFd, SOL_SOCKET, SO_SNDTIMEO, (char*)&connTv, sizeof(connTv)))
+                {
+                    sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set connect timeout\n");
+                    printError(g_errBuf);
                 }
                 
                 if( setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)))
                 {
                     sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set TCP_NODELAY\n");
-                    perror(g_errBuf);
+                    printError(g_errBuf);
                 }
                 if( setsockopt(sockFd, SOL_SOCKET, SO_LINGER, (char*)&lngr, sizeof(lngr)))
                 {
                     sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set SO_LINGER\n");
-                    perror(g_errBuf);
+                    printError(g_errBuf);
                 }
                 
                 retval = connect(sockFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
@@ -262,14 +1151,14 @@ int main(int argc, char**argv)
                 if( globalArgs.verbose )
                     printMessage(true, "Connect result: %i\n", retval);
                 
-                if( retval == -1 && errno != EINPROGRESS )
+                if( retval == -1 )
                 {
-                    int sleeptime = 10;
+                    int sleeptime = backoffDelay(&failures);
                     
                     if( globalArgs.verbose )
                     {
                         sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to connect\n");
-                        perror(g_errBuf);
+                        printError(g_errBuf);
                         printMessage(true, "Waiting %i seconds.\n", sleeptime);
                     }
                     close(sockFd);
@@ -282,7 +1171,7 @@ int main(int argc, char**argv)
                 {
                     
                     sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to connect\n");
-                    perror(g_errBuf);
+                    printError(g_errBuf);
                     return 1;
                 }
                 
@@ -293,22 +1182,31 @@ int main(int argc, char**argv)
                     printMessage(true, "Connect failed.\n");
                     close(sockFd);
                     sockFd = -1;
-                    return 1;
+                    sleep(backoffDelay(&failures));
+                    continue;
                 }
+                statsAdd(&ch->stats->connects, 1);
 #ifdef NON_BLOCK_READ
                 if( fcntl(sockFd, F_SETFL, O_NONBLOCK) == -1 )	// non-blocking sockets
                 {
                     sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Failed to set O_NONBLOCK\n");
-                    perror(g_errBuf);
+                    printError(g_errBuf);
                 }
                 FD_ZERO(&readfds);
                 FD_SET(sockFd, &readfds	);
 #endif
                 
+                nalFilterReset(&nalFilt, globalArgs.keyframeInterval);
+                recordReset(&ch->rec);
+                dvrFramerReset(&framer);
+                framer.skipMessages = DVR_LOGIN_REPLIES;
+                
                 printMessage(true, "Connected and awaiting stream\n");
                 do
                 {
                     int read = 0;
+                    int written = 0;
+                    bool spliced = false;
 #ifdef NON_BLOCK_READ
                     tv_sel.tv_sec = 10;
                     tv_sel.tv_usec = 0;
@@ -316,7 +1214,7 @@ int main(int argc, char**argv)
                     if( select( sockFd+1, &readfds, NULL, NULL, &tv_sel) == -1)
                     {
                         sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Select failed\n");
-                        perror(g_errBuf);
+                        printError(g_errBuf);
                         
                         close(sockFd);
                         sockFd = -1;
@@ -331,7 +1229,39 @@ int main(int argc, char**argv)
                     }
 #endif
                     
-                    read  = recv(sockFd, recvBuf, sizeof(recvBuf), 0);
+                    // Once ffmpeg has the pipe open the data can bypass recvBuf entirely, but
+                    // only if the DVR doesn't frame it: the headers and non-video messages
+                    // have to be taken out in user space
+                    if( spliceFds[0] != -1 && outPipe != -1 && framer.raw )
+                    {
+                        read = spliceChunk(sockFd, outPipe, spliceFds, &written);
+                        spliced = true;
+                        
+                        if( read == -1 && (errno == EINVAL || errno == ENOSYS) )
+                        {
+                            printMessage(true, "splice() not supported, copying data instead\n");
+                            close(spliceFds[0]);
+                            close(spliceFds[1]);
+                            spliceFds[0] = spliceFds[1] = -1;
+                            continue;
+                        }
+                        
+                        if( read == -2 )
+                        {
+                            if( globalArgs.verbose )
+                            {
+                                sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Pipe closed\n");
+                                printError(g_errBuf);
+                            }
+                            close(outPipe);
+                            outPipe = -1;
+                            close(sockFd);
+                            sockFd = -1;
+                            continue;
+                        }
+                    }
+                    else
+                        read  = recv(sockFd, recvBuf, sizeof(recvBuf), 0);
                     
                     if( read <= 0 )
                     {
@@ -351,10 +1281,52 @@ int main(int argc, char**argv)
                         break;
                     }
                     
-                    if( globalArgs.verbose )
+                    // Only the H.264 inside the DVR's messages goes on to ffmpeg
+                    if( !spliced )
+                        read = dvrFramerStrip(&framer, (unsigned char*)recvBuf, read, ch);
+                    else
+                    {
+                        statsAdd(&ch->stats->bytes, read);
+                        statsAdd(&ch->stats->droppedBytes, read - written);
+                    }
+                    
+                    // Past the login replies, the DVR is back
+                    if( spliced || framer.raw || framer.messages > DVR_LOGIN_REPLIES )
+                        failures = 0;
+                    
+                    // time() is a vDSO call, the checks themselves only run every WATCHDOG_INTERVAL
+                    g_now = time(NULL);
+                    
+                    if( written > 0 )
+                        ch->lastWrite = g_now;
+                    
+                    if( g_now >= nextCheck )
                     {
-                        printf(".");
-                        fflush(stdout);
+                        enum watchdog_t wd;
+                        
+                        nextCheck = g_now + WATCHDOG_INTERVAL;
+                        readSnapshotEvents();
+                        statsWrite();
+                        wd = channelWatchdog(ch);
+                        
+                        if( wd == WD_SMALL_SNAPSHOT || wd == WD_PIPE_LAG )
+                        {
+                            g_cleanUp = 4;
+                            break;
+                        }
+                        else if( wd == WD_FFMPEG_LAG && ffmpegPid > 0 )
+                        {
+                            kill(ffmpegPid, SIGKILL);
+                            waitpid(ffmpegPid, NULL, 0);
+                            ffmpegPid = -1;
+                            close(outPipe);
+                            outPipe = -1;
+                            ringCut(&ch->ring);
+                            ringRewind(&ch->ring);
+                            close(sockFd);
+                            sockFd = -1;
+                            break;
+                        }
                     }
                     
 #ifdef DOMAIN_SOCKETS
@@ -362,25 +1334,26 @@ int main(int argc, char**argv)
                     {
                         outPipe = socket(AF_UNIX, SOCK_STREAM, 0);
                         if( outPipe == -1 )
-                            perror("Error creating socket\n");
+                            printError("Error creating socket\n");
                         
                         memset(&addr, 0, sizeof(addr));
                         addr.sun_family = AF_UNIX;
                         strncpy(addr.sun_path, pipename, sizeof(addr.sun_path) - 1);
                         
                         if( bind(outPipe, (struct sockaddr*)&addr, sizeof(addr)) == -1 )
-                            perror("Error binding socket\n");
+                            printError("Error binding socket\n");
                     }
                     
 #else
                     
-                    if( outPipe == -1 ){
+                    if( outPipe == -1 && !globalArgs.builtinSnapshot ){
                         outPipe = open(pipename, O_WRONLY | O_NONBLOCK);
                     }
                     
 #endif
                     
-                    if (ffmpegPid == -1){
+                    if (ffmpegPid == -1 && !globalArgs.builtinSnapshot){
+                        statsAdd(&ch->stats->ffmpegStarts, 1);
                         if ((ffmpegPid = fork()) < 0) {
                             printMessage(true, "Error creating ffmpeg fork\n");
                             ffmpegPid = -1;
@@ -392,16 +1365,54 @@ int main(int argc, char**argv)
                             }
                         }
                         sleep(1);
+                        ch->lastSnapshot = time(NULL);
+                    }
+                    
+                    char *outData = recvBuf;
+                    int outLen = read;
+                    
+                    if( globalArgs.recordDir && !spliced )
+                        recordWrite(ch, (unsigned char*)recvBuf, read);
+                    
+                    if( globalArgs.keyframeInterval && !spliced )
+                    {
+                        nalFilt.hold = activityHold(ch);
+                        outLen = nalFilter(&nalFilt, (unsigned char*)recvBuf, read, (unsigned char*)filterBuf, sizeof(filterBuf));
+                        outData = filterBuf;
+                        if( nalFilt.overflow )
+                            printMessage(false, "Ch %i: Keyframe filter output full, %i bytes left out\n", g_processCh+1, nalFilt.overflow);
+                    }
+                    
+#ifdef BUILTIN_SNAPSHOT
+                    if( globalArgs.builtinSnapshot )
+                    {
+                        if( snapshotFeed(ch, &nalFilt, (unsigned char*)outData, outLen) == 0 )
+                            ch->lastWrite = g_now;
+                        continue;
+                    }
+#endif
+                    
+                    if( globalArgs.ringSize && !spliced )
+                    {
+                        if( channelRingRelay(ch, outPipe, outData, outLen) != 0 )
+                        {
+                            close(outPipe);
+                            outPipe = -1;
+                            close(sockFd);
+                            sockFd = -1;
+                        }
+                        continue;
                     }
                     
-                    if( outPipe != -1 )
+                    if( outPipe != -1 && !spliced && outLen > 0 )
                     {
-                        if( (retval = write(outPipe, recvBuf, read)) == -1)
+                        if( (retval = write(outPipe, outData, outLen)) == -1)
                         {
                             if( errno == EAGAIN || errno == EWOULDBLOCK )
                             {
+                                statsAdd(&ch->stats->droppedBytes, outLen);
                                 if( globalArgs.verbose )
-                                    printMessage(true, "\nCh %i: %s", g_processCh+1, "Reader isn't reading fast enough, discarding data. Not enough processing power?\n");
+                                    printMessage(true, "Ch %i: %s", g_processCh+1, "Reader isn't reading fast enough, discarding data. Not enough processing power?\n");
                                 
                                 continue;
                             }
@@ -409,7 +1420,7 @@ int main(int argc, char**argv)
                             else if( globalArgs.verbose )
                             {
                                 sprintf(g_errBuf, "Ch %i: %s", g_processCh+1, "Pipe closed\n");
-                                perror(g_errBuf);
+                                printError(g_errBuf);
                             }
                             
 #ifndef DOMAIN_SOCKETS
@@ -422,51 +1433,9 @@ int main(int argc, char**argv)
                             continue;
                         }
                         else
-                        {
-                            if( globalArgs.verbose )
-                            {
-                                printf("\b \b");
-                                fflush(stdout);
-                            }
-                        }
-                    }
-                    struct stat st;
-                    time_t rawtime;
-                    time ( &rawtime );
-                    
-                    memset( &st, 0, sizeof(struct stat) );
-                    
-                    stat(fileloc, &st);
-                    int fsize1 = st.st_size;
-                    
-                    if( fsize1 < 2500 && fsize1 > 10 ){
-                        printMessage(true, "Stream %i ouput pic size %i, reconnecting\n",g_processCh+1,fsize1);
-                        remove(fileloc);
-                        g_cleanUp = 4;
-                        break;
-                    }
-                    
-                    double dt = difftime(rawtime, st.st_mtime);
-                    
-                    if(  dt > 30 && dt < 40000 ){
-                        printMessage(true, "Stream %i FFMpeg output lagging by %f, restarting FFMpeg\n",g_processCh+1, difftime(rawtime, st.st_mtime));
-                        char* tarr[] = {"touch", fileloc, NULL};
-                        execvp("touch", tarr);
-                        kill(ffmpegPid, SIGKILL);
-                        ffmpegPid = -1;
-                        break;
-                    }
-                    
-                    memset( &st, 0, sizeof(struct stat) );
-                    stat(pipename, &st);
-                    
-                    dt = difftime(rawtime, st.st_mtime);
-                    
-                    if(  dt > 30 && dt < 40000 ){
-                        printMessage(true, "Stream %i FFMpeg input pipe lagging by %f, restarting pipe\n",g_processCh+1, difftime(rawtime, st.st_mtime));
-                        g_cleanUp = 4;
-                        break;
+                            ch->lastWrite = g_now;
                     }
+
                 }
                 while( sockFd != -1 && !g_cleanUp );
             }
@@ -475,12 +1444,25 @@ int main(int argc, char**argv)
             
             printMessage(true, "Cleaning up\n");
             
-            kill(ffmpegPid, SIGKILL);
+            // kill(-1) would signal every process we're allowed to
+            if( ffmpegPid > 0 )
+                kill(ffmpegPid, SIGKILL);
             ffmpegPid = -1;
             close(outPipe);
             outPipe = -1;
+            ringReset(&ch->ring);
+            recordClose(&ch->rec);
             close(sockFd);
             sockFd = -1;
+            if( spliceFds[0] != -1 )
+            {
+                close(spliceFds[0]);
+                close(spliceFds[1]);
+                spliceFds[0] = spliceFds[1] = -1;
+            }
+#ifdef BUILTIN_SNAPSHOT
+            snapshotClose(&ch->snap);
+#endif
             unlink(pipename);
             if( g_cleanUp == 1)
                 break;
@@ -498,7 +1480,6 @@ int main(int argc, char**argv)
             sigaction(SIGTERM, &oldsaterm, NULL);
             sigaction(SIGINT, &oldsaint, NULL);
             sigaction(SIGUSR1, &oldsahup, NULL);
-            freeaddrinfo(server);
             
             if( globalArgs.verbose )
                 printMessage(true, "Exiting program: %i\n", g_cleanUp);
@@ -510,13 +1491,54 @@ int main(int argc, char**argv)
 
 void display_usage(char *name)
 {
-    printf("Usage: %s [options]\n\n", name);
+    printf("Usage: %s [options] [capture files, with -d]\n\n", name);
     printf("Where [options] is one of:\n\n"
            "    -s <string>\tIP to connect to\n"
            "    -p <int>\tPort number to connect to\n"
-           "    -c <int>\tChannels to stream (can be specified multiple times)\n"
+           "    -c <int>\tChannels to stream, 1 to %i (can be specified multiple times)\n"
+           "    -C <file>\tStream the DVRs and channels listed in <file> instead of -s, -p and -c,\n"
+           "    \t\tshared out between worker processes pinned to their own cores (implies -e).\n"
+           "    \t\tOne setting per line, '#' starts a comment:\n"
+           "    \t\t    workers <int>     processes to use, default one per core\n"
+           "    \t\t    pipes <dir>       where the FIFOs to ffmpeg go, default /tmp\n"
+           "    \t\t    dvr <host> [port] the channels below come from this DVR\n"
+           "    \t\t    channel <int> [sub] [jpeg <file>] [size <WxH>]\n"
+           "    \t\tChannels are numbered from 1 across all DVRs, in the order given\n"
+           "    -S <int>\tStream this channel too, taking its snapshots from the DVR's low resolution\n"
+           "    \t\tsub stream. -r and -q still get the main stream, over a second connection\n"
+           "    \t\t(can be specified multiple times, implies -e)\n"
+           "    -e\t\tRun all channels from one process using an event loop\n"
+           "    -x\t\tStream every channel over a single DVR connection (implies -e)\n"
+           "    -z\t\tMove stream data to ffmpeg with splice() when the DVR doesn't frame it\n"
+           "    -k <int>\tOnly send every Nth keyframe (plus SPS/PPS) to ffmpeg\n"
+           "    -b <int>\tKB queued per channel while ffmpeg is busy, whole GOPs are dropped\n"
+           "    \t\twhen it fills (default %i, 0 discards what the reader can't take)\n"
+#ifdef BUILTIN_SNAPSHOT
+           "    -j\t\tDecode keyframes and write the JPEGs in-process instead of running ffmpeg\n"
+           "    -y <int>\tThreads decoding -j keyframes with -e, each pinned to its own core (default\n"
+           "    \t\tone per core, up to a few; 0 decodes in the event loop). When they fall behind,\n"
+           "    \t\tonly the newest keyframe waiting per channel is decoded\n"
+#endif
+           "    -m <file>\tWrite per-channel metrics to <file> in Prometheus text format every %i seconds\n"
+           "    -r <dir>\tRecord each channel's H.264 into <dir>, in %i MB files with a keyframe index\n"
+           "    -g <int>\tRecording files kept per channel, the oldest is overwritten (default %i)\n"
+           "    -l\t\tPace JPEGs by motion: one every %i s with it, one every %i s without (implies -k 1)\n"
+           "    -o\t\tOnly record GOPs that start while there is motion (with -r)\n"
+           "    -q <int>\tPublish each channel's frames for local readers in a shared-memory ring\n"
+           "    \t\tof <int> KB, /dev/shm/zmodopipe-chN (see zmodoring.h)\n"
+           "    -w <int>\tServe the channels over HTTP on port <int> as /N.h264 or /N.ts, and the\n"
+           "    \t\tlatest JPEG as /N.jpg (implies -e, and -q %i unless given)\n"
+           "    -i <path>\tHand the DVR connections, pipes and ffmpeg processes over to the next\n"
+           "    \t\tinstance started with -i <path>, taking them over from a running one\n"
+           "    \t\tfirst (implies -e)\n"
+           "    -f\t\tReceive with io_uring multishot receives, and write the pipes and recordings\n"
+           "    \t\tin one submission per wakeup (implies -e, not with -i)\n"
+           "    -d <dir>\tOffline: run the DVR byte streams or pcaps named after the options through\n"
+           "    \t\tthe framing, -k, recording and -j stages at full speed, one process per core.\n"
+           "    \t\tEach file is recorded into <dir>/<file name>/ and the rate is reported\n"
            "    -v\t\tVerbose output\n"
-           "\n");
+           "\n", DVR_CHANNELS, RING_SIZE_DEFAULT, STATS_INTERVAL, RECORD_SEGMENT_SIZE / (1024 * 1024), RECORD_SEGMENTS_DEFAULT,
+           ACTIVITY_SNAPSHOT_PERIOD, ACTIVITY_IDLE_PERIOD, HTTP_RING_DEFAULT);
 }
 
 void sigHandler(int sig)
@@ -541,33 +1563,5508 @@ void sigHandler(int sig)
     }
 }
 
-int printMessage(bool verbose, const char *message, ...)
+// Channel a message is about, from the process or a leading "Ch N: "
+static int logChannel(const char *text)
 {
-    char msgBuf[2048];
-    int ret=0;
-    va_list argptr;
-    va_start(argptr, message);
+    if( g_processCh != -1 )
+        return g_processCh + 1;
+    if( strncmp(text, "Ch ", 3) == 0 )
+        return atoi(text + 3);
+    return 0;
+}
+
+// Whether the message may be printed. Once LOG_RATE_BURST copies of it were
+// printed in a window, the rest are only counted and the count goes out with
+// the first one printed after the window.
+static bool logAllow(uintptr_t event, int channel, int *suppressed)
+{
+    uintptr_t key = (event ^ ((uintptr_t)channel * 0x9e3779b1u)) | 1;
+    struct logRate_t *rate = NULL;
+    time_t now = time(NULL);	// vDSO, no syscall
+    time_t window;
+    uintptr_t expected;
+    int loopIdx;
     
-    if( g_processCh == -1 )
-        sprintf(msgBuf, "Main: %s", message);
-    else
-        sprintf(msgBuf, "Ch %i: %s", g_processCh, message);
+    *suppressed = 0;
+    for( loopIdx=0;loopIdx<8;loopIdx++ )
+    {
+        rate = &g_log.rates[(key + loopIdx) % LOG_RATE_EVENTS];
+        expected = 0;
+        if( __atomic_load_n(&rate->key, __ATOMIC_RELAXED) == key ||
+            __atomic_compare_exchange_n(&rate->key, &expected, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+            expected == key )
+            break;
+        rate = NULL;
+    }
     
-    if( !( verbose && !globalArgs.verbose) )
-        ret = vprintf(msgBuf, argptr);
+    // Table full, nothing is held back
+    if( !rate )
+        return true;
     
-    va_end(argptr);
-    return ret;
+    window = __atomic_load_n(&rate->window, __ATOMIC_RELAXED);
+    if( now - window >= LOG_RATE_PERIOD &&
+        __atomic_compare_exchange_n(&rate->window, &window, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+    {
+        __atomic_store_n(&rate->count, 0, __ATOMIC_RELAXED);
+    }
+    
+    if( __atomic_add_fetch(&rate->count, 1, __ATOMIC_RELAXED) > LOG_RATE_BURST )
+    {
+        __atomic_add_fetch(&rate->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *suppressed = __atomic_exchange_n(&rate->suppressed, 0, __ATOMIC_RELAXED);
+    return true;
 }
 
-
-int connectStream(int sockFd, int channel)
+// Claim a slot of the log ring, NULL if the writer is that far behind.
+// Publish it with logPublish().
+static struct logEntry_t *logClaim(void)
 {
-    int retval;
-    char recvBuf[1500];
-    char aloginBuf[] = { /* Packet 182 */
-        0x31, 0x31, 0x31, 0x31, 0x88, 0x00, 0x00, 0x00,
-        0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    struct logEntry_t *e;
+    uint64_t pos = __atomic_load_n(&g_log.writeSeq, __ATOMIC_RELAXED);
+    uint64_t seq;
+    
+    while( 1 )
+    {
+        e = &g_log.slots[pos % LOG_SLOTS];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if( seq == pos )
+        {
+            if( __atomic_compare_exchange_n(&g_log.writeSeq, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                return e;
+        }
+        else if( seq < pos )
+        {
+            __atomic_add_fetch(&g_log.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        else
+            pos = __atomic_load_n(&g_log.writeSeq, __ATOMIC_RELAXED);
+    }
+}
+
+static void logPublish(struct logEntry_t *e)
+{
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Written with write() rather than stdio, so a fork() never finds a stream
+// locked by this thread
+static void logPrint(const struct logEntry_t *e)
+{
+    char out[LOG_LINE + 192];
+    char errBuf[128];
+    int len;
+    
+    if( e->error )
+        len = snprintf(out, sizeof(out), "%s: %s\n", e->text, strerror_r(e->err, errBuf, sizeof(errBuf)));
+    else
+        len = snprintf(out, sizeof(out), "%s", e->text);
+    
+    if( e->suppressed && len < (int)sizeof(out) )
+        len += snprintf(out + len, sizeof(out) - len, "    (%i more like this were suppressed)\n", e->suppressed);
+    
+    if( len > (int)sizeof(out) - 1 )
+        len = sizeof(out) - 1;
+    if( write(e->error ? STDERR_FILENO : STDOUT_FILENO, out, len) < 0 )
+        return;		// Nowhere left to complain to
+}
+
+// Print everything published so far, in order
+static void logDrain(void)
+{
+    static uint64_t droppedShown = 0;
+    struct logEntry_t *e;
+    uint64_t dropped;
+    
+    while( 1 )
+    {
+        e = &g_log.slots[g_log.readSeq % LOG_SLOTS];
+        if( __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != g_log.readSeq + 1 )
+            break;
+        logPrint(e);
+        __atomic_store_n(&e->seq, g_log.readSeq + LOG_SLOTS, __ATOMIC_RELEASE);
+        g_log.readSeq++;
+    }
+    
+    dropped = __atomic_load_n(&g_log.dropped, __ATOMIC_RELAXED);
+    if( dropped != droppedShown )
+    {
+        struct logEntry_t lost = {0};
+        
+        snprintf(lost.text, sizeof(lost.text), "Main: Log writer fell behind, %llu messages lost\n", (unsigned long long)(dropped - droppedShown));
+        logPrint(&lost);
+        droppedShown = dropped;
+    }
+}
+
+static void *logWriter(void *arg)
+{
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+    
+    while( !__atomic_load_n(&g_log.stop, __ATOMIC_ACQUIRE) )
+    {
+        logDrain();
+        syscall(SYS_futex, &g_log.stop, FUTEX_WAIT, 0, &ts, NULL, 0);
+    }
+    logDrain();
+    return NULL;
+}
+
+// The writer thread doesn't survive fork(). What the parent hadn't printed
+// yet is its to print, the child starts with an empty ring.
+static void logForkChild(void)
+{
+    int loopIdx;
+    
+    g_log.running = false;
+    g_log.stop = 0;
+    g_log.readSeq = g_log.writeSeq;
+    for( loopIdx=0;loopIdx<LOG_SLOTS;loopIdx++ )
+        g_log.slots[(g_log.readSeq + loopIdx) % LOG_SLOTS].seq = g_log.readSeq + loopIdx;
+}
+
+// Hand printing over to a thread of its own. Until then, or if it can't be
+// started, messages are printed straight away.
+void logStart(void)
+{
+    static bool once = false;
+    int loopIdx;
+    
+    if( !once )
+    {
+        once = true;
+        for( loopIdx=0;loopIdx<LOG_SLOTS;loopIdx++ )
+            g_log.slots[loopIdx].seq = loopIdx;
+        pthread_atfork(NULL, NULL, logForkChild);
+        atexit(logStop);
+    }
+    
+    if( g_log.running )
+        return;
+    
+    // Anything printed straight away so far goes out first
+    fflush(stdout);
+    g_log.stop = 0;
+    if( pthread_create(&g_log.thread, NULL, logWriter, NULL) != 0 )
+        return;
+    g_log.running = true;
+}
+
+// Print whatever is still queued and stop the writer
+void logStop(void)
+{
+    if( !g_log.running )
+        return;
+    
+    __atomic_store_n(&g_log.stop, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &g_log.stop, FUTEX_WAKE, 1, NULL, NULL, 0);
+    pthread_join(g_log.thread, NULL);
+    g_log.running = false;
+}
+
+int printMessage(bool verbose, const char *message, ...)
+{
+    struct logEntry_t *e;
+    char msgBuf[2048];
+    char line[LOG_LINE];
+    int ret=0;
+    int channel, suppressed, len;
+    va_list argptr;
+    
+    if( verbose && !globalArgs.verbose )
+        return 0;
+    
+    va_start(argptr, message);
+    
+    if( !g_log.running )
+    {
+        if( g_worker != -1 )
+            sprintf(msgBuf, "Worker %i: %s", g_worker+1, message);
+        else if( g_processCh == -1 )
+            sprintf(msgBuf, "Main: %s", message);
+        else
+            sprintf(msgBuf, "Ch %i: %s", g_processCh, message);
+        ret = vprintf(msgBuf, argptr);
+        va_end(argptr);
+        return ret;
+    }
+    
+    // Formatted first, the channel is usually in the text
+    if( g_worker != -1 )
+        len = snprintf(line, sizeof(line), "Worker %i: ", g_worker+1);
+    else if( g_processCh == -1 )
+        len = snprintf(line, sizeof(line), "Main: ");
+    else
+        len = snprintf(line, sizeof(line), "Ch %i: ", g_processCh);
+    ret = len + vsnprintf(line + len, sizeof(line) - len, message, argptr);
+    
+    channel = logChannel(line + len);
+    if( logAllow((uintptr_t)message, channel, &suppressed) && (e = logClaim()) )
+    {
+        memcpy(e->text, line, sizeof(line));
+        e->event = (uintptr_t)message;
+        e->channel = channel;
+        e->err = 0;
+        e->error = false;
+        e->suppressed = suppressed;
+        logPublish(e);
+    }
+    
+    va_end(argptr);
+    return ret;
+}
+
+// printError() through the log ring
+void printError(const char *message)
+{
+    struct logEntry_t *e;
+    uintptr_t hash = 2166136261u;
+    int err = errno;
+    int channel, suppressed;
+    const char *c;
+    
+    if( !g_log.running )
+    {
+        perror(message);
+        return;
+    }
+    
+    // The text is built in g_errBuf, so it names the event rather than its address
+    for( c=message;*c;c++ )
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    
+    channel = logChannel(message);
+    if( logAllow(hash, channel, &suppressed) && (e = logClaim()) )
+    {
+        snprintf(e->text, sizeof(e->text), "%s", message);
+        e->event = hash;
+        e->channel = channel;
+        e->err = err;
+        e->error = true;
+        e->suppressed = suppressed;
+        logPublish(e);
+    }
+    errno = err;
+}
+
+void nalFilterReset(struct nalFilter_t *f, unsigned int interval)
+{
+    memset(f, 0, sizeof(*f));
+    f->nalType = -1;
+    f->pictureEnd = -1;
+    f->interval = interval;
+}
+
+// Decide what happens to the NAL whose header and first payload byte are known
+static int nalFilterStart(struct nalFilter_t *f, unsigned char firstByte, unsigned char *out, int outSize)
+{
+    static const unsigned char startCode[] = {0x00, 0x00, 0x00, 0x01};
+    int o = 0;
+    bool newPicture;
+    
+    if( f->nalType != 5 )
+        return 0;
+    
+    // first_mb_in_slice is ue(v), its leading bit is set only when it is 0
+    newPicture = (firstByte & 0x80) != 0;
+    
+    if( newPicture )
+        f->passPicture = (f->keyframes++ % f->interval) == 0 && !f->hold;
+    
+    // Without parameter sets the decoder can't use the picture anyway
+    if( !f->passPicture || !f->spsLen || !f->ppsLen )
+        return 0;
+    
+    if( newPicture && outSize < f->spsLen + f->ppsLen + 3 * (int)sizeof(startCode) )
+        f->overflow += f->spsLen + f->ppsLen + 2 * sizeof(startCode);
+    else if( newPicture )
+    {
+        memcpy(out + o, startCode, sizeof(startCode));
+        o += sizeof(startCode);
+        memcpy(out + o, f->sps, f->spsLen);
+        o += f->spsLen;
+        memcpy(out + o, startCode, sizeof(startCode));
+        o += sizeof(startCode);
+        memcpy(out + o, f->pps, f->ppsLen);
+        o += f->ppsLen;
+    }
+    
+    if( outSize - o >= (int)sizeof(startCode) + 1 )
+    {
+        memcpy(out + o, startCode, sizeof(startCode));
+        o += sizeof(startCode);
+        out[o++] = f->nalHeader;
+        f->forward = true;
+        f->inPicture = true;
+    }
+    else
+        f->overflow += sizeof(startCode) + 1;
+    return o;
+}
+
+// Add one byte to the current NAL, wherever that NAL is going
+static inline void nalFilterPut(struct nalFilter_t *f, unsigned char b, unsigned char *out, int *o, int outSize)
+{
+    if( f->forward && *o < outSize )
+        out[(*o)++] = b;
+    else if( f->forward )
+        f->overflow++;
+    else if( f->capture )
+    {
+        if( f->captureLen < NAL_PARAM_MAX )
+            f->captureBuf[f->captureLen++] = b;
+        else
+            f->capture = 0;		// Too big to keep, use the previous one
+    }
+}
+
+// Same for a run of bytes
+static void nalFilterPutRun(struct nalFilter_t *f, const unsigned char *data, int n, unsigned char *out, int *o, int outSize)
+{
+    int k;
+    
+    if( f->forward )
+    {
+        k = (n < outSize - *o) ? n : outSize - *o;
+        memcpy(out + *o, data, k);
+        *o += k;
+        f->overflow += n - k;
+        return;
+    }
+    
+    if( n && f->capture )
+    {
+        if( n > NAL_PARAM_MAX - f->captureLen )
+            f->capture = 0;
+        else
+        {
+            memcpy(f->captureBuf + f->captureLen, data, n);
+            f->captureLen += n;
+        }
+    }
+}
+
+// Filter 'len' bytes of Annex-B stream into 'out', returns the number of bytes written.
+// f->overflow is set to what had to be left out for lack of room.
+int nalFilter(struct nalFilter_t *f, const unsigned char *in, int len, unsigned char *out, int outSize)
+{
+    static const unsigned char zeros[3] = {0};
+    int i, o = 0;
+    int end, held, n;
+    unsigned char b;
+    
+    f->pictureEnd = -1;
+    f->overflow = 0;
+    
+    for( i=0;i<len;i++ )
+    {
+        // Past the bytes that decide where a NAL goes, it is copied up to the
+        // next start code in one go. Zeros held back from before come first.
+        if( f->nalType == -1 || (f->nalType != -2 && f->nalBytes > 1) )
+        {
+            held = f->zeros;
+            end = nalScan(in, i, len, &f->zeros);
+            n = held + (end - i) - f->zeros;
+            nalFilterPutRun(f, zeros, (n < held) ? n : held, out, &o, outSize);
+            if( n > held )
+                nalFilterPutRun(f, in + i, n - held, out, &o, outSize);
+            i = end;
+            if( i == len )
+                break;
+        }
+        
+        b = in[i];
+        
+        // A slice's first payload byte is zero when first_mb_in_slice is large, and
+        // decides whether it starts a picture. Held back as a zero, it would only be
+        // written once that decision was made on the wrong byte.
+        if( b == 0x00 && !(f->nalType == 5 && f->nalBytes == 1) )
+        {
+            // Only the last three zeros can belong to a start code
+            if( ++f->zeros > 3 )
+            {
+                nalFilterPut(f, 0x00, out, &o, outSize);
+                f->zeros = 3;
+            }
+            continue;
+        }
+        
+        if( b == 0x01 && f->zeros >= 2 )
+        {
+            // End of the previous NAL, keep it if it was a parameter set
+            if( f->capture == 7 )
+            {
+                memcpy(f->sps, f->captureBuf, f->captureLen);
+                f->spsLen = f->captureLen;
+            }
+            else if( f->capture == 8 )
+            {
+                memcpy(f->pps, f->captureBuf, f->captureLen);
+                f->ppsLen = f->captureLen;
+            }
+            
+            f->zeros = 0;
+            f->nalType = -2;
+            f->nalBytes = 0;
+            f->forward = false;
+            f->capture = 0;
+            continue;
+        }
+        
+        for( ;f->zeros > 0;f->zeros-- )
+            nalFilterPut(f, 0x00, out, &o, outSize);
+        
+        if( f->nalType == -2 )
+        {
+            f->nalHeader = b;
+            f->nalType = b & 0x1f;
+            
+            // Anything but another slice ends the picture being passed
+            if( f->inPicture && f->nalType != 5 )
+            {
+                f->inPicture = false;
+                f->pictureEnd = o;
+            }
+            
+            if( f->nalType == 7 || f->nalType == 8 )
+            {
+                f->capture = f->nalType;
+                f->captureLen = 0;
+            }
+        }
+        else if( f->nalBytes == 1 )
+        {
+            // So does a slice that starts a new picture
+            if( f->inPicture && f->nalType == 5 && (b & 0x80) )
+            {
+                f->inPicture = false;
+                f->pictureEnd = o;
+            }
+            o += nalFilterStart(f, b, out + o, outSize - o);
+        }
+        
+        f->nalBytes++;
+        nalFilterPut(f, b, out, &o, outSize);
+    }
+    return o;
+}
+
+void dvrFramerReset(struct dvrFramer_t *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->frame.channel = -1;
+}
+
+static inline uint32_t readLE32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Whether a message body starting with these bytes is H.264. The first piece
+// of a body may be only a few bytes of its start code.
+static inline bool dvrIsVideo(const unsigned char *data, int len)
+{
+    static const unsigned char startCode[] = {0x00, 0x00, 0x00, 0x01};
+    
+    if( len >= 4 )
+        return memcmp(data, startCode, 4) == 0 || memcmp(data, startCode + 1, 3) == 0;
+    return memcmp(data, startCode, len) == 0 || memcmp(data, startCode + 1, len) == 0;
+}
+
+// Feed stream data through the framer, payload is called with each piece of
+// a message body and the header it came with. Nothing is copied or allocated.
+// Bodies that don't start with a start code (replies, alarms, audio) are dropped.
+void dvrFramerParse(struct dvrFramer_t *f, const unsigned char *data, int len, dvrPayload_t payload, void *ctx)
+{
+    uint32_t msgLen;
+    int n;
+    
+    if( f->raw )
+    {
+        if( len > 0 )
+            payload(ctx, &f->frame, data, len);
+        return;
+    }
+    
+    while( len > 0 )
+    {
+        if( f->remaining )
+        {
+            n = (len < f->remaining) ? len : (int)f->remaining;
+            if( f->frame.offset == 0 )
+                f->video = dvrIsVideo(data, n);
+            if( f->frame.sequence > f->skipMessages && f->video )
+                payload(ctx, &f->frame, data, n);
+            f->frame.offset += n;
+            f->remaining -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        
+        f->hdr[f->hdrLen++] = *data++;
+        len--;
+        
+        // Resync on the 0x31313131 magic
+        if( f->hdrLen <= 4 )
+        {
+            if( f->hdr[f->hdrLen-1] != 0x31 )
+            {
+                f->resyncs += f->hdrLen;
+                f->lost += f->hdrLen;
+                f->hdrLen = 0;
+                
+                // Some firmware only frames the login replies, or nothing at all
+                if( f->lost > DVR_SYNC_LIMIT )
+                {
+                    printMessage(true, "No DVR message headers found, passing the stream through as is\n");
+                    f->raw = true;
+                    f->frame.offset = 0;
+                    f->frame.length = 0;
+                    dvrFramerParse(f, data, len, payload, ctx);
+                    return;
+                }
+            }
+            continue;
+        }
+        
+        if( f->hdrLen < DVR_HDR_SIZE )
+            continue;
+        f->hdrLen = 0;
+        
+        // The length field counts everything after itself
+        msgLen = readLE32(f->hdr + 4);
+        if( msgLen < DVR_HDR_SIZE - 8 || msgLen > DVR_MAX_MESSAGE )
+        {
+            f->resyncs += DVR_HDR_SIZE;
+            f->lost += DVR_HDR_SIZE;
+            continue;
+        }
+        
+        f->lost = 0;
+        f->remaining = msgLen - (DVR_HDR_SIZE - 8);
+        f->frame.type = f->hdr[8] | (f->hdr[9] << 8);
+        f->frame.channel = (int)readLE32(f->hdr + 12);
+        f->frame.length = f->remaining;
+        f->frame.offset = 0;
+        f->frame.sequence = ++f->messages;
+    }
+}
+
+// Type of the NAL the data starts with, -1 if it doesn't start with a start code
+static inline int nalFirstType(const unsigned char *data, int len)
+{
+    if( len < 5 || data[0] || data[1] )
+        return -1;
+    
+    return data[(data[2] == 1) ? 3 : 4] & 0x1f;
+}
+
+// True if the data starts with a SPS or IDR slice
+static inline bool nalIsKeyframe(const unsigned char *data, int len)
+{
+    int nalType = nalFirstType(data, len);
+    
+    return nalType == 7 || nalType == 5;
+}
+
+// Count a frame, and the GOP it ends if it is a keyframe
+static void statsCount(struct chStats_t *st, bool key)
+{
+    uint64_t frames;
+    
+    statsAdd(&st->frames, 1);
+    
+    if( !key )
+        return;
+    
+    frames = statsGet(&st->frames);
+    statsAdd(&st->keyframes, 1);
+    __atomic_store_n(&st->gop, frames - statsGet(&st->lastKeyframe), __ATOMIC_RELAXED);
+    __atomic_store_n(&st->lastKeyframe, frames, __ATOMIC_RELAXED);
+}
+
+// Count a DVR message as a frame, and as a keyframe if it starts with a SPS or IDR slice
+void statsFrame(struct chStats_t *st, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    if( !frame->sequence || frame->offset )
+        return;
+    
+    statsCount(st, nalIsKeyframe(data, len));
+}
+
+// Score a DVR message for -l and -o. Only messages holding a P slice count,
+// keyframes are big whatever the scene is doing.
+void activityFrame(struct channel_t *ch, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    struct activity_t *a = &ch->act;
+    uint64_t quiet, score;
+    
+    if( !(globalArgs.adaptiveSnapshot || globalArgs.eventRecord) || !frame->sequence || frame->offset || nalFirstType(data, len) != 1 )
+        return;
+    
+    if( !a->frames++ )
+        a->recent = a->quiet = (uint64_t)frame->length * 8;
+    
+    a->recent += frame->length - (a->recent >> 3);
+    if( a->recent < a->quiet )
+        a->quiet = a->recent;
+    else
+        a->quiet += (a->recent - a->quiet) >> 10;
+    
+    quiet = (a->quiet > ACTIVITY_FLOOR * 8) ? a->quiet : ACTIVITY_FLOOR * 8;
+    score = a->recent * 100 / quiet;
+    __atomic_store_n(&ch->stats->activity, score, __ATOMIC_RELAXED);
+    
+    if( score < ACTIVITY_THRESHOLD || a->frames < ACTIVITY_WARMUP )
+        return;
+    
+    if( g_now >= a->activeUntil && globalArgs.verbose )
+        printMessage(true, "Ch %i: Motion, P-frames at %i%% of the quiet level\n", ch->index+1, (int)score);
+    a->activeUntil = g_now + ACTIVITY_HOLD;
+}
+
+// True while there is motion, or the channel hasn't been scored enough to tell
+bool activityActive(const struct channel_t *ch)
+{
+    return ch->act.frames < ACTIVITY_WARMUP || g_now < ch->act.activeUntil;
+}
+
+// With -l a static scene gets a JPEG every ACTIVITY_IDLE_PERIOD seconds, the
+// keyframe filter holds back the IDR pictures in between
+bool activityHold(const struct channel_t *ch)
+{
+    return globalArgs.adaptiveSnapshot && !activityActive(ch) && g_now - ch->lastSnapshot < ACTIVITY_IDLE_PERIOD;
+}
+
+static void statsPrint(FILE *fp, const char *name, const char *type, const char *help, size_t field)
+{
+    int loopIdx;
+    
+    fprintf(fp, "# HELP zmodopipe_%s %s\n# TYPE zmodopipe_%s %s\n", name, help, name, type);
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        if( g_chConfig[loopIdx].streamed )
+            fprintf(fp, "zmodopipe_%s{channel=\"%i\"} %llu\n", name, loopIdx+1,
+                    (unsigned long long)statsGet((uint64_t*)((char*)&g_stats->ch[loopIdx] + field)));
+    }
+}
+
+// Write the counters of every channel to the -m file in the Prometheus text
+// format, at most every STATS_INTERVAL seconds. Any process may call this, the
+// first one to claim the slot writes the file.
+void statsWrite(void)
+{
+    char tmpName[300];
+    int64_t next = __atomic_load_n(&g_stats->nextWrite, __ATOMIC_RELAXED);
+    int loopIdx;
+    FILE *fp;
+    
+    if( !globalArgs.statsFile || g_now < next )
+        return;
+    
+    if( !__atomic_compare_exchange_n(&g_stats->nextWrite, &next, (int64_t)g_now + STATS_INTERVAL, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        return;
+    
+    // Readers only ever see a complete file
+    snprintf(tmpName, sizeof(tmpName), "%s.%i", globalArgs.statsFile, (int)getpid());
+    
+    if( (fp = fopen(tmpName, "w")) == NULL )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to write %.200s\n", tmpName);
+        printError(g_errBuf);
+        return;
+    }
+    
+    statsPrint(fp, "received_bytes_total", "counter", "Stream bytes received from the DVR.", offsetof(struct chStats_t, bytes));
+    statsPrint(fp, "frames_total", "counter", "DVR messages received.", offsetof(struct chStats_t, frames));
+    statsPrint(fp, "keyframes_total", "counter", "DVR messages starting with a SPS or IDR slice.", offsetof(struct chStats_t, keyframes));
+    statsPrint(fp, "keyframe_interval_frames", "gauge", "Frames between the last two keyframes.", offsetof(struct chStats_t, gop));
+    statsPrint(fp, "dropped_bytes_total", "counter", "Bytes the reader couldn't take.", offsetof(struct chStats_t, droppedBytes));
+    statsPrint(fp, "dropped_frames_total", "counter", "Frames dropped from the queue.", offsetof(struct chStats_t, droppedFrames));
+    statsPrint(fp, "connects_total", "counter", "Stream requests made to the DVR.", offsetof(struct chStats_t, connects));
+    statsPrint(fp, "ffmpeg_starts_total", "counter", "ffmpeg processes started.", offsetof(struct chStats_t, ffmpegStarts));
+    if( globalArgs.recordDir )
+        statsPrint(fp, "recorded_bytes_total", "counter", "Stream bytes written to the recording.", offsetof(struct chStats_t, recordedBytes));
+    if( globalArgs.adaptiveSnapshot || globalArgs.eventRecord )
+        statsPrint(fp, "activity_percent", "gauge", "Size of the latest P-frames as a percentage of a static scene's.", offsetof(struct chStats_t, activity));
+#ifdef BUILTIN_SNAPSHOT
+    if( g_snapPool.workers )
+    {
+        statsPrint(fp, "snapshots_replaced_total", "counter", "Keyframes replaced by a newer one before a snapshot worker took them.", offsetof(struct chStats_t, snapshotsReplaced));
+        statsPrint(fp, "snapshots_late_total", "counter", "JPEGs the snapshot workers finished after their deadline.", offsetof(struct chStats_t, snapshotsLate));
+    }
+#endif
+    
+    fprintf(fp, "# HELP zmodopipe_snapshot_age_seconds Time since the JPEG was last written.\n# TYPE zmodopipe_snapshot_age_seconds gauge\n");
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        int64_t last = __atomic_load_n(&g_stats->ch[loopIdx].lastSnapshot, __ATOMIC_RELAXED);
+        
+        if( g_chConfig[loopIdx].streamed && last )
+            fprintf(fp, "zmodopipe_snapshot_age_seconds{channel=\"%i\"} %lli\n", loopIdx+1, (long long)(g_now - last));
+    }
+    
+    if( fclose(fp) != 0 || rename(tmpName, globalArgs.statsFile) != 0 )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to write %.200s\n", globalArgs.statsFile);
+        printError(g_errBuf);
+        unlink(tmpName);
+    }
+}
+
+struct dvrStrip_t {
+    unsigned char *out;
+    int len;
+    struct channel_t *ch;
+};
+
+static void dvrStripPayload(void *ctx, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    struct dvrStrip_t *strip = ctx;
+    
+    // With a -S main stream of its own, the frames are counted and published from that
+    if( !strip->ch->mainConn )
+    {
+        statsFrame(strip->ch->stats, frame, data, len);
+        channelPublish(strip->ch, frame, data, len);
+    }
+    activityFrame(strip->ch, frame, data, len);
+    memmove(strip->out + strip->len, data, len);	// Never ahead of data
+    strip->len += len;
+}
+
+// Remove the DVR framing from a single channel stream in place. Returns the
+// number of H.264 bytes left at the start of buf.
+int dvrFramerStrip(struct dvrFramer_t *f, unsigned char *buf, int len, struct channel_t *ch)
+{
+    struct dvrStrip_t strip = { buf, 0, ch };
+    
+    dvrFramerParse(f, buf, len, dvrStripPayload, &strip);
+    statsAdd(&ch->stats->bytes, strip.len);
+    return strip.len;
+}
+
+static size_t frameRingDataOffset(void)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    
+    return (sizeof(struct zmRingHdr_t) + page - 1) & ~(page - 1);
+}
+
+// The -q size, rounded up to a power of two
+static size_t frameRingDataSize(void)
+{
+    size_t dataSize = 65536;
+    
+    while( dataSize < (size_t)globalArgs.frameRingSize * 1024 )
+        dataSize <<= 1;
+    return dataSize;
+}
+
+// Map the ring kept in 'fd', setting it up unless it already holds one. 'fd' is closed.
+static int frameRingMap(struct frameRing_t *r, int fd, size_t dataOffset, size_t dataSize)
+{
+    if( ftruncate(fd, dataOffset + dataSize) != 0 ||
+        zmRingMap(fd, dataOffset, dataSize, PROT_READ | PROT_WRITE, &r->hdr, &r->data) != 0 )
+    {
+        close(fd);
+        r->hdr = NULL;
+        return -1;
+    }
+    close(fd);
+    
+    if( r->hdr->magic != ZMRING_MAGIC )
+    {
+        r->hdr->slotCount = ZMRING_SLOTS;
+        r->hdr->dataSize = dataSize;
+        r->hdr->dataOffset = dataOffset;
+        __atomic_store_n(&r->hdr->magic, ZMRING_MAGIC, __ATOMIC_RELEASE);
+    }
+    
+    r->next = r->hdr->writePos;
+    r->active = false;
+    return 0;
+}
+
+// Create the channel's shared-memory ring, or take over the one an earlier
+// run left behind so readers that are still attached carry on.
+int frameRingOpen(struct channel_t *ch)
+{
+    struct zmRingHdr_t old;
+    size_t dataOffset = frameRingDataOffset();
+    size_t dataSize = frameRingDataSize();
+    ssize_t len;
+    char name[64];
+    int fd;
+    
+    snprintf(name, sizeof(name), ZMRING_NAME, ch->index+1);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    
+    // A ring of another size is replaced, shrinking it would fault its readers
+    if( fd != -1 && (len = pread(fd, &old, offsetof(struct zmRingHdr_t, writeSeq), 0)) != 0 &&
+        (len != offsetof(struct zmRingHdr_t, writeSeq) || old.magic != ZMRING_MAGIC || old.slotCount != ZMRING_SLOTS ||
+         old.dataSize != dataSize || old.dataOffset != dataOffset) )
+    {
+        close(fd);
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+    
+    if( fd == -1 || frameRingMap(&ch->pub, fd, dataOffset, dataSize) != 0 )
+    {
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Failed to create shared-memory ring\n");
+        printError(g_errBuf);
+        return -1;
+    }
+    
+    // The MPEG-TS for -w is muxed once per frame into a private ring of its own
+    if( globalArgs.httpPort && ((fd = memfd_create("zmodopipe-ts", MFD_CLOEXEC)) == -1 ||
+                                frameRingMap(&ch->ts.ring, fd, dataOffset, dataSize) != 0) )
+    {
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Failed to create MPEG-TS ring\n");
+        printError(g_errBuf);
+    }
+    return 0;
+}
+
+static void frameRingStart(struct frameRing_t *r, bool key)
+{
+    r->start = r->next;
+    r->len = 0;
+    r->key = key;
+    r->active = true;
+}
+
+// Copy more of the frame being written into the ring
+static void frameRingAppend(struct frameRing_t *r, const unsigned char *data, int len)
+{
+    struct zmRingHdr_t *hdr = r->hdr;
+    
+    if( r->len + len > hdr->dataSize )
+    {
+        r->active = false;		// Bigger than the ring, dropped
+        return;
+    }
+    
+    // Claim the space before overwriting it, so readers can tell their frame has gone
+    r->next = r->start + r->len + len;
+    __atomic_store_n(&hdr->writePos, r->next, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    
+    // The data is mapped twice in a row, so a frame never has to wrap
+    memcpy(r->data + ((r->start + r->len) & (hdr->dataSize - 1)), data, len);
+    r->len += len;
+}
+
+// Make the frame that has been written visible to readers
+static void frameRingCommit(struct frameRing_t *r, int64_t usec)
+{
+    struct zmRingHdr_t *hdr = r->hdr;
+    struct zmRingSlot_t *slot;
+    uint64_t seq = hdr->writeSeq + 1;
+    
+    slot = &hdr->slots[seq % ZMRING_SLOTS];
+    
+    // Readers that catch the slot half written see the sequence change
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->pos = r->start;
+    slot->len = r->len;
+    slot->flags = r->key ? ZMRING_KEY : 0;
+    slot->usec = usec;
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    
+    if( r->key )
+        __atomic_store_n(&hdr->keySeq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->writeSeq, seq, __ATOMIC_SEQ_CST);
+    
+    // Readers can't register on a read-only mapping, so wake them every frame
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    r->usec = usec;
+    r->active = false;
+}
+
+// Copy a piece of a DVR message into the ring. Returns true once the whole
+// message is in and has been published, readers only ever see complete frames.
+bool frameRingPut(struct frameRing_t *r, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    struct timespec ts;
+    
+    if( !r->hdr || len <= 0 )
+        return false;
+    
+    // An unframed stream has every chunk at offset 0, each one is a frame
+    if( frame->offset == 0 )
+    {
+        frameRingStart(r, nalIsKeyframe(data, len));
+        if( frame->length > r->hdr->dataSize )
+            r->active = false;
+    }
+    
+    if( !r->active )
+        return false;
+    
+    frameRingAppend(r, data, len);
+    
+    if( !r->active || (frame->length && frame->offset + len < frame->length) )
+        return false;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    frameRingCommit(r, (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    return true;
+}
+
+// MPEG-2 CRC, as used by the PAT and PMT
+static uint32_t tsCrc32(const unsigned char *data, int len)
+{
+    uint32_t crc = 0xffffffff;
+    int i, bit;
+    
+    for( i=0;i<len;i++ )
+    {
+        crc ^= (uint32_t)data[i] << 24;
+        for( bit=0;bit<8;bit++ )
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+// Add one TS packet with up to 184 bytes of payload to the ring. Room the
+// payload doesn't use goes to the adaptation field, which also carries the
+// PCR unless 'pcr' is -1. Returns the payload bytes taken.
+static int tsPacket(struct tsMux_t *ts, int pid, bool unitStart, unsigned char *cc, const unsigned char *payload, int len, int64_t pcr)
+{
+    unsigned char pkt[TS_PACKET_SIZE];
+    int room = TS_PACKET_SIZE - 4 - ((pcr >= 0) ? 8 : 0);
+    int afLen;			// Adaptation field including its length byte
+    
+    if( len > room )
+        len = room;
+    afLen = TS_PACKET_SIZE - 4 - len;
+    
+    pkt[0] = 0x47;
+    pkt[1] = (unitStart ? 0x40 : 0x00) | (pid >> 8);
+    pkt[2] = pid & 0xff;
+    pkt[3] = (afLen ? 0x30 : 0x10) | (*cc & 0x0f);
+    (*cc)++;
+    
+    if( afLen )
+    {
+        pkt[4] = afLen - 1;
+        if( afLen > 1 )
+        {
+            pkt[5] = (pcr >= 0) ? 0x10 : 0x00;
+            memset(pkt + 6, 0xff, afLen - 2);
+            if( pcr >= 0 )
+            {
+                pkt[6] = pcr >> 25;
+                pkt[7] = pcr >> 17;
+                pkt[8] = pcr >> 9;
+                pkt[9] = pcr >> 1;
+                pkt[10] = ((pcr & 1) << 7) | 0x7e;
+                pkt[11] = 0;
+            }
+        }
+    }
+    
+    memcpy(pkt + 4 + afLen, payload, len);
+    frameRingAppend(&ts->ring, pkt, sizeof(pkt));
+    return len;
+}
+
+// Put a PSI section (CRC excluded from 'len') in a packet of its own
+static void tsSection(struct tsMux_t *ts, int pid, unsigned char *cc, const unsigned char *section, int len)
+{
+    unsigned char buf[TS_PACKET_SIZE - 4];
+    uint32_t crc = tsCrc32(section, len);
+    
+    memset(buf, 0xff, sizeof(buf));
+    buf[0] = 0;			// pointer_field
+    memcpy(buf + 1, section, len);
+    buf[len+1] = crc >> 24;
+    buf[len+2] = crc >> 16;
+    buf[len+3] = crc >> 8;
+    buf[len+4] = crc;
+    tsPacket(ts, pid, true, cc, buf, sizeof(buf), -1);
+}
+
+// Wrap one frame of H.264 in a PES packet and split that into TS packets.
+// Keyframes get the PAT and PMT in front, so viewers can join at any of them.
+static void tsMuxFrame(struct tsMux_t *ts, const unsigned char *data, uint32_t len, bool key, int64_t usec)
+{
+    static const unsigned char pat[] = {
+        0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xe0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xff
+    };
+    static const unsigned char pmt[] = {
+        0x02, 0xb0, 0x12, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff, 0xf0, 0x00,
+        0x1b, 0xe0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xff, 0xf0, 0x00
+    };
+    unsigned char buf[TS_PACKET_SIZE];
+    int64_t pcr = (usec * 9 / 100) & 0x1ffffffffLL;	// 90 kHz from the arrival time
+    int64_t pts = (pcr + 9000) & 0x1ffffffffLL;		// Shown 100 ms later
+    int hdrLen, n;
+    
+    if( !ts->ring.hdr )
+        return;
+    
+    frameRingStart(&ts->ring, key);
+    
+    if( key )
+    {
+        tsSection(ts, 0x0000, &ts->ccPat, pat, sizeof(pat));
+        tsSection(ts, TS_PID_PMT, &ts->ccPmt, pmt, sizeof(pmt));
+    }
+    
+    // PES header with the PTS, then an access unit delimiter
+    hdrLen = 0;
+    buf[hdrLen++] = 0x00;
+    buf[hdrLen++] = 0x00;
+    buf[hdrLen++] = 0x01;
+    buf[hdrLen++] = 0xe0;
+    buf[hdrLen++] = 0x00;		// Unbounded length, allowed for video
+    buf[hdrLen++] = 0x00;
+    buf[hdrLen++] = 0x80;
+    buf[hdrLen++] = 0x80;		// PTS only
+    buf[hdrLen++] = 5;
+    buf[hdrLen++] = 0x21 | ((pts >> 29) & 0x0e);
+    buf[hdrLen++] = pts >> 22;
+    buf[hdrLen++] = ((pts >> 14) & 0xfe) | 1;
+    buf[hdrLen++] = pts >> 7;
+    buf[hdrLen++] = ((pts << 1) & 0xfe) | 1;
+    buf[hdrLen++] = 0x00;
+    buf[hdrLen++] = 0x00;
+    buf[hdrLen++] = 0x00;
+    buf[hdrLen++] = 0x01;
+    buf[hdrLen++] = 0x09;
+    buf[hdrLen++] = 0xf0;
+    
+    // The first packet carries the PCR and the PES header
+    n = TS_PACKET_SIZE - 4 - 8 - hdrLen;
+    if( n > len )
+        n = len;
+    memcpy(buf + hdrLen, data, n);
+    tsPacket(ts, TS_PID_VIDEO, true, &ts->ccVideo, buf, hdrLen + n, pcr);
+    data += n;
+    len -= n;
+    
+    while( len > 0 && ts->ring.active )
+    {
+        n = tsPacket(ts, TS_PID_VIDEO, false, &ts->ccVideo, data, len, -1);
+        data += n;
+        len -= n;
+    }
+    
+    if( ts->ring.active )
+        frameRingCommit(&ts->ring, usec);
+}
+
+// A piece of the channel's stream has arrived. Complete frames go to the
+// shared-memory ring, the MPEG-TS ring and on to any HTTP viewers.
+void channelPublish(struct channel_t *ch, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    struct frameRing_t *r = &ch->pub;
+    
+    if( !frameRingPut(r, frame, data, len) )
+        return;
+    
+    tsMuxFrame(&ch->ts, r->data + (r->start & (r->hdr->dataSize - 1)), r->len, r->key, r->usec);
+    
+    if( globalArgs.httpPort )
+        httpChannelFrame(ch);
+}
+
+#ifdef BUILTIN_SNAPSHOT
+struct jpegError_t {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+// libjpeg's default handler calls exit(), return to snapshotWriteJpeg() instead
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(((struct jpegError_t*)cinfo->err)->jump, 1);
+}
+
+static int snapshotOpen(struct snapshot_t *snap)
+{
+    const AVCodec *decoder = avcodec_find_decoder(AV_CODEC_ID_H264);
+    
+    if( !decoder )
+        return -1;
+    
+    snap->codec = avcodec_alloc_context3(decoder);
+    snap->pkt = av_packet_alloc();
+    snap->frame = av_frame_alloc();
+    snap->rgb = malloc(SNAPSHOT_WIDTH * SNAPSHOT_HEIGHT * 3);
+    
+    if( !snap->codec || !snap->pkt || !snap->frame || !snap->rgb )
+    {
+        snapshotFreeDecoder(snap);
+        return -1;
+    }
+    
+    // Every packet is a complete keyframe, don't hold frames back for reordering or threads
+    snap->codec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    snap->codec->thread_count = 1;
+    
+    if( avcodec_open2(snap->codec, decoder, NULL) < 0 )
+    {
+        snapshotFreeDecoder(snap);
+        return -1;
+    }
+    return 0;
+}
+
+static void snapshotFreeDecoder(struct snapshot_t *snap)
+{
+    avcodec_free_context(&snap->codec);
+    av_packet_free(&snap->pkt);
+    av_frame_free(&snap->frame);
+    sws_freeContext(snap->sws);
+    snap->sws = NULL;
+    free(snap->rgb);
+    snap->rgb = NULL;
+}
+
+// Drop the decoder and the keyframes collected so far. While the -y workers
+// run one of them may be decoding for the channel, so it's told to start
+// afresh with the next keyframe instead.
+void snapshotClose(struct snapshot_t *snap)
+{
+    if( g_snapPool.workers )
+    {
+        pthread_mutex_lock(&g_snapPool.lock);
+        snap->reset = true;
+        snap->pendingLen = 0;
+        pthread_mutex_unlock(&g_snapPool.lock);
+        snap->pictureLen = 0;
+        return;
+    }
+    
+    snapshotFreeDecoder(snap);
+    free(snap->picture);
+    snap->picture = NULL;
+    snap->pictureLen = snap->pictureSize = 0;
+    free(snap->pending);
+    snap->pending = NULL;
+    snap->pendingLen = snap->pendingSize = 0;
+    free(snap->work);
+    snap->work = NULL;
+    snap->workLen = snap->workSize = 0;
+    snapshotJpegRelease(snap->done);
+    snap->done = NULL;
+    snap->reset = false;
+}
+
+// Compress the decoded frame. Also run by the -y workers, so nothing shared
+// is touched: the caller publishes the JPEG.
+static struct snapshotJpeg_t *snapshotWriteJpeg(struct channel_t *ch, AVFrame *frame)
+{
+    struct snapshot_t *snap = &ch->snap;
+    struct jpeg_compress_struct cinfo;
+    struct jpegError_t jerr;
+    uint8_t *dst[4] = {snap->rgb, NULL, NULL, NULL};
+    int dstStride[4] = {SNAPSHOT_WIDTH * 3, 0, 0, 0};
+    struct snapshotJpeg_t *jpeg;
+    JSAMPROW row;
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *fp;
+    
+    // swscale picks the SIMD code path for the CPU it runs on
+    snap->sws = sws_getCachedContext(snap->sws, frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                     SNAPSHOT_WIDTH, SNAPSHOT_HEIGHT, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    if( !snap->sws )
+        return NULL;
+    
+    sws_scale(snap->sws, (const uint8_t * const*)frame->data, frame->linesize, 0, frame->height, dst, dstStride);
+    
+    // Compressed into memory, snapshotPublish() writes the file
+    fp = open_memstream(&buf, &size);
+    if( !fp )
+    {
+        printMessage(true, "Ch %i: Failed to open snapshot: %s\n", ch->index+1, strerror(errno));
+        return NULL;
+    }
+    
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpegErrorExit;
+    
+    if( setjmp(jerr.jump) )
+    {
+        jpeg_destroy_compress(&cinfo);
+        fclose(fp);
+        free(buf);
+        return NULL;
+    }
+    
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, fp);
+    cinfo.image_width = SNAPSHOT_WIDTH;
+    cinfo.image_height = SNAPSHOT_HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, SNAPSHOT_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    
+    while( cinfo.next_scanline < cinfo.image_height )
+    {
+        row = snap->rgb + cinfo.next_scanline * SNAPSHOT_WIDTH * 3;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    
+    fclose(fp);
+    
+    jpeg = snapshotJpegAlloc(size);
+    if( jpeg )
+        memcpy(jpeg->data, buf, size);
+    free(buf);
+    return jpeg;
+}
+
+// Decode a keyframe into a JPEG, NULL if it's broken. The padding behind the
+// picture is cleared for the decoder.
+static struct snapshotJpeg_t *snapshotMake(struct channel_t *ch, unsigned char *picture, int len)
+{
+    struct snapshot_t *snap = &ch->snap;
+    struct snapshotJpeg_t *jpeg = NULL, *next;
+    
+    memset(picture + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    snap->pkt->data = picture;
+    snap->pkt->size = len;
+    
+    // A broken picture is simply skipped, the next keyframe starts clean
+    if( avcodec_send_packet(snap->codec, snap->pkt) < 0 )
+        return NULL;
+    
+    while( avcodec_receive_frame(snap->codec, snap->frame) == 0 )
+    {
+        if( (next = snapshotWriteJpeg(ch, snap->frame)) )
+        {
+            snapshotJpegRelease(jpeg);
+            jpeg = next;
+        }
+    }
+    return jpeg;
+}
+
+static time_t snapshotPeriod(struct channel_t *ch)
+{
+    return (globalArgs.adaptiveSnapshot && activityActive(ch)) ? ACTIVITY_SNAPSHOT_PERIOD : SNAPSHOT_PERIOD;
+}
+
+// Decode the keyframe collected in snap->picture if a JPEG is due
+static void snapshotDecode(struct channel_t *ch)
+{
+    struct snapshot_t *snap = &ch->snap;
+    struct snapshotJpeg_t *jpeg;
+    
+    if( snap->pictureLen <= 0 || g_now < snap->nextJpeg )
+        return;
+    
+    if( (jpeg = snapshotMake(ch, snap->picture, snap->pictureLen)) )
+    {
+        snapshotPublish(ch, jpeg);
+        snap->nextJpeg = g_now + snapshotPeriod(ch);
+    }
+}
+
+static void snapshotSwap(unsigned char **buf, int *size, unsigned char **otherBuf, int *otherSize)
+{
+    unsigned char *tmpBuf = *buf;
+    int tmpSize = *size;
+    
+    *buf = *otherBuf;
+    *size = *otherSize;
+    *otherBuf = tmpBuf;
+    *otherSize = tmpSize;
+}
+
+static int64_t monotonicUsec(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Hand the keyframe collected in snap->picture to the -y workers. It's
+// queued if a JPEG is due, and replaces the one queued if a worker hasn't
+// taken it yet: the deadline stays, the picture is just fresher.
+static void snapshotQueue(struct channel_t *ch)
+{
+    struct snapshot_t *snap = &ch->snap;
+    
+    if( snap->pictureLen <= 0 )
+        return;
+    
+    pthread_mutex_lock(&g_snapPool.lock);
+    
+    if( snap->pendingLen || g_now >= snap->nextJpeg )
+    {
+        if( snap->pendingLen )
+            statsAdd(&ch->stats->snapshotsReplaced, 1);
+        else
+        {
+            snap->deadline = monotonicUsec() + (int64_t)snapshotPeriod(ch) * 1000000;
+            snap->nextJpeg = g_now + snapshotPeriod(ch);
+            pthread_cond_signal(&g_snapPool.wake);
+        }
+        
+        snapshotSwap(&snap->picture, &snap->pictureSize, &snap->pending, &snap->pendingSize);
+        snap->pendingLen = snap->pictureLen;
+    }
+    
+    pthread_mutex_unlock(&g_snapPool.lock);
+}
+
+// A -y worker. Takes the waiting keyframe with the earliest deadline, one
+// worker per channel at a time, and leaves the JPEG for the event loop.
+static void *snapshotWorker(void *arg)
+{
+    int cpu = (int)(intptr_t)arg;
+    struct channel_t *ch, *next;
+    struct snapshot_t *snap;
+    struct snapshotJpeg_t *jpeg;
+    uint64_t one = 1;
+    int64_t deadline;
+    cpu_set_t set;
+    bool reset;
+    int loopIdx;
+    
+    // Keeps the decoder's caches warm, and off the cores the event loop moves between
+    if( cpu >= 0 )
+    {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    
+    pthread_mutex_lock(&g_snapPool.lock);
+    
+    while( !g_snapPool.quit )
+    {
+        ch = NULL;
+        for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+        {
+            next = &g_channels[loopIdx];
+            if( next->snap.pendingLen && !next->snap.busy && (!ch || next->snap.deadline < ch->snap.deadline) )
+                ch = next;
+        }
+        
+        if( !ch )
+        {
+            pthread_cond_wait(&g_snapPool.wake, &g_snapPool.lock);
+            continue;
+        }
+        
+        snap = &ch->snap;
+        snapshotSwap(&snap->work, &snap->workSize, &snap->pending, &snap->pendingSize);
+        snap->workLen = snap->pendingLen;
+        snap->pendingLen = 0;
+        deadline = snap->deadline;
+        reset = snap->reset;
+        snap->reset = false;
+        snap->busy = true;
+        
+        pthread_mutex_unlock(&g_snapPool.lock);
+        
+        if( reset )
+            snapshotFreeDecoder(snap);
+        
+        jpeg = NULL;
+        if( !snap->codec && snapshotOpen(snap) != 0 )
+            printMessage(true, "Ch %i: Failed to open H.264 decoder\n", ch->index+1);
+        else
+            jpeg = snapshotMake(ch, snap->work, snap->workLen);
+        
+        pthread_mutex_lock(&g_snapPool.lock);
+        
+        snap->busy = false;
+        if( jpeg )
+        {
+            if( monotonicUsec() > deadline )
+                statsAdd(&ch->stats->snapshotsLate, 1);
+            
+            // One the event loop hasn't got to yet is older, this one replaces it
+            snapshotJpegRelease(snap->done);
+            snap->done = jpeg;
+            if( write(g_snapPool.eventFd, &one, sizeof(one)) != sizeof(one) )
+                printMessage(true, "Ch %i: Failed to signal snapshot\n", ch->index+1);
+        }
+        
+        // Another keyframe of this channel may have been waiting for the decoder
+        if( snap->pendingLen )
+            pthread_cond_signal(&g_snapPool.wake);
+    }
+    
+    pthread_mutex_unlock(&g_snapPool.lock);
+    return NULL;
+}
+
+// Publish the JPEGs the workers have finished
+static void snapshotPoolEvent(void)
+{
+    struct snapshotJpeg_t *jpeg;
+    struct channel_t *ch;
+    uint64_t count;
+    int loopIdx;
+    
+    if( read(g_snapPool.eventFd, &count, sizeof(count)) <= 0 )
+        return;
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        ch = &g_channels[loopIdx];
+        
+        if( globalArgs.channel[loopIdx] != true )
+            continue;
+        
+        pthread_mutex_lock(&g_snapPool.lock);
+        jpeg = ch->snap.done;
+        ch->snap.done = NULL;
+        pthread_mutex_unlock(&g_snapPool.lock);
+        
+        if( jpeg )
+            snapshotPublish(ch, jpeg);
+    }
+}
+
+// True while a keyframe of the channel is waiting for, or with, a worker
+static bool snapshotWaiting(struct snapshot_t *snap)
+{
+    bool waiting;
+    
+    if( !g_snapPool.workers )
+        return false;
+    
+    pthread_mutex_lock(&g_snapPool.lock);
+    waiting = snap->pendingLen || snap->busy;
+    pthread_mutex_unlock(&g_snapPool.lock);
+    return waiting;
+}
+
+// Start the -y workers, pinned in turn to the CPUs this process may use
+static void snapshotPoolStart(void)
+{
+    int cpus[SNAPSHOT_WORKERS_MAX];
+    int workers = globalArgs.snapshotWorkers;
+    int cpuCount = 0, loopIdx;
+    struct epoll_event ev;
+    cpu_set_t allowed;
+    
+    if( !globalArgs.builtinSnapshot || workers == 0 )
+        return;
+    
+    if( sched_getaffinity(0, sizeof(allowed), &allowed) == 0 )
+    {
+        for( loopIdx=0;loopIdx<CPU_SETSIZE && cpuCount<SNAPSHOT_WORKERS_MAX;loopIdx++ )
+        {
+            if( CPU_ISSET(loopIdx, &allowed) )
+                cpus[cpuCount++] = loopIdx;
+        }
+    }
+    
+    if( workers < 0 )
+        workers = cpuCount < SNAPSHOT_WORKERS_DEFAULT ? cpuCount : SNAPSHOT_WORKERS_DEFAULT;
+    if( workers < 1 )
+        workers = 1;
+    
+    g_snapPool.eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( g_snapPool.eventFd == -1 )
+    {
+        printError("Failed to create snapshot eventfd, decoding in the event loop\n");
+        return;
+    }
+    
+    pthread_mutex_init(&g_snapPool.lock, NULL);
+    pthread_cond_init(&g_snapPool.wake, NULL);
+    g_snapPool.quit = false;
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_snapReady;
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_snapPool.eventFd, &ev);
+    
+    // More workers than CPUs share them, none are pinned if the mask couldn't be read
+    for( loopIdx=0;loopIdx<workers;loopIdx++ )
+    {
+        if( pthread_create(&g_snapPool.threads[loopIdx], NULL, snapshotWorker, (void*)(intptr_t)(cpuCount ? cpus[loopIdx % cpuCount] : -1)) != 0 )
+            break;
+        g_snapPool.workers++;
+    }
+    
+    printMessage(true, "Decoding snapshots on %i threads\n", g_snapPool.workers);
+    if( !g_snapPool.workers )
+        snapshotPoolStop();
+}
+
+// Stop the workers, the channels' decoders are closed afterwards by snapshotClose()
+static void snapshotPoolStop(void)
+{
+    int loopIdx;
+    
+    if( g_snapPool.eventFd == -1 )
+        return;
+    
+    pthread_mutex_lock(&g_snapPool.lock);
+    g_snapPool.quit = true;
+    pthread_cond_broadcast(&g_snapPool.wake);
+    pthread_mutex_unlock(&g_snapPool.lock);
+    
+    for( loopIdx=0;loopIdx<g_snapPool.workers;loopIdx++ )
+        pthread_join(g_snapPool.threads[loopIdx], NULL);
+    g_snapPool.workers = 0;
+    
+    epoll_ctl(g_epollFd, EPOLL_CTL_DEL, g_snapPool.eventFd, NULL);
+    close(g_snapPool.eventFd);
+    g_snapPool.eventFd = -1;
+    pthread_cond_destroy(&g_snapPool.wake);
+    pthread_mutex_destroy(&g_snapPool.lock);
+}
+
+static void snapshotAppend(struct snapshot_t *snap, const unsigned char *data, int len)
+{
+    unsigned char *grown;
+    int size;
+    
+    if( snap->pictureLen < 0 )
+        return;			// Picture already too big, wait for the next one
+    
+    if( snap->pictureLen + len + AV_INPUT_BUFFER_PADDING_SIZE > snap->pictureSize )
+    {
+        size = snap->pictureSize ? snap->pictureSize * 2 : 256 * 1024;
+        while( size < snap->pictureLen + len + AV_INPUT_BUFFER_PADDING_SIZE )
+            size *= 2;
+        
+        if( size > SNAPSHOT_MAX_PICTURE || !(grown = realloc(snap->picture, size)) )
+        {
+            snap->pictureLen = -1;
+            return;
+        }
+        snap->picture = grown;
+        snap->pictureSize = size;
+    }
+    
+    memcpy(snap->picture + snap->pictureLen, data, len);
+    snap->pictureLen += len;
+}
+
+// Take the output of the keyframe filter. Returns -1 if the decoder couldn't be set up.
+int snapshotFeed(struct channel_t *ch, const struct nalFilter_t *f, const unsigned char *data, int len)
+{
+    struct snapshot_t *snap = &ch->snap;
+    
+    if( g_snapPool.workers )
+    {
+        // The workers open the decoder, the watchdog counts from the first keyframe data
+        if( !ch->lastSnapshot )
+            ch->lastSnapshot = g_now;
+    }
+    else if( !snap->codec )
+    {
+        if( snapshotOpen(snap) != 0 )
+        {
+            printMessage(true, "Ch %i: Failed to open H.264 decoder\n", ch->index+1);
+            return -1;
+        }
+        ch->lastSnapshot = g_now;
+    }
+    
+    if( f->pictureEnd >= 0 )
+    {
+        snapshotAppend(snap, data, f->pictureEnd);
+        if( g_snapPool.workers )
+            snapshotQueue(ch);
+        else
+            snapshotDecode(ch);
+        snap->pictureLen = 0;
+        data += f->pictureEnd;
+        len -= f->pictureEnd;
+    }
+    
+    if( len > 0 )
+        snapshotAppend(snap, data, len);
+    return 0;
+}
+#endif
+
+void ringReset(struct ringBuf_t *r)
+{
+    r->tail = r->head;
+    r->markFirst = r->markCount = 0;
+    r->skipping = true;		// A new reader needs a keyframe first
+    r->zeros = 0;
+    r->nalType = -1;
+    r->pendingStart = 0;
+}
+
+static int ringInit(struct ringBuf_t *r, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+    r->data = malloc(size);
+    if( !r->data )
+        return -1;
+    r->size = size;
+    r->head = r->tail = 1;	// Position 0 means "none" for pendingStart
+    ringReset(r);
+    return 0;
+}
+
+static void ringPushMark(struct ringBuf_t *r, uint64_t pos, bool key)
+{
+    if( r->markCount == RING_MAX_FRAMES )
+    {
+        r->markFirst = (r->markFirst + 1) % RING_MAX_FRAMES;
+        r->markCount--;
+    }
+    r->marks[(r->markFirst + r->markCount) % RING_MAX_FRAMES].pos = pos;
+    r->marks[(r->markFirst + r->markCount) % RING_MAX_FRAMES].key = key;
+    r->markCount++;
+}
+
+// The stream stopped mid-picture: what was queued of that picture and hasn't
+// been written yet goes, and queuing resumes at the next keyframe.
+void ringCut(struct ringBuf_t *r)
+{
+    if( r->lastPicture && r->lastPicture >= r->tail )
+    {
+        while( r->markCount && r->marks[(r->markFirst + r->markCount - 1) % RING_MAX_FRAMES].pos >= r->lastPicture )
+            r->markCount--;
+        r->head = r->lastPicture;
+    }
+    r->skipping = true;
+    r->zeros = 0;
+    r->nalType = -1;
+    r->pendingStart = 0;
+}
+
+// Like ringReset(), for a new reader: the latest keyframe, its SPS/PPS and
+// the rest of its GOP are queued again if they haven't been overwritten, so
+// a restarted ffmpeg has a picture to decode without waiting for the camera.
+void ringRewind(struct ringBuf_t *r)
+{
+    uint64_t key = r->lastKey;
+    
+    if( !key || r->head - key > r->size )
+    {
+        ringReset(r);
+        return;
+    }
+    
+    // Frames already written have no mark left, the keyframe gets its own back
+    while( r->markCount && r->marks[r->markFirst].pos < key )
+    {
+        r->markFirst = (r->markFirst + 1) % RING_MAX_FRAMES;
+        r->markCount--;
+    }
+    if( (!r->markCount || r->marks[r->markFirst].pos != key) && r->markCount < RING_MAX_FRAMES )
+    {
+        r->markFirst = (r->markFirst + RING_MAX_FRAMES - 1) % RING_MAX_FRAMES;
+        r->marks[r->markFirst].pos = key;
+        r->marks[r->markFirst].key = true;
+        r->markCount++;
+    }
+    r->tail = key;
+    
+    // Waiting for a keyframe, the picture that was cut short isn't replayed
+    if( r->skipping )
+        ringCut(r);
+}
+
+// Drop everything in front of 'pos', counting the frames that go with it
+static void ringDropTo(struct ringBuf_t *r, uint64_t pos)
+{
+    while( r->markCount && r->marks[r->markFirst].pos < pos )
+    {
+        if( r->marks[r->markFirst].pos >= r->tail )
+            r->droppedFrames++;
+        r->markFirst = (r->markFirst + 1) % RING_MAX_FRAMES;
+        r->markCount--;
+    }
+    r->droppedBytes += pos - r->tail;
+    r->tail = pos;
+}
+
+// Free 'need' bytes by dropping the oldest GOPs. If no keyframe in the ring
+// leaves enough room everything goes and queuing resumes at the next keyframe.
+static void ringMakeRoom(struct ringBuf_t *r, size_t need)
+{
+    int loopIdx;
+    struct frameMark_t *m;
+    
+    for( loopIdx=0;loopIdx<r->markCount;loopIdx++ )
+    {
+        m = &r->marks[(r->markFirst + loopIdx) % RING_MAX_FRAMES];
+        
+        if( m->key && m->pos > r->tail && r->size - (r->head - m->pos) >= need )
+        {
+            ringDropTo(r, m->pos);
+            return;
+        }
+    }
+    
+    ringDropTo(r, r->head);
+    r->skipping = true;
+}
+
+static void ringPut(struct ringBuf_t *r, const unsigned char *data, size_t len)
+{
+    size_t off = r->head % r->size;
+    size_t first = (len < r->size - off) ? len : r->size - off;
+    
+    memcpy(r->data + off, data, first);
+    memcpy(r->data, data + first, len - first);
+    r->head += len;
+}
+
+// Scan a chunk for frame starts and queue it
+static void ringQueue(struct ringBuf_t *r, const unsigned char *in, int len)
+{
+    static const unsigned char startCode[] = {0x00, 0x00, 0x00, 0x01};
+    uint64_t base;		// Ring position of in[0] once queued
+    int segStart = 0;		// First byte of the chunk that gets queued
+    int i, type;
+    
+    // Not with -b at least RING_SIZE_MIN, but a chunk the ring can't hold is dropped
+    if( (size_t)len + sizeof(startCode) > r->size )
+    {
+        ringDropTo(r, r->head);
+        ringCut(r);
+        r->droppedBytes += len;
+        return;
+    }
+    
+    if( !r->skipping && r->size - (r->head - r->tail) < (size_t)len )
+        ringMakeRoom(r, len);
+    
+    if( r->skipping )
+        segStart = -1;
+    base = r->head;
+    
+    for( i=0;i<len;i++ )
+    {
+        // Only the first two bytes of a NAL matter, skip to the next one
+        if( r->nalType == -1 || (r->nalType != -2 && r->nalBytes > 1) )
+        {
+            i = nalScan(in, i, len, &r->zeros);
+            if( i == len )
+                break;
+        }
+        
+        if( in[i] == 0x00 )
+        {
+            if( r->zeros < 3 )
+                r->zeros++;
+            continue;
+        }
+        
+        if( in[i] == 0x01 && r->zeros >= 2 )
+        {
+            r->scStart = base + i - r->zeros;
+            r->zeros = 0;
+            r->nalType = -2;
+            continue;
+        }
+        r->zeros = 0;
+        
+        if( r->nalType == -2 )
+        {
+            type = in[i] & 0x1f;
+            r->nalType = type;
+            r->nalBytes = 0;
+            
+            // Resume at the first SPS or IDR slice, with a fresh start code in front
+            if( segStart == -1 && (type == 7 || type == 5) )
+            {
+                if( r->size - (r->head - r->tail) < (size_t)(len - i) + sizeof(startCode) )
+                    ringMakeRoom(r, len - i + sizeof(startCode));
+                r->skipping = false;
+                r->pendingStart = r->head;
+                ringPut(r, startCode, sizeof(startCode));
+                segStart = i;
+                base = r->head - i;
+            }
+            else if( type == 6 || type == 7 || type == 8 || type == 9 )
+            {
+                if( !r->pendingStart && segStart != -1 )
+                    r->pendingStart = r->scStart;
+            }
+        }
+        else if( r->nalBytes == 1 && (r->nalType == 1 || r->nalType == 5) && (in[i] & 0x80) )
+        {
+            // first_mb_in_slice == 0, a new picture
+            if( segStart == -1 )
+                r->droppedFrames++;
+            else
+            {
+                r->lastPicture = r->pendingStart ? r->pendingStart : r->scStart;
+                ringPushMark(r, r->lastPicture, r->nalType == 5);
+                if( r->nalType == 5 )
+                    r->lastKey = r->lastPicture;
+            }
+            r->pendingStart = 0;
+        }
+        r->nalBytes++;
+    }
+    
+    if( segStart == -1 )
+        r->droppedBytes += len;
+    else
+        ringPut(r, in + segStart, len - segStart);
+}
+
+// Frame starts already written out are of no more use
+static void ringForgetWritten(struct ringBuf_t *r)
+{
+    while( r->markCount && r->marks[r->markFirst].pos < r->tail )
+    {
+        r->markFirst = (r->markFirst + 1) % RING_MAX_FRAMES;
+        r->markCount--;
+    }
+}
+
+// Write as much of the queue as the pipe takes. Returns bytes written or -1 on error.
+static int ringFlush(struct ringBuf_t *r, int outFd)
+{
+    size_t off, len;
+    ssize_t written;
+    int total = 0;
+    
+    while( r->tail < r->head )
+    {
+        off = r->tail % r->size;
+        len = r->head - r->tail;
+        if( len > r->size - off )
+            len = r->size - off;
+        
+        written = write(outFd, r->data + off, len);
+        
+        if( written == -1 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            return -1;
+        }
+        
+        r->tail += written;
+        total += written;
+        
+        if( (size_t)written < len )
+            break;			// Pipe is full
+    }
+    
+    ringForgetWritten(r);
+    return total;
+}
+
+// Copy path with the ring in between. Returns -1 if the reader went away.
+int channelRingRelay(struct channel_t *ch, int outFd, const char *data, int len)
+{
+    struct ringBuf_t *r = &ch->ring;
+    uint64_t droppedBytes, droppedFrames;
+    int written = 0;
+    int retval;
+    
+    if( !r->data && ringInit(r, (size_t)globalArgs.ringSize * 1024) != 0 )
+        return 0;
+    
+    droppedBytes = r->droppedBytes;
+    droppedFrames = r->droppedFrames;
+    
+    // With -f the pipe is written once per wakeup, by uringFlush()
+    if( g_uring.active )
+        outFd = -1;
+    
+    // Older data first, then whatever fits of the new chunk
+    if( outFd != -1 && (retval = ringFlush(r, outFd)) >= 0 )
+        written += retval;
+    
+    ringQueue(r, (const unsigned char*)data, len);
+    
+    if( outFd != -1 )
+    {
+        if( (retval = ringFlush(r, outFd)) == -1 )
+        {
+            if( globalArgs.verbose )
+            {
+                sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Pipe closed\n");
+                printError(g_errBuf);
+            }
+            ringRewind(r);
+            return -1;
+        }
+        written += retval;
+    }
+    
+    if( written > 0 )
+        ch->lastWrite = g_now;
+    
+    statsAdd(&ch->stats->droppedBytes, r->droppedBytes - droppedBytes);
+    statsAdd(&ch->stats->droppedFrames, r->droppedFrames - droppedFrames);
+    
+    if( r->droppedFrames != droppedFrames && globalArgs.verbose )
+        printMessage(true, "Ch %i: Reader isn't reading fast enough, dropped %llu bytes and %llu frames so far\n",
+                     ch->index+1, (unsigned long long)r->droppedBytes, (unsigned long long)r->droppedFrames);
+    return 0;
+}
+
+void recordReset(struct recorder_t *r)
+{
+    r->waiting = true;		// After a reconnect the recording resumes at a keyframe
+    r->keyOpen = false;
+    r->vclSeen = false;
+    r->zeros = 0;
+    r->nalType = -1;
+}
+
+static void recordName(char *name, size_t size, struct channel_t *ch, int slot, const char *ext)
+{
+    snprintf(name, size, "%s/%i-%i.%s", globalArgs.recordDir, ch->index+1, slot, ext);
+}
+
+// Slot of the newest segment left by an earlier run, so the oldest goes first
+static int recordNewestSlot(struct channel_t *ch)
+{
+    char name[300];
+    struct stat st;
+    time_t newest = 0;
+    int slot = globalArgs.recordSegments - 1;
+    int loopIdx;
+    
+    for( loopIdx=0;loopIdx<globalArgs.recordSegments;loopIdx++ )
+    {
+        recordName(name, sizeof(name), ch, loopIdx, "h264");
+        if( stat(name, &st) == 0 && st.st_mtime >= newest )
+        {
+            newest = st.st_mtime;
+            slot = loopIdx;
+        }
+    }
+    return slot;
+}
+
+// Start the next segment of the channel's recording, replacing the oldest one
+static int recordOpen(struct channel_t *ch)
+{
+    struct recorder_t *r = &ch->rec;
+    char name[300];
+    
+    if( !r->buf && posix_memalign((void**)&r->buf, 4096, RECORD_WRITE_SIZE) != 0 )
+    {
+        r->buf = NULL;
+        return -1;
+    }
+    
+    if( r->slot == -1 )
+        r->slot = recordNewestSlot(ch);
+    r->slot = (r->slot + 1) % globalArgs.recordSegments;
+    
+    recordName(name, sizeof(name), ch, r->slot, "h264");
+    r->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if( r->fd == -1 )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Ch %i: Failed to open %.200s\n", ch->index+1, name);
+        printError(g_errBuf);
+        return -1;
+    }
+    
+    // Reserve the whole segment so it isn't fragmented by the other channels.
+    // The zeros past the data are trimmed on close, and are harmless to a
+    // decoder if the process dies first.
+    if( fallocate(r->fd, 0, 0, RECORD_SEGMENT_SIZE) != 0 && globalArgs.verbose )
+    {
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Failed to preallocate recording\n");
+        printError(g_errBuf);
+    }
+    
+    recordName(name, sizeof(name), ch, r->slot, "idx");
+    r->indexFd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if( r->indexFd == -1 )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Ch %i: Failed to open %.200s\n", ch->index+1, name);
+        printError(g_errBuf);
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    
+    r->segLen = 0;
+    r->bufLen = 0;
+    r->seq++;
+    printMessage(true, "Ch %i: Recording to segment %i\n", ch->index+1, r->slot);
+    return 0;
+}
+
+static int recordFlush(struct recorder_t *r)
+{
+    ssize_t written;
+    int off = 0;
+    
+    // At the segment's length rather than the file position, -f writes out of line
+    while( off < r->bufLen )
+    {
+        written = pwrite(r->fd, r->buf + off, r->bufLen - off, r->segLen + off);
+        if( written == -1 )
+        {
+            if( errno == EINTR )
+                continue;
+            r->bufLen = 0;
+            return -1;
+        }
+        off += written;
+    }
+    
+    r->segLen += r->bufLen;
+    r->bufLen = 0;
+    return 0;
+}
+
+// Write out the buffer queued for -f, what the batch didn't get to included
+static int recordWriteQueued(struct recorder_t *r)
+{
+    ssize_t written;
+    int off = 0;
+    
+    while( off < r->fullLen )
+    {
+        written = pwrite(r->fd, r->full + off, r->fullLen - off, r->fullOff + off);
+        if( written == -1 )
+        {
+            if( errno == EINTR )
+                continue;
+            r->fullLen = 0;
+            return -1;
+        }
+        off += written;
+    }
+    
+    r->fullLen = 0;
+    return 0;
+}
+
+// Hand the full buffer to the next batch of -f writes and carry on in a spare one
+static int recordQueue(struct recorder_t *r)
+{
+    unsigned char *buf;
+    
+    // The spare one is still being written, this one can't wait
+    if( r->fullBusy )
+        return recordFlush(r);
+    
+    if( r->fullLen && recordWriteQueued(r) != 0 )
+        return -1;
+    
+    if( !r->full && posix_memalign((void**)&r->full, 4096, RECORD_WRITE_SIZE) != 0 )
+    {
+        r->full = NULL;
+        return recordFlush(r);
+    }
+    
+    buf = r->full;
+    r->full = r->buf;
+    r->buf = buf;
+    r->fullLen = r->bufLen;
+    r->fullOff = r->segLen;
+    r->segLen += r->bufLen;
+    r->bufLen = 0;
+    return 0;
+}
+
+void recordClose(struct recorder_t *r)
+{
+    if( r->fd == -1 )
+        return;
+    
+    // A buffer already submitted lands inside segLen whenever it completes
+    if( !r->fullBusy )
+        recordWriteQueued(r);
+    recordFlush(r);
+    
+    // Give back the part of the preallocation that wasn't used
+    if( ftruncate(r->fd, r->segLen) != 0 && globalArgs.verbose )
+        printError("Failed to trim recording\n");
+    
+    close(r->fd);
+    close(r->indexFd);
+    r->fd = r->indexFd = -1;
+}
+
+// Buffer data for the segment, it is written out RECORD_WRITE_SIZE bytes at a time
+static void recordAppend(struct channel_t *ch, const unsigned char *data, int len)
+{
+    struct recorder_t *r = &ch->rec;
+    int n;
+    
+    statsAdd(&ch->stats->recordedBytes, len);
+    
+    while( len > 0 && r->fd != -1 )
+    {
+        n = RECORD_WRITE_SIZE - r->bufLen;
+        if( n > len )
+            n = len;
+        
+        memcpy(r->buf + r->bufLen, data, n);
+        r->bufLen += n;
+        data += n;
+        len -= n;
+        
+        if( r->bufLen == RECORD_WRITE_SIZE && (g_uring.active ? recordQueue(r) : recordFlush(r)) != 0 )
+        {
+            sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Failed to write recording\n");
+            printError(g_errBuf);
+            recordClose(r);
+            r->waiting = true;	// Try a new segment at the next keyframe
+        }
+    }
+}
+
+// A keyframe starts at the NAL header being scanned. 'continuing' is set when
+// the data in front of it, start code included, has just been recorded.
+static void recordKeyframe(struct channel_t *ch, bool continuing)
+{
+    static const unsigned char startCode[] = {0x00, 0x00, 0x00, 0x01};
+    struct recorder_t *r = &ch->rec;
+    struct recordIndex_t entry;
+    struct timespec ts;
+    bool full = r->fd == -1 || r->segLen + r->bufLen >= RECORD_SEGMENT_SIZE;
+    
+    if( continuing && !full )
+        entry.offset = r->segLen + r->bufLen - r->scLen;
+    else
+    {
+        if( full && r->fd != -1 )
+        {
+            // The start code goes with the keyframe into the new segment
+            if( continuing )
+                r->bufLen -= (r->bufLen < r->scLen) ? r->bufLen : r->scLen;
+            recordClose(r);
+        }
+        
+        if( r->fd == -1 && recordOpen(ch) != 0 )
+        {
+            r->waiting = true;
+            return;
+        }
+        
+        entry.offset = r->segLen + r->bufLen;
+        r->waiting = false;
+        recordAppend(ch, startCode, sizeof(startCode));
+        if( r->fd == -1 )
+            return;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    entry.usec = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    
+    if( write(r->indexFd, &entry, sizeof(entry)) != sizeof(entry) && globalArgs.verbose )
+    {
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Failed to write recording index\n");
+        printError(g_errBuf);
+    }
+}
+
+// Add a chunk of the channel's H.264 to the recording
+void recordWrite(struct channel_t *ch, const unsigned char *data, int len)
+{
+    struct recorder_t *r = &ch->rec;
+    int from = 0;		// First byte of the chunk not recorded or skipped yet
+    int i, type;
+    bool key;
+    
+    for( i=0;i<len;i++ )
+    {
+        // Only NAL headers matter, skip to the next one
+        if( r->nalType != -2 )
+        {
+            i = nalScan(data, i, len, &r->zeros);
+            if( i == len )
+                break;
+        }
+        
+        if( data[i] == 0x00 )
+        {
+            if( r->zeros < 3 )
+                r->zeros++;
+            continue;
+        }
+        
+        if( data[i] == 0x01 && r->zeros >= 2 )
+        {
+            r->scLen = r->zeros + 1;
+            r->zeros = 0;
+            r->nalType = -2;
+            continue;
+        }
+        r->zeros = 0;
+        
+        if( r->nalType != -2 )
+            continue;
+        
+        type = data[i] & 0x1f;
+        r->nalType = type;
+        
+        // A SPS starts a keyframe, so does an IDR slice without one in front
+        key = (type == 7 && (!r->keyOpen || r->vclSeen)) || (type == 5 && !r->keyOpen);
+        if( type == 1 )
+            r->keyOpen = false;
+        
+        if( key )
+        {
+            if( !r->waiting )
+                recordAppend(ch, data + from, i - from);
+            from = i;
+            
+            // With -o a GOP is only kept if it starts while there is motion
+            if( globalArgs.eventRecord && !activityActive(ch) )
+            {
+                if( !r->waiting )
+                    r->bufLen -= (r->bufLen < r->scLen) ? r->bufLen : r->scLen;
+                r->waiting = true;
+            }
+            else
+                recordKeyframe(ch, !r->waiting);
+            r->keyOpen = true;
+            r->vclSeen = false;
+        }
+        
+        if( type == 1 || type == 5 )
+            r->vclSeen = true;
+    }
+    
+    if( !r->waiting )
+        recordAppend(ch, data + from, len - from);
+}
+
+int openSplicePipe(int spliceFds[2])
+{
+    if( g_nullFd == -1 )
+        g_nullFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    
+    if( g_nullFd == -1 )
+        return -1;
+    
+    return pipe2(spliceFds, O_NONBLOCK | O_CLOEXEC);
+}
+
+// Move one chunk from the socket to the output pipe through the kernel pipe
+// 'spliceFds', so the data is never copied into user space. Whatever the output
+// can't take right now is dropped, like the copy loop does.
+// Returns bytes taken from the socket, 0 if the socket closed, -1 on a socket
+// error and -2 if the output pipe failed (errno is set in both cases).
+// 'written' receives the number of bytes that actually reached the output.
+int spliceChunk(int sockFd, int outPipe, int spliceFds[2], int *written)
+{
+    ssize_t read, moved;
+    ssize_t pending;
+    int outErr = 0;
+    
+    *written = 0;
+    read = splice(sockFd, NULL, spliceFds[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    
+    if( read <= 0 )
+        return read;
+    
+    pending = read;
+    
+    while( pending > 0 )
+    {
+        moved = splice(spliceFds[0], NULL, outPipe, NULL, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        
+        if( moved > 0 )
+        {
+            pending -= moved;
+            *written += moved;
+            continue;
+        }
+        
+        if( moved == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+            outErr = errno;
+        else if( globalArgs.verbose )
+            printMessage(true, "Reader isn't reading fast enough, discarding data. Not enough processing power?\n");
+        
+        // Empty the internal pipe so the next chunk starts clean
+        while( pending > 0 && (moved = splice(spliceFds[0], NULL, g_nullFd, NULL, pending, SPLICE_F_NONBLOCK)) > 0 )
+            pending -= moved;
+        break;
+    }
+    
+    if( outErr )
+    {
+        errno = outErr;
+        return -2;
+    }
+    return read;
+}
+
+void channelStartFfmpeg(struct channel_t *ch)
+{
+    char *size = g_chConfig[ch->index].size[0] ? g_chConfig[ch->index].size : "390x220";
+    char* ffLCmd[] = {"ffmpeg", "-y", "-f",  "h264", "-framerate", "1", "-i", ch->pipename,  "-s",  size,  "-r",  globalArgs.adaptiveSnapshot ? "1" : "1/2",  "-update",  "1",  "-f",  "image2", ch->tmploc, NULL};
+    
+    statsAdd(&ch->stats->ffmpegStarts, 1);
+    ch->ffmpegAdopted = false;
+    if ((ch->ffmpegPid = fork()) < 0) {
+        printMessage(true, "Ch %i: Error creating ffmpeg fork\n", ch->index+1);
+        ch->ffmpegPid = -1;
+    }
+    else if (ch->ffmpegPid == 0) {
+        if( g_worker != -1 )
+            sched_setaffinity(0, sizeof(g_cpusAllowed), &g_cpusAllowed);
+        execvp("ffmpeg", ffLCmd);
+        printMessage(true, "Ch %i: Error returned from ffmpeg\n", ch->index+1);
+        fflush(stdout);
+        _exit(1);
+    }
+    
+    ch->lastSnapshot = g_now;
+}
+
+// Seconds to wait before the next connection attempt. Doubles with every
+// failure up to BACKOFF_MAX, and is randomised so channels that lost the DVR
+// together don't all come back at the same moment.
+int backoffDelay(int *failures)
+{
+    int delay = 2 << ((*failures < 4) ? *failures : 4);	// Waits of 1-2 s the first time
+    
+    if( delay > BACKOFF_MAX )
+        delay = BACKOFF_MAX;
+    (*failures)++;
+    
+    return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+// Drop the DVR connection and try again in 'seconds'. ffmpeg and the pipes are kept.
+void connDisconnect(struct dvrConn_t *conn, int seconds)
+{
+    int loopIdx;
+    
+    // The next connection starts with a keyframe, not the rest of this picture
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        if( g_channels[loopIdx].conn == conn && g_channels[loopIdx].ring.data )
+            ringCut(&g_channels[loopIdx].ring);
+    }
+    
+    if( conn->sockFd != -1 )
+    {
+        if( conn->uringArmed )
+            uringRecvCancel(conn);
+        else
+            epoll_ctl(g_epollFd, EPOLL_CTL_DEL, conn->sockFd, NULL);
+        close(conn->sockFd);
+        conn->sockFd = -1;
+    }
+    
+    conn->uringArmed = false;
+    conn->uringGen++;
+    conn->state = CH_WAITING;
+    conn->deadline = 0;
+    conn->retryTime = g_now + seconds;
+    
+    if( seconds && globalArgs.verbose )
+        printMessage(true, "%s: Retrying in %i seconds.\n", conn->label, seconds);
+}
+
+// Drop the connection after a failure, backing off a little more each time
+void connRetry(struct dvrConn_t *conn)
+{
+    connDisconnect(conn, backoffDelay(&conn->failures));
+}
+
+// Tear down everything belonging to the channel, a new pipe is made on reconnect.
+// A multiplexed connection is left alone, the channel resumes at the next keyframe.
+void channelRestart(struct channel_t *ch)
+{
+    if( ch->conn && ch->conn->channel == ch )
+        connDisconnect(ch->conn, 0);
+    
+    if( ch->ffmpegPid > 0 )
+        kill(ch->ffmpegPid, SIGKILL);	// Reaped by the event loop
+    ch->ffmpegPid = -1;
+    
+    if( ch->outPipe != -1 )
+        close(ch->outPipe);
+    ch->outPipe = -1;
+    ringRewind(&ch->ring);
+    
+    if( ch->pipename[0] )
+        unlink(ch->pipename);
+    ch->pipename[0] = '\0';
+    
+#ifdef BUILTIN_SNAPSHOT
+    snapshotClose(&ch->snap);
+#endif
+}
+
+// The FIFO of a channel in -C worker 'worker'. It keeps its name when the
+// worker is restarted, so the parent knows what a dead one leaves behind.
+static void workerPipeName(char *name, size_t size, int worker, int channel)
+{
+    snprintf(name, size, "%s/cam%iworker%ipid%i", globalArgs.pipeDir, channel, worker+1, (int)g_workerParent);
+}
+
+// Make the FIFO ffmpeg reads from, if the channel doesn't have one already
+void channelMakePipe(struct channel_t *ch)
+{
+    if( ch->pipename[0] || globalArgs.builtinSnapshot )
+        return;
+    
+    if( g_worker != -1 )
+    {
+        workerPipeName(ch->pipename, sizeof(ch->pipename), g_worker, ch->index);
+        unlink(ch->pipename);
+    }
+    else
+        sprintf(ch->pipename, "%s/cam%irand%i", globalArgs.pipeDir, ch->index, rand());
+    
+    if( mkfifo(ch->pipename, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH) != 0 )
+    {
+        sprintf(g_errBuf, "Ch %i: Failed to create pipe\n", ch->index+1);
+        printError(g_errBuf);
+    }
+    ch->lastWrite = g_now;
+}
+
+void connConnect(struct dvrConn_t *conn)
+{
+    struct sockaddr_in *serverAddr = &g_dvrs[conn->dvr].addr;
+    struct epoll_event ev;
+    struct linger lngr;
+    int flag = true;
+    int retval;
+    int loopIdx;
+    
+    lngr.l_onoff = false;
+    lngr.l_linger = 0;
+    
+    for( loopIdx=0;loopIdx<DVR_CHANNELS;loopIdx++ )
+    {
+        if( conn->chans[loopIdx] && conn->chans[loopIdx]->mainConn != conn )
+            channelMakePipe(conn->chans[loopIdx]);
+    }
+    
+    conn->sockFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    
+    if( conn->sockFd == -1 )
+    {
+        sprintf(g_errBuf, "%s: %s", conn->label, "Failed to create socket\n");
+        printError(g_errBuf);
+        connRetry(conn);
+        return;
+    }
+    
+    if( setsockopt(conn->sockFd, IPPROTO_TCP, TCP_NODELAY, (char*)&flag, sizeof(flag)))
+    {
+        sprintf(g_errBuf, "%s: %s", conn->label, "Failed to set TCP_NODELAY\n");
+        printError(g_errBuf);
+    }
+    if( setsockopt(conn->sockFd, SOL_SOCKET, SO_LINGER, (char*)&lngr, sizeof(lngr)))
+    {
+        sprintf(g_errBuf, "%s: %s", conn->label, "Failed to set SO_LINGER\n");
+        printError(g_errBuf);
+    }
+    
+    retval = connect(conn->sockFd, (struct sockaddr*)serverAddr, sizeof(*serverAddr));
+    
+    if( retval == -1 && errno != EINPROGRESS )
+    {
+        if( globalArgs.verbose )
+        {
+            sprintf(g_errBuf, "%s: %s", conn->label, "Failed to connect\n");
+            printError(g_errBuf);
+        }
+        connRetry(conn);
+        return;
+    }
+    
+    // Writable once the connection has completed (or failed)
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, conn->sockFd, &ev);
+    
+    conn->state = CH_CONNECTING;
+    conn->deadline = g_now + CONNECT_TIMEOUT;
+}
+
+// Send the login and the stream request in one go. Nothing waits for the
+// login replies, the framer drops them when they arrive ahead of the stream.
+void connStartStream(struct dvrConn_t *conn)
+{
+    struct channel_t *ch;
+    int loopIdx;
+    
+    if( sendLoginRequest(conn->sockFd) != 0 || sendStreamRequest(conn->sockFd, conn->channelMask, conn->subMask) != 0 )
+    {
+        printMessage(true, "%s: Connect failed.\n", conn->label);
+        connRetry(conn);
+        return;
+    }
+    
+    printMessage(true, "%s: Connected and awaiting stream\n", conn->label);
+    
+    dvrFramerReset(&conn->framer);
+    conn->framer.skipMessages = DVR_LOGIN_REPLIES;
+    conn->state = CH_STREAMING;
+    conn->deadline = g_now + STREAM_TIMEOUT;
+    
+    for( loopIdx=0;loopIdx<DVR_CHANNELS;loopIdx++ )
+    {
+        if( !(ch = conn->chans[loopIdx]) )
+            continue;
+        
+        statsAdd(&ch->stats->connects, 1);
+        
+        if( !ch->mainConn || ch->mainConn == conn )
+            recordReset(&ch->rec);
+        if( ch->mainConn == conn )
+            continue;
+        
+        nalFilterReset(&ch->nalFilt, globalArgs.keyframeInterval);
+        if( ch->ffmpegPid == -1 && !globalArgs.builtinSnapshot )
+            channelStartFfmpeg(ch);
+    }
+}
+
+void channelOpenPipe(struct channel_t *ch)
+{
+    // Fails until ffmpeg opens its end
+    if( ch->outPipe == -1 && (ch->outPipe = open(ch->pipename, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) != -1 )
+    {
+        // Whatever was left of a chunk for the last pipe is replayed from the ring
+        ch->pipeSeq++;
+        ch->pipeOff = ch->pipeLen = 0;
+        ch->pipeFull = false;
+        ch->pipePolling = false;
+    }
+}
+
+// Hand a chunk of stream data to ffmpeg. Returns -1 if the reader went away.
+int channelRelay(struct channel_t *ch, const char *data, int len)
+{
+    const char *outData = data;
+    
+    if( globalArgs.recordDir && !ch->mainConn )
+        recordWrite(ch, (const unsigned char*)data, len);
+    
+    if( globalArgs.keyframeInterval )
+    {
+        ch->nalFilt.hold = activityHold(ch);
+        len = nalFilter(&ch->nalFilt, (const unsigned char*)data, len, (unsigned char*)ch->filterBuf, sizeof(ch->filterBuf));
+        outData = ch->filterBuf;
+        if( ch->nalFilt.overflow )
+            printMessage(false, "Ch %i: Keyframe filter output full, %i bytes left out\n", ch->index+1, ch->nalFilt.overflow);
+    }
+    
+#ifdef BUILTIN_SNAPSHOT
+    if( globalArgs.builtinSnapshot )
+    {
+        if( snapshotFeed(ch, &ch->nalFilt, (unsigned char*)outData, len) == 0 )
+            ch->lastWrite = g_now;
+        return 0;
+    }
+#endif
+    
+    channelOpenPipe(ch);
+    
+    if( globalArgs.ringSize )
+    {
+        if( channelRingRelay(ch, ch->outPipe, outData, len) == 0 )
+            return 0;
+        close(ch->outPipe);
+        ch->outPipe = -1;
+        return -1;
+    }
+    
+    if( ch->outPipe == -1 || len == 0 )
+        return 0;
+    
+    if( write(ch->outPipe, outData, len) == -1 )
+    {
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+        {
+            statsAdd(&ch->stats->droppedBytes, len);
+            if( globalArgs.verbose )
+                printMessage(true, "Ch %i: %s", ch->index+1, "Reader isn't reading fast enough, discarding data. Not enough processing power?\n");
+            return 0;
+        }
+        else if( globalArgs.verbose )
+        {
+            sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Pipe closed\n");
+            printError(g_errBuf);
+        }
+        
+        close(ch->outPipe);
+        ch->outPipe = -1;
+        return -1;
+    }
+    
+    ch->lastWrite = g_now;
+    return 0;
+}
+
+// Framer callback for a multiplexed connection
+static void connDeliver(void *ctx, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    struct dvrConn_t *conn = ctx;
+    int channel = conn->channel ? conn->channel->dvrChannel : frame->channel;
+    struct channel_t *ch;
+    
+    // Login replies and anything for a channel we didn't ask for are dropped
+    if( channel < 0 || channel >= DVR_CHANNELS || !(ch = conn->chans[channel]) )
+        return;
+    
+    statsAdd(&ch->stats->bytes, len);
+    
+    // -S: the main stream is only recorded and published, the sub stream only snapshotted
+    if( !ch->mainConn || ch->mainConn == conn )
+    {
+        statsFrame(ch->stats, frame, data, len);
+        channelPublish(ch, frame, data, len);
+    }
+    if( ch->mainConn == conn )
+    {
+        if( globalArgs.recordDir )
+            recordWrite(ch, data, len);
+        return;
+    }
+    
+    activityFrame(ch, frame, data, len);
+    
+    // A closed pipe is reopened once the channel's ffmpeg has been restarted
+    channelRelay(ch, (const char*)data, len);
+}
+
+// Pass on a chunk received from the DVR. Returns -1 if the connection was dropped.
+static int connReceived(struct dvrConn_t *conn, unsigned char *buf, int len)
+{
+    struct channel_t *ch = conn->channel;	// NULL when multiplexed
+    
+    conn->deadline = g_now + STREAM_TIMEOUT;
+    
+    // Past the login replies, the DVR is back
+    if( conn->framer.raw || conn->framer.messages > DVR_LOGIN_REPLIES )
+        conn->failures = 0;
+    
+    // A -S main stream goes the same way, it never reaches the pipe
+    if( !ch || ch->mainConn == conn )
+    {
+        dvrFramerParse(&conn->framer, buf, len, connDeliver, conn);
+        return 0;
+    }
+    
+    len = dvrFramerStrip(&conn->framer, buf, len, ch);
+    if( channelRelay(ch, (const char*)buf, len) != 0 )
+    {
+        connDisconnect(conn, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void connEvent(struct dvrConn_t *conn, uint32_t events)
+{
+    struct channel_t *ch = conn->channel;	// NULL when multiplexed
+    struct epoll_event ev;
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    int read;
+    int loopIdx;
+    
+    switch( conn->state )
+    {
+        case CH_CONNECTING:
+            if( getsockopt(conn->sockFd, SOL_SOCKET, SO_ERROR, &err, &errLen) == -1 || err != 0 )
+            {
+                if( globalArgs.verbose )
+                {
+                    errno = err;
+                    sprintf(g_errBuf, "%s: %s", conn->label, "Failed to connect\n");
+                    printError(g_errBuf);
+                }
+                connRetry(conn);
+                return;
+            }
+            
+            // With -f the stream is received through io_uring instead
+            if( g_uring.active )
+            {
+                epoll_ctl(g_epollFd, EPOLL_CTL_DEL, conn->sockFd, NULL);
+                connStartStream(conn);
+                if( conn->state == CH_STREAMING && uringRecvArm(conn) != 0 )
+                {
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn;
+                    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, conn->sockFd, &ev);
+                }
+                break;
+            }
+            
+            ev.events = EPOLLIN;
+            ev.data.ptr = conn;
+            epoll_ctl(g_epollFd, EPOLL_CTL_MOD, conn->sockFd, &ev);
+            
+            connStartStream(conn);
+            break;
+            
+        case CH_STREAMING:
+            for( loopIdx=0;loopIdx<MAX_RECV_BURST;loopIdx++ )
+            {
+                bool spliced = false;
+                int written = 0;
+                
+                if( ch && ch->mainConn != conn )
+                    channelOpenPipe(ch);
+                
+                // Only a stream without DVR message headers can be spliced as it is
+                if( ch && ch->spliceFds[0] != -1 && ch->outPipe != -1 && conn->framer.raw )
+                {
+                    read = spliceChunk(conn->sockFd, ch->outPipe, ch->spliceFds, &written);
+                    spliced = true;
+                }
+                else
+                    read = recv(conn->sockFd, conn->recvBuf, sizeof(conn->recvBuf), 0);
+                
+                if( read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+                    break;
+                
+                if( spliced && read == -1 && (errno == EINVAL || errno == ENOSYS) )
+                {
+                    printMessage(true, "%s: splice() not supported, copying data instead\n", conn->label);
+                    close(ch->spliceFds[0]);
+                    close(ch->spliceFds[1]);
+                    ch->spliceFds[0] = ch->spliceFds[1] = -1;
+                    continue;
+                }
+                
+                if( read == -2 )
+                {
+                    if( globalArgs.verbose )
+                    {
+                        sprintf(g_errBuf, "%s: %s", conn->label, "Pipe closed\n");
+                        printError(g_errBuf);
+                    }
+                    close(ch->outPipe);
+                    ch->outPipe = -1;
+                    connDisconnect(conn, 0);
+                    return;
+                }
+                
+                if( read <= 0 )
+                {
+                    if( globalArgs.verbose )
+                        printMessage(true, "%s: Socket closed. Receive result: %i\n", conn->label, read);
+                    connRetry(conn);
+                    return;
+                }
+                
+                if( spliced )
+                {
+                    conn->deadline = g_now + STREAM_TIMEOUT;
+                    conn->failures = 0;
+                    if( written > 0 )
+                        ch->lastWrite = g_now;
+                    statsAdd(&ch->stats->bytes, read);
+                    statsAdd(&ch->stats->droppedBytes, read - written);
+                    continue;
+                }
+                
+                if( connReceived(conn, (unsigned char*)conn->recvBuf, read) != 0 )
+                    return;
+            }
+            break;
+            
+        case CH_WAITING:
+            break;
+    }
+}
+
+static int uringSetup(struct uring_t *u, unsigned entries, unsigned cqEntries)
+{
+    struct io_uring_params p;
+    
+    memset(&p, 0, sizeof(p));
+    if( cqEntries )
+    {
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cqEntries;
+    }
+    
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if( u->fd == -1 )
+        return -1;
+    
+    // 5.5 and later, which multishot receives need anyway
+    if( !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) )
+    {
+        close(u->fd);
+        u->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+    
+    u->ringMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if( u->ringMapSize < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) )
+        u->ringMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    
+    u->ringMap = mmap(NULL, u->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if( u->ringMap == MAP_FAILED || u->sqes == MAP_FAILED )
+    {
+        if( u->ringMap != MAP_FAILED )
+            munmap(u->ringMap, u->ringMapSize);
+        if( u->sqes != MAP_FAILED )
+            munmap(u->sqes, u->sqesSize);
+        close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+    
+    u->sqEntries = p.sq_entries;
+    u->sqHead = (unsigned*)(u->ringMap + p.sq_off.head);
+    u->sqTail = (unsigned*)(u->ringMap + p.sq_off.tail);
+    u->sqMask = (unsigned*)(u->ringMap + p.sq_off.ring_mask);
+    u->sqArray = (unsigned*)(u->ringMap + p.sq_off.array);
+    u->cqHead = (unsigned*)(u->ringMap + p.cq_off.head);
+    u->cqTail = (unsigned*)(u->ringMap + p.cq_off.tail);
+    u->cqMask = (unsigned*)(u->ringMap + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(u->ringMap + p.cq_off.cqes);
+    u->sqNext = *u->sqTail;
+    return 0;
+}
+
+static void uringFree(struct uring_t *u)
+{
+    if( u->fd == -1 )
+        return;
+    munmap(u->sqes, u->sqesSize);
+    munmap(u->ringMap, u->ringMapSize);
+    close(u->fd);
+    u->fd = -1;
+}
+
+// Next free SQE, cleared. NULL if the queue is full until it's submitted.
+static struct io_uring_sqe *uringGetSqe(struct uring_t *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+    
+    if( u->sqNext - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries )
+        return NULL;
+    
+    idx = u->sqNext & *u->sqMask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqArray[idx] = idx;
+    u->sqNext++;
+    return sqe;
+}
+
+// Submit the SQEs filled in, and wait for 'waitFor' completions
+static int uringSubmit(struct uring_t *u, unsigned waitFor)
+{
+    int ret;
+    
+    __atomic_store_n(u->sqTail, u->sqNext, __ATOMIC_RELEASE);
+    
+    do
+        ret = syscall(__NR_io_uring_enter, u->fd, u->sqNext - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE), waitFor,
+                      waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while( ret == -1 && errno == EINTR );
+    return ret;
+}
+
+static struct io_uring_cqe *uringPeekCqe(struct uring_t *u)
+{
+    unsigned head = *u->cqHead;
+    
+    if( head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE) )
+        return NULL;
+    return &u->cqes[head & *u->cqMask];
+}
+
+static void uringSeenCqe(struct uring_t *u)
+{
+    __atomic_store_n(u->cqHead, *u->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// Give a receive buffer back to the kernel
+static void uringBufReturn(uint16_t bid)
+{
+    struct io_uring_buf *buf = &g_uring.bufRing->bufs[g_uring.bufTail & (URING_BUF_COUNT - 1)];
+    
+    buf->addr = (uint64_t)(uintptr_t)(g_uring.bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    g_uring.bufTail++;
+    __atomic_store_n(&g_uring.bufRing->tail, g_uring.bufTail, __ATOMIC_RELEASE);
+}
+
+// Set up the -f io_uring and the shared receive buffers. Returns -1 if the
+// kernel can't do it, the event loop then carries on with epoll.
+static int uringOpen(void)
+{
+    struct io_uring_buf_reg reg;
+    struct epoll_event ev;
+    int loopIdx;
+    
+    if( uringSetup(&g_uring.ring, URING_ENTRIES, URING_CQ_ENTRIES) != 0 )
+    {
+        printError("Failed to set up io_uring, using epoll\n");
+        return -1;
+    }
+    
+    g_uring.bufRing = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    g_uring.bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)g_uring.bufRing;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = 0;
+    
+    // Provided buffer rings came with 5.19, multishot receives with 6.0
+    if( g_uring.bufRing == MAP_FAILED || !g_uring.bufs ||
+        syscall(__NR_io_uring_register, g_uring.ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0 )
+    {
+        printError("Failed to register io_uring buffers, using epoll\n");
+        if( g_uring.bufRing != MAP_FAILED )
+            munmap(g_uring.bufRing, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+        free(g_uring.bufs);
+        g_uring.bufs = NULL;
+        g_uring.bufRing = NULL;
+        uringFree(&g_uring.ring);
+        return -1;
+    }
+    
+    g_uring.bufTail = 0;
+    for( loopIdx=0;loopIdx<URING_BUF_COUNT;loopIdx++ )
+        uringBufReturn(loopIdx);
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_uringReady;
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_uring.ring.fd, &ev);
+    
+    g_uring.active = true;
+    printMessage(true, "Receiving through io_uring\n");
+    return 0;
+}
+
+// What a completion is for, in the top bits of its user_data. The rest is
+// the connection or channel and the generation it was submitted for.
+enum uringOp_t {
+    URING_RECV,
+    URING_PIPE,
+    URING_RECORD,
+    URING_CANCEL,
+    URING_PIPE_POLL
+};
+
+static uint64_t uringTag(enum uringOp_t op, int idx, uint32_t gen)
+{
+    return ((uint64_t)op << 61) | ((uint64_t)idx << 32) | gen;
+}
+
+// Post a multishot receive on the streaming socket. It keeps completing
+// into the shared buffers until the socket closes or the buffers run out.
+int uringRecvArm(struct dvrConn_t *conn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(&g_uring.ring);
+    
+    if( !sqe )
+        return -1;
+    
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->sockFd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uringTag(URING_RECV, conn - g_conns, conn->uringGen);
+    
+    if( uringSubmit(&g_uring.ring, 0) < 0 )
+    {
+        sprintf(g_errBuf, "%s: %s", conn->label, "Failed to submit receive\n");
+        printError(g_errBuf);
+        return -1;
+    }
+    conn->uringArmed = true;
+    return 0;
+}
+
+// The receive holds its own reference to the socket, closing it isn't enough
+void uringRecvCancel(struct dvrConn_t *conn)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(&g_uring.ring);
+    
+    // Hand the queued SQEs to the kernel to make room, the receive must not outlive the connection
+    if( !sqe && uringSubmit(&g_uring.ring, 0) >= 0 )
+        sqe = uringGetSqe(&g_uring.ring);
+    if( !sqe )
+    {
+        sprintf(g_errBuf, "%s: %s", conn->label, "Failed to cancel receive\n");
+        printError(g_errBuf);
+        return;
+    }
+    
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uringTag(URING_RECV, conn - g_conns, conn->uringGen);
+    sqe->user_data = uringTag(URING_CANCEL, 0, 0);
+    uringSubmit(&g_uring.ring, 0);
+}
+
+// Queue a write of the rest of pipeOut. The pipe is non-blocking, so once
+// it has been full a poll for room goes first: the kernel waits for ffmpeg,
+// not the event loop. The write is only queued when the poll completes for
+// the pipe that is still open, never linked to it: a linked write would
+// only look up its fd then, and that number may have been reused.
+static int uringPipeWrite(struct channel_t *ch, int idx)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(&g_uring.ring);
+    
+    if( !sqe )
+        return -1;
+    
+    if( ch->pipeFull )
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = ch->outPipe;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = uringTag(URING_PIPE_POLL, idx, ch->pipeSeq);
+        ch->pipePolling = true;
+        return 0;
+    }
+    
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = ch->outPipe;
+    sqe->addr = (uint64_t)(uintptr_t)(ch->pipeOut + ch->pipeOff);
+    sqe->len = ch->pipeLen - ch->pipeOff;
+    sqe->user_data = uringTag(URING_PIPE, idx, ch->pipeSeq);
+    ch->pipeWriting = true;
+    return 0;
+}
+
+// Submit the pipe and recording writes of every channel in one go. A pipe
+// gets the next URING_PIPE_CHUNK bytes of its ring once the last chunk has
+// been written in full, and the ring goes on dropping old GOPs if ffmpeg
+// falls behind.
+static void uringFlush(void)
+{
+    struct io_uring_sqe *sqe;
+    struct channel_t *ch;
+    struct recorder_t *rec;
+    struct ringBuf_t *r;
+    size_t off, len, first;
+    bool queued = false;
+    int loopIdx;
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        ch = &g_channels[loopIdx];
+        r = &ch->ring;
+        rec = &ch->rec;
+        
+        if( ch->outPipe != -1 && !ch->pipeWriting && ch->pipeOff == ch->pipeLen && r->data && r->tail < r->head &&
+            (ch->pipeOut || (ch->pipeOut = malloc(URING_PIPE_CHUNK))) )
+        {
+            off = r->tail % r->size;
+            len = r->head - r->tail;
+            if( len > URING_PIPE_CHUNK )
+                len = URING_PIPE_CHUNK;
+            first = (len < r->size - off) ? len : r->size - off;
+            memcpy(ch->pipeOut, r->data + off, first);
+            memcpy(ch->pipeOut + first, r->data, len - first);
+            r->tail += len;
+            ringForgetWritten(r);
+            ch->pipeOff = 0;
+            ch->pipeLen = len;
+        }
+        
+        if( ch->outPipe != -1 && !ch->pipeWriting && !ch->pipePolling && ch->pipeOff < ch->pipeLen && uringPipeWrite(ch, loopIdx) == 0 )
+            queued = true;
+        
+        if( rec->fullLen && !rec->fullBusy && rec->fd != -1 && (sqe = uringGetSqe(&g_uring.ring)) )
+        {
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = rec->fd;
+            sqe->addr = (uint64_t)(uintptr_t)rec->full;
+            sqe->len = rec->fullLen;
+            sqe->off = rec->fullOff;
+            sqe->user_data = uringTag(URING_RECORD, loopIdx, rec->seq);
+            rec->fullBusy = true;
+            g_uring.recordWrites++;
+            queued = true;
+        }
+    }
+    
+    if( queued && uringSubmit(&g_uring.ring, 0) < 0 )
+        printError("Failed to submit writes\n");
+}
+
+// A pipe write has completed
+static void uringPipeDone(struct channel_t *ch, uint32_t seq, int res)
+{
+    ch->pipeWriting = false;
+    
+    // Meant for a pipe that has been closed since
+    if( seq != ch->pipeSeq || ch->outPipe == -1 )
+        return;
+    
+    // A short write leaves the rest for the next flush, once there is room
+    if( res >= 0 )
+    {
+        if( res > 0 )
+            ch->lastWrite = g_now;
+        ch->pipeOff += res;
+        ch->pipeFull = ch->pipeOff < ch->pipeLen;
+        return;
+    }
+    
+    // Full, nothing was written
+    if( res == -EAGAIN )
+    {
+        ch->pipeFull = true;
+        return;
+    }
+    
+    if( globalArgs.verbose )
+    {
+        errno = -res;
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Pipe closed\n");
+        printError(g_errBuf);
+    }
+    close(ch->outPipe);
+    ch->outPipe = -1;
+    ringRewind(&ch->ring);
+    if( ch->conn && ch->conn->channel == ch )
+        connDisconnect(ch->conn, 0);
+}
+
+// The pipe has room, or has been closed by ffmpeg: the write that follows finds out which
+static void uringPipePolled(struct channel_t *ch, uint32_t seq, int res)
+{
+    // A poll on a pipe closed since ends when its ffmpeg goes, and is forgotten
+    if( seq != ch->pipeSeq )
+        return;
+    
+    ch->pipePolling = false;
+    if( res >= 0 )
+        ch->pipeFull = false;
+}
+
+// A recording write has completed, the rest of a short one is written the ordinary way
+static void uringRecordDone(struct channel_t *ch, uint32_t seq, int res)
+{
+    struct recorder_t *r = &ch->rec;
+    
+    r->fullBusy = false;
+    g_uring.recordWrites--;
+    
+    if( seq != r->seq || r->fd == -1 )
+    {
+        r->fullLen = 0;
+        return;
+    }
+    
+    if( res < 0 )
+        errno = -res;
+    else
+    {
+        r->fullOff += res;
+        r->fullLen -= res;
+        memmove(r->full, r->full + res, r->fullLen);
+        res = recordWriteQueued(r);
+    }
+    
+    if( res < 0 )
+    {
+        r->fullLen = 0;
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Failed to write recording\n");
+        printError(g_errBuf);
+        recordClose(r);
+        r->waiting = true;
+    }
+}
+
+// Handle the completions. The writes the received data produces go out
+// afterwards, in uringFlush().
+static void uringEvent(void)
+{
+    struct io_uring_cqe *cqe;
+    struct dvrConn_t *conn;
+    uint64_t tag;
+    uint32_t flags, gen;
+    int res, idx;
+    
+    while( (cqe = uringPeekCqe(&g_uring.ring)) )
+    {
+        tag = cqe->user_data;
+        res = cqe->res;
+        flags = cqe->flags;
+        uringSeenCqe(&g_uring.ring);
+        
+        idx = (tag >> 32) & 0x1fffffff;
+        gen = (uint32_t)tag;
+        
+        switch( (enum uringOp_t)(tag >> 61) )
+        {
+            case URING_PIPE:
+                uringPipeDone(&g_channels[idx], gen, res);
+                continue;
+            case URING_PIPE_POLL:
+                uringPipePolled(&g_channels[idx], gen, res);
+                continue;
+            case URING_RECORD:
+                uringRecordDone(&g_channels[idx], gen, res);
+                continue;
+            case URING_CANCEL:
+                continue;
+            case URING_RECV:
+                break;
+        }
+        
+        conn = &g_conns[idx];
+        
+        // The socket has been closed since
+        if( gen != conn->uringGen || !conn->uringArmed )
+        {
+            if( flags & IORING_CQE_F_BUFFER )
+                uringBufReturn(flags >> IORING_CQE_BUFFER_SHIFT);
+            continue;
+        }
+        
+        if( res > 0 )
+        {
+            connReceived(conn, g_uring.bufs + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE, res);
+            uringBufReturn(flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        else if( res != -ENOBUFS )
+        {
+            if( globalArgs.verbose )
+                printMessage(true, "%s: Socket closed. Receive result: %i\n", conn->label, res);
+            connRetry(conn);
+            continue;
+        }
+        
+        // Ended because the buffers ran out, or the kernel stopped it. Still
+        // connected (connReceived() may have dropped it), so post another.
+        if( !(flags & IORING_CQE_F_MORE) && conn->uringArmed && gen == conn->uringGen )
+        {
+            conn->uringArmed = false;
+            if( uringRecvArm(conn) != 0 )
+                connRetry(conn);
+        }
+    }
+}
+
+// Called once the connections are closed. Recording writes are waited
+// for, pipe writes still waiting for ffmpeg are cancelled with the ring.
+static void uringClose(void)
+{
+    if( !g_uring.active )
+        return;
+    
+    while( g_uring.recordWrites > 0 && uringSubmit(&g_uring.ring, 1) >= 0 )
+        uringEvent();
+    
+    epoll_ctl(g_epollFd, EPOLL_CTL_DEL, g_uring.ring.fd, NULL);
+    uringFree(&g_uring.ring);
+    munmap(g_uring.bufRing, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(g_uring.bufs);
+    g_uring.bufs = NULL;
+    g_uring.bufRing = NULL;
+    g_uring.active = false;
+}
+
+void channelInit(struct channel_t *ch, int index)
+{
+    memset(ch, 0, sizeof(*ch));
+    ch->index = index;
+    ch->stats = &g_stats->ch[index];
+    ch->outPipe = -1;
+    ch->ffmpegPid = -1;
+    ch->spliceFds[0] = ch->spliceFds[1] = -1;
+    ch->snapshotWd = -1;
+    ch->rec.fd = ch->rec.indexFd = -1;
+    ch->rec.slot = -1;
+    recordReset(&ch->rec);
+    ch->dvrChannel = g_chConfig[index].dvrChannel;
+    
+    if( !g_chConfig[index].jpeg[0] )
+    {
+        sprintf(ch->fileloc, "/var/www/html/%i.jpg", index+1);
+        sprintf(ch->tmploc, "/var/www/html/.%i.tmp.jpg", index+1);
+    }
+    else
+    {
+        // ffmpeg's file goes next to it, so the rename stays on one filesystem
+        const char *name = strrchr(g_chConfig[index].jpeg, '/');
+        
+        name = name ? name + 1 : g_chConfig[index].jpeg;
+        strcpy(ch->fileloc, g_chConfig[index].jpeg);
+        sprintf(ch->tmploc, "%.*s.%s.tmp.jpg", (int)(name - g_chConfig[index].jpeg), g_chConfig[index].jpeg, name);
+    }
+}
+
+// Add a channel to 'conn' with -x, or to a new connection. Returns the connection.
+static struct dvrConn_t *connAdd(struct dvrConn_t *conn, int index, bool sub)
+{
+    struct channel_t *ch = &g_channels[index];
+    
+    if( !conn || !globalArgs.multiplex )
+    {
+        conn = &g_conns[g_connCount++];
+        memset(conn, 0, sizeof(*conn));
+        conn->type = POLL_DVR;
+        conn->dvr = g_chConfig[index].dvr;
+        conn->sockFd = -1;
+        conn->state = CH_WAITING;
+        conn->channel = globalArgs.multiplex ? NULL : &g_channels[index];
+        dvrFramerReset(&conn->framer);
+        strcpy(conn->label, "Ch ");
+    }
+    else
+        strcat(conn->label, "+");
+    
+    // A whole DVR's channels don't fit, the rest are left at "..."
+    if( strlen(conn->label) + sizeof("256 sub+...") > sizeof(conn->label) )
+    {
+        if( !strstr(conn->label, "...") )
+            strcat(conn->label, "...");
+        else
+            conn->label[strlen(conn->label) - 1] = '\0';
+    }
+    else
+        sprintf(conn->label + strlen(conn->label), sub ? "%i sub" : "%i", index+1);
+    conn->channelMask |= 1u << ch->dvrChannel;
+    if( sub )
+        conn->subMask |= 1u << ch->dvrChannel;
+    conn->chans[ch->dvrChannel] = ch;
+    return conn;
+}
+
+// Give every channel being streamed a DVR connection, or all of a DVR's channels the same
+// one with -x. A -S channel that is recorded or published gets a second one for its main
+// stream, shared by all of that DVR's with -x.
+void connSetup(void)
+{
+    struct dvrConn_t *conn = NULL, *mainConn = NULL;
+    bool mainWanted = globalArgs.recordDir || globalArgs.frameRingSize > 0;
+    bool sub;
+    int loopIdx;
+    int dvr = -1;
+    
+    g_connCount = 0;
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        if( globalArgs.channel[loopIdx] != true )
+            continue;
+        
+        // The channels of a DVR are listed together
+        if( g_chConfig[loopIdx].dvr != dvr )
+        {
+            dvr = g_chConfig[loopIdx].dvr;
+            conn = mainConn = NULL;
+        }
+        
+        sub = g_chConfig[loopIdx].sub;
+        conn = connAdd(conn, loopIdx, sub);
+        g_channels[loopIdx].conn = conn;
+        g_channels[loopIdx].mainConn = NULL;
+        
+        if( sub && mainWanted )
+        {
+            mainConn = connAdd(mainConn, loopIdx, false);
+            g_channels[loopIdx].mainConn = mainConn;
+        }
+    }
+}
+
+// Ask inotify to report when ffmpeg finishes writing the channel's JPEG to tmploc
+void channelWatchSnapshot(struct channel_t *ch)
+{
+    char dir[256];
+    
+    if( g_inotifyFd == -1 )
+        return;
+    
+    strcpy(dir, ch->fileloc);
+    ch->snapshotWd = inotify_add_watch(g_inotifyFd, dirname(dir), IN_CLOSE_WRITE);
+    
+    if( ch->snapshotWd == -1 && globalArgs.verbose )
+    {
+        sprintf(g_errBuf, "Ch %i: %s", ch->index+1, "Can't watch snapshot directory, polling it instead\n");
+        printError(g_errBuf);
+    }
+}
+
+static void channelSnapshotWritten(struct channel_t *ch, time_t when, off_t size)
+{
+    ch->lastSnapshot = when;
+    ch->snapshotSize = size;
+    __atomic_store_n(&ch->stats->lastSnapshot, (int64_t)when, __ATOMIC_RELAXED);
+}
+
+struct snapshotJpeg_t *snapshotJpegAlloc(size_t len)
+{
+    struct snapshotJpeg_t *jpeg = malloc(sizeof(*jpeg) + len);
+    
+    if( jpeg )
+    {
+        jpeg->refs = 1;
+        jpeg->len = len;
+        jpeg->etag[0] = '\0';
+    }
+    return jpeg;
+}
+
+void snapshotJpegRelease(struct snapshotJpeg_t *jpeg)
+{
+    if( jpeg && --jpeg->refs == 0 )
+        free(jpeg);
+}
+
+// Make 'jpeg' the channel's snapshot, the channel takes over the reference.
+// The file is written under another name and renamed over fileloc, so the
+// web server never sees half a JPEG.
+void snapshotPublish(struct channel_t *ch, struct snapshotJpeg_t *jpeg)
+{
+    uint64_t hash = 14695981039346656037ULL;	// FNV-1a
+    char tmpName[300];
+    ssize_t written = -1;
+    size_t loopIdx;
+    int fd;
+    
+    for( loopIdx=0;loopIdx<jpeg->len;loopIdx++ )
+        hash = (hash ^ jpeg->data[loopIdx]) * 1099511628211ULL;
+    snprintf(jpeg->etag, sizeof(jpeg->etag), "\"%016llx\"", (unsigned long long)hash);
+    
+    snprintf(tmpName, sizeof(tmpName), "%s.%i", ch->fileloc, (int)getpid());
+    fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if( fd != -1 )
+    {
+        written = write(fd, jpeg->data, jpeg->len);
+        if( close(fd) != 0 )
+            written = -1;
+    }
+    
+    if( written != (ssize_t)jpeg->len || rename(tmpName, ch->fileloc) != 0 )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Ch %i: Failed to write %.200s\n", ch->index+1, ch->fileloc);
+        printError(g_errBuf);
+        if( fd != -1 )
+            unlink(tmpName);
+    }
+    
+    snapshotJpegRelease(ch->jpeg);
+    ch->jpeg = jpeg;
+    channelSnapshotWritten(ch, g_now, jpeg->len);
+}
+
+// ffmpeg has closed tmploc. It may already be rewriting it by the time it's
+// read, so only a file that is whole from SOI to EOI is published.
+void channelSnapshotReady(struct channel_t *ch)
+{
+    struct snapshotJpeg_t *jpeg = NULL;
+    struct stat st;
+    ssize_t len = -1;
+    int fd;
+    
+    fd = open(ch->tmploc, O_RDONLY | O_CLOEXEC);
+    if( fd == -1 )
+        return;
+    
+    if( fstat(fd, &st) == 0 && st.st_size >= 4 && st.st_size <= SNAPSHOT_MAX_SIZE && (jpeg = snapshotJpegAlloc(st.st_size)) )
+        len = read(fd, jpeg->data, jpeg->len);
+    close(fd);
+    
+    if( !jpeg )
+        return;
+    
+    if( len != (ssize_t)jpeg->len || jpeg->data[0] != 0xff || jpeg->data[1] != 0xd8 ||
+        jpeg->data[len-2] != 0xff || jpeg->data[len-1] != 0xd9 )
+    {
+        if( globalArgs.verbose )
+            printMessage(true, "Ch %i: Skipping a JPEG that was still being written\n", ch->index+1);
+        snapshotJpegRelease(jpeg);
+        return;
+    }
+    
+    snapshotPublish(ch, jpeg);
+}
+
+// Drain the inotify queue and publish the channels' new JPEGs
+void readSnapshotEvents(void)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *ptr;
+    int loopIdx;
+    
+    if( g_inotifyFd == -1 )
+        return;
+    
+    while( (len = read(g_inotifyFd, buf, sizeof(buf))) > 0 )
+    {
+        for( ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len )
+        {
+            event = (const struct inotify_event*)ptr;
+            
+            if( !event->len )
+                continue;
+            
+            for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+            {
+                struct channel_t *ch = &g_channels[loopIdx];
+                char *name = strrchr(ch->tmploc, '/');
+                
+                if( ch->snapshotWd != event->wd || strcmp(name ? name + 1 : ch->tmploc, event->name) != 0 )
+                    continue;
+                
+                channelSnapshotReady(ch);
+            }
+        }
+    }
+}
+
+// Output health checks, run every WATCHDOG_INTERVAL seconds instead of per packet.
+// The times come from memory; ffmpeg's JPEG is only read when inotify says it
+// changed, or stat()'d on every check if the directory couldn't be watched.
+enum watchdog_t channelWatchdog(struct channel_t *ch)
+{
+    struct stat st;
+    double dt;
+    
+    if( ch->snapshotWd == -1 )
+    {
+        memset( &st, 0, sizeof(struct stat) );
+        if( stat(ch->tmploc, &st) == 0 && st.st_mtime > ch->lastSnapshot )
+            channelSnapshotReady(ch);
+    }
+    
+    if( ch->snapshotSize < 2500 && ch->snapshotSize > 10 ){
+        printMessage(true, "Stream %i ouput pic size %i, reconnecting\n", ch->index+1, (int)ch->snapshotSize);
+        remove(ch->fileloc);
+        ch->snapshotSize = 0;
+        return WD_SMALL_SNAPSHOT;
+    }
+    
+    dt = difftime(g_now, ch->lastSnapshot);
+    
+    // lastSnapshot is 0 until ffmpeg has been started
+    if( ch->lastSnapshot && dt > 30 ){
+        printMessage(true, "Stream %i FFMpeg output lagging by %f, restarting FFMpeg\n", ch->index+1, dt);
+        ch->lastSnapshot = g_now;
+        return WD_FFMPEG_LAG;
+    }
+    
+    dt = difftime(g_now, ch->lastWrite);
+    
+    if( ch->lastWrite && dt > 30 ){
+        printMessage(true, "Stream %i FFMpeg input pipe lagging by %f, restarting pipe\n", ch->index+1, dt);
+        ch->lastWrite = g_now;
+        return WD_PIPE_LAG;
+    }
+    return WD_OK;
+}
+
+
+// Connection timeouts and reconnects, run on every timer tick
+void connTimers(struct dvrConn_t *conn)
+{
+    if( conn->state == CH_WAITING )
+    {
+        if( g_now >= conn->retryTime )
+            connConnect(conn);
+    }
+    else if( conn->deadline && g_now >= conn->deadline )
+    {
+        if( globalArgs.verbose )
+            printMessage(true, "%s: Timed out waiting for DVR\n", conn->label);
+        connRetry(conn);
+    }
+}
+
+// The output watchdog, run on every timer tick while the channel is streaming
+void channelTimers(struct channel_t *ch)
+{
+    if( ch->conn->state != CH_STREAMING )
+        return;
+    
+    // ffmpeg quit or was restarted on a shared connection, the stream goes on without it
+    if( ch->ffmpegPid == -1 && !globalArgs.builtinSnapshot && !ch->conn->channel )
+    {
+        channelMakePipe(ch);
+        channelStartFfmpeg(ch);
+    }
+    
+    switch( channelWatchdog(ch) )
+    {
+        case WD_SMALL_SNAPSHOT:
+        case WD_PIPE_LAG:
+            channelRestart(ch);
+            break;
+        case WD_FFMPEG_LAG:
+#ifdef BUILTIN_SNAPSHOT
+            if( globalArgs.builtinSnapshot )
+            {
+                // Late because the -y workers are behind, the JPEG is still coming
+                if( snapshotWaiting(&ch->snap) )
+                    printMessage(true, "Ch %i: Snapshot workers are behind, keeping the decoder\n", ch->index+1);
+                else
+                    snapshotClose(&ch->snap);	// Reopened by the next keyframe
+                break;
+            }
+#endif
+            if( ch->ffmpegPid > 0 )
+                kill(ch->ffmpegPid, SIGKILL);
+            ch->ffmpegPid = -1;
+            if( ch->outPipe != -1 )
+                close(ch->outPipe);
+            ch->outPipe = -1;
+            ringRewind(&ch->ring);
+            channelStartFfmpeg(ch);
+            break;
+        case WD_OK:
+            break;
+    }
+}
+
+// Listen for -w viewers
+int httpOpen(void)
+{
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    int flag = true;
+    int loopIdx;
+    
+    for( loopIdx=0;loopIdx<HTTP_MAX_CLIENTS;loopIdx++ )
+    {
+        g_clients[loopIdx].type = POLL_HTTP_CLIENT;
+        g_clients[loopIdx].fd = -1;
+    }
+    
+    // Taken over with -i, it is listening already
+    if( g_httpFd == -1 )
+    {
+        g_httpFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if( g_httpFd == -1 )
+        {
+            printError("Failed to create HTTP socket\n");
+            return -1;
+        }
+        
+        if( setsockopt(g_httpFd, SOL_SOCKET, SO_REUSEADDR, (char*)&flag, sizeof(flag)) )
+            printError("Failed to set SO_REUSEADDR\n");
+        
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(globalArgs.httpPort);
+        
+        if( bind(g_httpFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(g_httpFd, SOMAXCONN) != 0 )
+        {
+            sprintf(g_errBuf, "Failed to listen on port %i\n", globalArgs.httpPort);
+            printError(g_errBuf);
+            close(g_httpFd);
+            g_httpFd = -1;
+            return -1;
+        }
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_httpListen;
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_httpFd, &ev);
+    return 0;
+}
+
+void httpClose(struct httpClient_t *c)
+{
+    if( c->fd == -1 )
+        return;
+    
+    if( c->ch )
+        printMessage(true, "Ch %i: HTTP viewer left after skipping %llu times\n", c->ch->index+1, (unsigned long long)c->skips);
+    
+    snapshotJpegRelease(c->jpeg);
+    c->jpeg = NULL;
+    epoll_ctl(g_epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->ch = NULL;
+}
+
+void httpAccept(void)
+{
+    static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+    struct httpClient_t *c;
+    struct epoll_event ev;
+    int sndBuf = HTTP_SNDBUF;
+    int fd, loopIdx;
+    
+    while( (fd = accept4(g_httpFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1 )
+    {
+        c = NULL;
+        for( loopIdx=0;loopIdx<HTTP_MAX_CLIENTS && !c;loopIdx++ )
+        {
+            if( g_clients[loopIdx].fd == -1 )
+                c = &g_clients[loopIdx];
+        }
+        
+        if( !c )
+        {
+            printMessage(true, "Too many HTTP viewers, turning one away\n");
+            send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+        
+        // Left to grow, the kernel would hide a slow viewer for many seconds
+        // instead of letting it skip GOPs
+        if( setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char*)&sndBuf, sizeof(sndBuf)) && globalArgs.verbose )
+            printError("Failed to set SO_SNDBUF\n");
+        
+        memset(c, 0, sizeof(*c));
+        c->type = POLL_HTTP_CLIENT;
+        c->fd = fd;
+        c->deadline = g_now + HTTP_REQUEST_TIMEOUT;
+        
+        // Edge triggered, EPOLLOUT only comes back after a send() fell short
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = c;
+        epoll_ctl(g_epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Send the viewer the frames it hasn't had yet, until its socket is full.
+// Returns -1 if the viewer has to go.
+static int httpSend(struct httpClient_t *c)
+{
+    struct zmRingHdr_t *hdr = c->ring->hdr;
+    struct zmFrame_t f;
+    ssize_t n;
+    int ret, skips = 0;
+    
+    while( !c->blocked )
+    {
+        if( !c->left )
+        {
+            ret = zmRingNext(&c->reader, &f);
+            if( ret == 0 )
+                return 0;
+            
+            // Lapped between frames, carry on from the latest keyframe. Never
+            // more than a few times a call, the DVR is still to be read.
+            if( ret == -1 )
+            {
+                if( ++skips > HTTP_SKIPS_MAX )
+                    return 0;
+                c->skips++;
+                c->started = false;	// The keyframe, if it's still there, or the next one
+                if( globalArgs.verbose )
+                    printMessage(true, "Ch %i: HTTP viewer fell behind, skipping to the latest keyframe\n", c->ch->index+1);
+                continue;
+            }
+            
+            if( !c->started && !f.key )
+                continue;
+            
+            // Half the ring behind, skip to the latest keyframe while the
+            // viewer is between frames rather than be dropped in the middle of one
+            if( hdr->writePos - f.pos > hdr->dataSize / 2 && hdr->keySeq > f.seq )
+            {
+                if( ++skips > HTTP_SKIPS_MAX )
+                    return 0;
+                zmRingResync(&c->reader);
+                c->started = false;
+                c->skips++;
+                if( globalArgs.verbose )
+                    printMessage(true, "Ch %i: HTTP viewer fell behind, skipping to the latest keyframe\n", c->ch->index+1);
+                continue;
+            }
+            
+            c->started = true;
+            c->pos = f.pos;
+            c->left = f.len;
+        }
+        
+        // Overwritten before it could all be sent, the viewer can't keep up at all
+        if( hdr->writePos - c->pos > hdr->dataSize )
+            return -1;
+        
+        n = send(c->fd, c->ring->data + (c->pos & (hdr->dataSize - 1)), c->left, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if( n == -1 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                c->blocked = true;
+                return 0;
+            }
+            return -1;
+        }
+        
+        c->pos += n;
+        c->left -= n;
+    }
+    return 0;
+}
+
+// Send the rest of a JPEG. Returns -1 once it's all sent, or the viewer has gone.
+static int httpSendJpeg(struct httpClient_t *c)
+{
+    ssize_t n;
+    
+    while( c->jpegSent < c->jpeg->len )
+    {
+        n = send(c->fd, c->jpeg->data + c->jpegSent, c->jpeg->len - c->jpegSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if( n == -1 )
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        c->jpegSent += n;
+    }
+    return -1;
+}
+
+static void httpReply(struct httpClient_t *c, const char *status, const char *type)
+{
+    char buf[256];
+    int len;
+    
+    len = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-Type: %s\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", status, type);
+    send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// "GET /<channel>.jpg" is answered from memory. A dashboard that sends back
+// the ETag it was given gets a 304 until there is a newer JPEG.
+static int httpJpeg(struct httpClient_t *c, struct channel_t *ch)
+{
+    struct snapshotJpeg_t *jpeg = ch->jpeg;
+    const char *match, *end;
+    char buf[256];
+    int len;
+    
+    if( !jpeg )
+    {
+        httpReply(c, "404 Not Found", "text/plain");
+        return -1;
+    }
+    
+    match = strcasestr(c->req, "\nIf-None-Match:");
+    if( match )
+    {
+        end = strchr(match + 1, '\n');
+        if( memmem(match, end - match, jpeg->etag, strlen(jpeg->etag)) )
+        {
+            len = snprintf(buf, sizeof(buf), "HTTP/1.0 304 Not Modified\r\nETag: %s\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", jpeg->etag);
+            send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            return -1;
+        }
+    }
+    
+    len = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\nETag: %s\r\n"
+                   "Cache-Control: no-cache\r\nConnection: close\r\n\r\n", jpeg->len, jpeg->etag);
+    send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    
+    // Held on to, a newer JPEG may be published before this one is all sent
+    jpeg->refs++;
+    c->jpeg = jpeg;
+    c->jpegSent = 0;
+    return httpSendJpeg(c);
+}
+
+// Read the request, "GET /<channel>.h264", "GET /<channel>.ts" or
+// "GET /<channel>.jpg". Returns -1 if the connection should be closed.
+static int httpRequest(struct httpClient_t *c)
+{
+    struct channel_t *ch;
+    struct frameRing_t *ring = NULL;
+    const char *type = NULL;
+    char path[64];
+    char *ext;
+    ssize_t n;
+    long channel;
+    
+    while( (n = read(c->fd, c->req + c->reqLen, sizeof(c->req) - 1 - c->reqLen)) > 0 )
+        c->reqLen += n;
+    
+    // A full buffer reads 0 as well, the request is too long
+    if( n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) )
+        return -1;
+    
+    c->req[c->reqLen] = '\0';
+    if( !strstr(c->req, "\r\n\r\n") && !strstr(c->req, "\n\n") )
+        return 0;
+    
+    if( sscanf(c->req, "GET /%63s", path) != 1 )
+    {
+        httpReply(c, "400 Bad Request", "text/plain");
+        return -1;
+    }
+    
+    channel = strtol(path, &ext, 10);
+    if( channel < 1 || channel > MAX_CHANNELS || globalArgs.channel[channel-1] != true )
+    {
+        httpReply(c, "404 Not Found", "text/plain");
+        return -1;
+    }
+    ch = &g_channels[channel-1];
+    
+    if( strcmp(ext, ".jpg") == 0 )
+        return httpJpeg(c, ch);
+    
+    if( strcmp(ext, ".h264") == 0 || *ext == '\0' )
+    {
+        ring = &ch->pub;
+        type = "video/h264";
+    }
+    else if( strcmp(ext, ".ts") == 0 )
+    {
+        ring = &ch->ts.ring;
+        type = "video/mp2t";
+    }
+    
+    if( !ring || !ring->hdr )
+    {
+        httpReply(c, "404 Not Found", "text/plain");
+        return -1;
+    }
+    
+    httpReply(c, "200 OK", type);
+    printMessage(true, "Ch %i: HTTP viewer joined for %s\n", ch->index+1, path);
+    
+    // Frames are read like any other ring reader, starting at the latest keyframe
+    c->ch = ch;
+    c->ring = ring;
+    c->reader.hdr = ring->hdr;
+    c->reader.data = ring->data;
+    c->reader.fd = -1;
+    zmRingResync(&c->reader);
+    return httpSend(c);
+}
+
+void httpEvent(struct httpClient_t *c, uint32_t events)
+{
+    char buf[256];
+    ssize_t n;
+    
+    if( c->fd == -1 )
+        return;			// Closed earlier in this wakeup
+    
+    if( events & (EPOLLERR | EPOLLHUP) )
+    {
+        httpClose(c);
+        return;
+    }
+    
+    if( c->jpeg )
+    {
+        if( (events & EPOLLOUT) && httpSendJpeg(c) != 0 )
+            httpClose(c);
+        return;
+    }
+    
+    if( !c->ch )
+    {
+        if( (events & EPOLLIN) && httpRequest(c) != 0 )
+            httpClose(c);
+        return;
+    }
+    
+    // Nothing more is expected from the viewer, except that it hangs up
+    if( events & EPOLLIN )
+    {
+        while( (n = read(c->fd, buf, sizeof(buf))) > 0 )
+            ;
+        if( n == 0 )
+        {
+            httpClose(c);
+            return;
+        }
+    }
+    
+    if( events & EPOLLOUT )
+        c->blocked = false;
+    
+    if( httpSend(c) != 0 )
+        httpClose(c);
+}
+
+// A frame was published on the channel, pass it on to its viewers
+void httpChannelFrame(struct channel_t *ch)
+{
+    int loopIdx;
+    
+    for( loopIdx=0;loopIdx<HTTP_MAX_CLIENTS;loopIdx++ )
+    {
+        struct httpClient_t *c = &g_clients[loopIdx];
+        
+        if( c->fd != -1 && c->ch == ch && !c->blocked && httpSend(c) != 0 )
+            httpClose(c);
+    }
+}
+
+// Drop viewers that never sent a request, or are too slow to take a JPEG
+void httpTimers(void)
+{
+    int loopIdx;
+    
+    for( loopIdx=0;loopIdx<HTTP_MAX_CLIENTS;loopIdx++ )
+    {
+        if( g_clients[loopIdx].fd != -1 && !g_clients[loopIdx].ch && g_now >= g_clients[loopIdx].deadline )
+            httpClose(&g_clients[loopIdx]);
+    }
+}
+
+static int handoffAddr(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if( strlen(globalArgs.handoffPath) >= sizeof(addr->sun_path) )
+    {
+        printMessage(true, "%.200s is too long for a Unix socket\n", globalArgs.handoffPath);
+        return -1;
+    }
+    strcpy(addr->sun_path, globalArgs.handoffPath);
+    return 0;
+}
+
+static int handoffSendMsg(int sock, struct handoffMsg_t *msg, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    
+    msg->magic = HANDOFF_MAGIC;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    
+    if( fd != -1 )
+    {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    
+    return (sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof(*msg)) ? 0 : -1;
+}
+
+// Returns the fd that came with the message, or -1. 'msg->magic' is 0 on failure.
+static int handoffRecvMsg(int sock, struct handoffMsg_t *msg)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    int fd = -1;
+    
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    
+    if( recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(*msg) )
+        msg->magic = 0;
+    
+    for( cmsg = CMSG_FIRSTHDR(&mh);cmsg;cmsg = CMSG_NXTHDR(&mh, cmsg) )
+    {
+        if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    
+    if( msg->magic != HANDOFF_MAGIC && fd != -1 )
+    {
+        close(fd);
+        fd = -1;
+    }
+    msg->pipename[sizeof(msg->pipename) - 1] = '\0';
+    return fd;
+}
+
+// With -i, take over from the instance listening on the socket if there is
+// one. The state is kept in g_handoff until the event loop has set up its
+// connections. Returns -1 if the old instance is there but it didn't work,
+// in which case it carries on.
+int handoffReceive(void)
+{
+    struct timeval tv = { 2 * HANDOFF_TIMEOUT + 1, 0 };
+    struct sockaddr_un addr;
+    struct handoffMsg_t *msg;
+    int sock, fd;
+    char ack = 1;
+    
+    if( handoffAddr(&addr) != 0 )
+        return -1;
+    
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if( sock == -1 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 )
+    {
+        if( sock != -1 )
+            close(sock);
+        return 0;		// Nobody to take over from
+    }
+    
+    printMessage(true, "Taking over from the instance on %.200s\n", globalArgs.handoffPath);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    
+    while( 1 )
+    {
+        if( g_handoffCount == HANDOFF_MAX )
+            break;
+        
+        msg = &g_handoff[g_handoffCount];
+        fd = handoffRecvMsg(sock, msg);
+        if( msg->magic != HANDOFF_MAGIC )
+            break;
+        
+        if( msg->type == HANDOFF_END )
+        {
+            // The old instance lets go of everything once it has this
+            if( send(sock, &ack, 1, MSG_NOSIGNAL) != 1 )
+                break;
+            close(sock);
+            return 0;
+        }
+        g_handoffFds[g_handoffCount++] = fd;
+    }
+    
+    printError("Handoff was cut short\n");
+    close(sock);
+    for( ;g_handoffCount > 0;g_handoffCount-- )
+    {
+        if( g_handoffFds[g_handoffCount-1] != -1 )
+            close(g_handoffFds[g_handoffCount-1]);
+    }
+    return -1;
+}
+
+// Put what handoffReceive() got in place, after connSetup(). Whatever the new
+// command line no longer asks for is closed, the rest starts up as usual.
+void handoffAdopt(void)
+{
+    struct handoffMsg_t *msg;
+    struct dvrConn_t *conn;
+    struct channel_t *ch;
+    struct epoll_event ev;
+    int loopIdx, connIdx, fd;
+    
+    for( loopIdx=0;loopIdx<g_handoffCount;loopIdx++ )
+    {
+        msg = &g_handoff[loopIdx];
+        fd = g_handoffFds[loopIdx];
+        
+        switch( msg->type )
+        {
+            case HANDOFF_CONN:
+                conn = NULL;
+                for( connIdx=0;connIdx<g_connCount && !conn;connIdx++ )
+                {
+                    if( g_conns[connIdx].channelMask == msg->channelMask && g_conns[connIdx].subMask == msg->subMask &&
+                        g_dvrs[g_conns[connIdx].dvr].addr.sin_addr.s_addr == msg->dvrAddr &&
+                        g_dvrs[g_conns[connIdx].dvr].addr.sin_port == msg->dvrPort && g_conns[connIdx].sockFd == -1 )
+                        conn = &g_conns[connIdx];
+                }
+                
+                if( !conn || fd == -1 )
+                {
+                    printMessage(true, "Closing the taken over DVR connection for channel mask 0x%x\n", msg->channelMask);
+                    if( fd != -1 )
+                        close(fd);
+                    break;
+                }
+                
+                // Already logged in and streaming, the framer starts on a message boundary
+                conn->sockFd = fd;
+                conn->state = CH_STREAMING;
+                conn->deadline = g_now + STREAM_TIMEOUT;
+                dvrFramerReset(&conn->framer);
+                conn->framer.skipMessages = DVR_LOGIN_REPLIES;
+                conn->framer.messages = msg->messages;
+                conn->framer.raw = msg->raw;
+                
+                ev.events = EPOLLIN;
+                ev.data.ptr = conn;
+                epoll_ctl(g_epollFd, EPOLL_CTL_ADD, conn->sockFd, &ev);
+                
+                for( connIdx=0;connIdx<DVR_CHANNELS;connIdx++ )
+                {
+                    if( !(ch = conn->chans[connIdx]) )
+                        continue;
+                    if( ch->mainConn != conn )
+                        nalFilterReset(&ch->nalFilt, globalArgs.keyframeInterval);
+                    if( !ch->mainConn || ch->mainConn == conn )
+                        recordReset(&ch->rec);
+                }
+                printMessage(true, "%s: Taken over\n", conn->label);
+                break;
+            
+            case HANDOFF_CHANNEL:
+                ch = (msg->channel < MAX_CHANNELS) ? &g_channels[msg->channel] : NULL;
+                
+                if( !ch || globalArgs.channel[msg->channel] != true || globalArgs.builtinSnapshot )
+                {
+                    if( msg->ffmpegPid > 0 )
+                        kill(msg->ffmpegPid, SIGKILL);
+                    if( fd != -1 )
+                        close(fd);
+                    if( msg->pipename[0] )
+                        unlink(msg->pipename);
+                    break;
+                }
+                
+                strcpy(ch->pipename, msg->pipename);
+                ch->outPipe = fd;
+                ch->ffmpegPid = msg->ffmpegPid;
+                ch->ffmpegAdopted = ch->ffmpegPid > 0;
+                ch->lastWrite = g_now;
+                ch->lastSnapshot = msg->lastSnapshot ? msg->lastSnapshot : g_now;
+                
+                // ffmpeg carries on from the last frame instead of waiting for a keyframe
+                if( globalArgs.ringSize && msg->pipeClean && ringInit(&ch->ring, (size_t)globalArgs.ringSize * 1024) == 0 )
+                    ch->ring.skipping = false;
+                break;
+            
+            case HANDOFF_HTTP:
+                if( globalArgs.httpPort && g_httpFd == -1 )
+                    g_httpFd = fd;
+                else if( fd != -1 )
+                    close(fd);
+                break;
+        }
+    }
+    g_handoffCount = 0;
+}
+
+// Listen on the -i socket for the instance that will replace this one
+int handoffListen(void)
+{
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    
+    if( handoffAddr(&addr) != 0 )
+        return -1;
+    
+    unlink(addr.sun_path);
+    g_handoffFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( g_handoffFd == -1 || bind(g_handoffFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(g_handoffFd, 1) != 0 )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to listen on %.200s\n", globalArgs.handoffPath);
+        printError(g_errBuf);
+        if( g_handoffFd != -1 )
+            close(g_handoffFd);
+        g_handoffFd = -1;
+        return -1;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = &g_handoffListen;
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, g_handoffFd, &ev);
+    return 0;
+}
+
+// Read no further than the end of the DVR message in progress, so the new
+// instance's framer starts on a header. Returns -1 if it didn't get there.
+static int handoffQuiesce(struct dvrConn_t *conn, time_t deadline)
+{
+    struct dvrFramer_t *f = &conn->framer;
+    struct pollfd pfd = { conn->sockFd, POLLIN, 0 };
+    int want, read;
+    
+    while( !f->raw && (f->remaining || f->hdrLen) )
+    {
+        want = f->remaining ? (int)f->remaining : DVR_HDR_SIZE - f->hdrLen;
+        if( want > (int)sizeof(conn->recvBuf) )
+            want = sizeof(conn->recvBuf);
+        
+        read = recv(conn->sockFd, conn->recvBuf, want, 0);
+        if( read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+        {
+            if( time(NULL) >= deadline || poll(&pfd, 1, 100) == -1 )
+                return -1;
+            continue;
+        }
+        if( read <= 0 )
+            return -1;
+        
+        if( !conn->channel || conn->channel->mainConn == conn )
+            dvrFramerParse(f, (unsigned char*)conn->recvBuf, read, connDeliver, conn);
+        else
+        {
+            read = dvrFramerStrip(f, (unsigned char*)conn->recvBuf, read, conn->channel);
+            channelRelay(conn->channel, conn->recvBuf, read);
+        }
+    }
+    return 0;
+}
+
+// A new instance connected to the -i socket. Every stream is brought to a
+// message boundary and whatever ffmpeg has queued is flushed, then the
+// sockets, FIFOs and ffmpeg processes are passed over and this instance quits
+// without touching them. If the new instance doesn't confirm, it carries on.
+void handoffSend(void)
+{
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+    struct handoffMsg_t msg;
+    struct pollfd pfd;
+    struct channel_t *ch;
+    struct dvrConn_t *conn;
+    bool handed[MAX_CONNS] = {false};
+    time_t deadline = time(NULL) + HANDOFF_TIMEOUT;
+    int sock, loopIdx;
+    int ret = 0;
+    char ack;
+    
+    sock = accept4(g_handoffFd, NULL, NULL, SOCK_CLOEXEC);
+    if( sock == -1 )
+        return;
+    
+    printMessage(true, "Handing over to a new instance\n");
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
+    
+    for( loopIdx=0;loopIdx<g_connCount && ret == 0;loopIdx++ )
+    {
+        conn = &g_conns[loopIdx];
+        handed[loopIdx] = conn->state == CH_STREAMING && handoffQuiesce(conn, deadline) == 0;
+        if( !handed[loopIdx] )
+            continue;
+        
+        memset(&msg, 0, sizeof(msg));
+        msg.type = HANDOFF_CONN;
+        msg.channelMask = conn->channelMask;
+        msg.subMask = conn->subMask;
+        msg.dvrAddr = g_dvrs[conn->dvr].addr.sin_addr.s_addr;
+        msg.dvrPort = g_dvrs[conn->dvr].addr.sin_port;
+        msg.messages = conn->framer.messages;
+        msg.raw = conn->framer.raw;
+        ret = handoffSendMsg(sock, &msg, conn->sockFd);
+    }
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS && ret == 0;loopIdx++ )
+    {
+        ch = &g_channels[loopIdx];
+        if( globalArgs.channel[loopIdx] != true || ch->ffmpegPid <= 0 )
+            continue;
+        
+        // What ffmpeg hasn't taken yet would be lost, give it a moment
+        pfd.fd = ch->outPipe;
+        pfd.events = POLLOUT;
+        while( ch->outPipe != -1 && ch->ring.data && ch->ring.tail < ch->ring.head &&
+               ringFlush(&ch->ring, ch->outPipe) >= 0 && time(NULL) < deadline )
+            poll(&pfd, 1, 100);
+        
+        memset(&msg, 0, sizeof(msg));
+        msg.type = HANDOFF_CHANNEL;
+        msg.channel = loopIdx;
+        msg.ffmpegPid = ch->ffmpegPid;
+        msg.lastSnapshot = ch->lastSnapshot;
+        msg.pipeClean = !ch->ring.data || (ch->ring.tail == ch->ring.head && !ch->ring.skipping);
+        strcpy(msg.pipename, ch->pipename);
+        ret = handoffSendMsg(sock, &msg, ch->outPipe);
+    }
+    
+    if( g_httpFd != -1 && ret == 0 )
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.type = HANDOFF_HTTP;
+        ret = handoffSendMsg(sock, &msg, g_httpFd);
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.type = HANDOFF_END;
+    if( ret != 0 || handoffSendMsg(sock, &msg, -1) != 0 || recv(sock, &ack, 1, 0) != 1 )
+    {
+        printError("Handoff failed, carrying on\n");
+        close(sock);
+        return;
+    }
+    close(sock);
+    
+    // Let go of it all without closing anything down, the new instance has its own copies
+    for( loopIdx=0;loopIdx<g_connCount;loopIdx++ )
+    {
+        conn = &g_conns[loopIdx];
+        if( handed[loopIdx] )
+        {
+            epoll_ctl(g_epollFd, EPOLL_CTL_DEL, conn->sockFd, NULL);
+            close(conn->sockFd);
+            conn->sockFd = -1;
+            conn->state = CH_WAITING;
+        }
+    }
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        ch = &g_channels[loopIdx];
+        if( globalArgs.channel[loopIdx] != true || ch->ffmpegPid <= 0 )
+            continue;
+        if( ch->outPipe != -1 )
+            close(ch->outPipe);
+        ch->outPipe = -1;
+        ch->ffmpegPid = -1;
+        ch->pipename[0] = '\0';
+    }
+    
+    if( g_httpFd != -1 )
+    {
+        epoll_ctl(g_epollFd, EPOLL_CTL_DEL, g_httpFd, NULL);
+        close(g_httpFd);
+        g_httpFd = -1;
+    }
+    
+    close(g_handoffFd);
+    g_handoffFd = -1;
+    g_cleanUp = 1;
+    printMessage(true, "Handed over, exiting\n");
+}
+
+// Totals of a -d run, shared by its worker processes
+struct batchShared_t {
+    int next;			// Next file to be taken
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t frames;
+    uint64_t keyframes;
+    bool picked;		// -c was given, other channels are passed over
+};
+
+// One DVR connection in the input: the whole file, or a TCP flow of a pcap
+struct batchFlow_t {
+    struct dvrFramer_t framer;
+    int rawChannel;		// Channel of a stream without DVR headers
+    // pcap only
+    unsigned char addr[16];	// DVR address, IPv4 in the first 4 bytes
+    uint16_t port;		// Client port, tells the DVR's connections apart
+    uint32_t nextSeq;
+    uint64_t gaps;		// Bytes missing from the capture
+    // Bare H.264 only
+    int nalZeros;		// nalScan() state
+    int nalWant;		// 1 after a start code, 2 after a slice's NAL header
+    int nalType;
+};
+
+struct batchShared_t *g_batch;
+
+// A stream without DVR headers has no messages to count frames by, so count
+// the slices that start a picture: first_mb_in_slice is 0, a single 1 bit.
+static void batchCountPictures(struct batchFlow_t *flow, struct chStats_t *st, const unsigned char *data, int len)
+{
+    int i = 0;
+    
+    while( i < len )
+    {
+        if( flow->nalWant == 1 )
+        {
+            flow->nalType = data[i++] & 0x1f;
+            flow->nalWant = (flow->nalType == 1 || flow->nalType == 5) ? 2 : 0;
+        }
+        else if( flow->nalWant == 2 )
+        {
+            if( data[i] & 0x80 )
+                statsCount(st, flow->nalType == 5);
+            flow->nalWant = 0;
+        }
+        else if( (i = nalScan(data, i, len, &flow->nalZeros)) < len )
+        {
+            flow->nalZeros = 0;
+            flow->nalWant = 1;
+            i++;
+        }
+    }
+}
+
+// Framer callback: the same stages as a live channel, minus the pipe to ffmpeg
+static void batchDeliver(void *ctx, const struct dvrFrame_t *frame, const unsigned char *data, int len)
+{
+    struct batchFlow_t *flow = ctx;
+    struct channel_t *ch;
+    int channel = (frame->channel >= 0) ? frame->channel : flow->rawChannel;
+    bool key;
+    
+    if( channel < 0 || channel >= MAX_CHANNELS || (g_batch->picked && !globalArgs.channel[channel]) )
+        return;
+    
+    ch = &g_channels[channel];
+    if( frame->sequence )
+        statsFrame(ch->stats, frame, data, len);
+    else
+        batchCountPictures(flow, ch->stats, data, len);
+    activityFrame(ch, frame, data, len);
+    statsAdd(&ch->stats->bytes, len);
+    key = frame->offset == 0 && nalIsKeyframe(data, len);
+    
+    recordWrite(ch, data, len);
+    
+    if( globalArgs.keyframeInterval )
+    {
+        ch->nalFilt.hold = activityHold(ch);
+        len = nalFilter(&ch->nalFilt, data, len, (unsigned char*)ch->filterBuf, sizeof(ch->filterBuf));
+        data = (unsigned char*)ch->filterBuf;
+        if( ch->nalFilt.overflow )
+            printMessage(false, "Ch %i: Keyframe filter output full, %i bytes left out\n", ch->index+1, ch->nalFilt.overflow);
+    }
+
+#ifdef BUILTIN_SNAPSHOT
+    // Every keyframe let through gets a JPEG of its own, named after its number
+    if( globalArgs.builtinSnapshot )
+    {
+        if( key )
+        {
+            ch->snap.nextJpeg = 0;
+            snprintf(ch->fileloc, sizeof(ch->fileloc), "%s/%i-%06llu.jpg", globalArgs.recordDir, channel+1, (unsigned long long)statsGet(&ch->stats->keyframes));
+        }
+        snapshotFeed(ch, &ch->nalFilt, data, len);
+    }
+#else
+    (void)key;
+#endif
+}
+
+static void batchFeed(struct batchFlow_t *flow, const unsigned char *data, size_t len)
+{
+    size_t n;
+    
+    while( len > 0 )
+    {
+        n = (len < BATCH_CHUNK) ? len : BATCH_CHUNK;
+        dvrFramerParse(&flow->framer, data, n, batchDeliver, flow);
+        data += n;
+        len -= n;
+    }
+    g_now = time(NULL);
+}
+
+static void batchFlowReset(struct batchFlow_t *flow, int rawChannel)
+{
+    memset(flow, 0, sizeof(*flow));
+    dvrFramerReset(&flow->framer);
+    flow->rawChannel = rawChannel;
+}
+
+// Follow the TCP payload the DVR (source port -p) sent in a classic pcap file.
+// Retransmissions are dropped; segments lost from the capture, or captured
+// out of order, leave a gap that the framer resyncs after.
+static int batchPcap(const char *path, const unsigned char *data, size_t size, int rawChannel)
+{
+    static struct batchFlow_t flows[BATCH_MAX_FLOWS];
+    struct batchFlow_t *flow;
+    const unsigned char *pkt, *src;	// src is the DVR's address in the IP header
+    uint32_t magic = readLE32(data);
+    uint32_t linkType, capLen, seq;
+    bool swapped = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+    size_t pos = 24;
+    int flowCount = 0, loopIdx, l3, l4, ipLen, addrLen, hdrLen, payload;
+    int32_t ahead;
+    uint16_t proto;
+    
+    linkType = readLE32(data + 20);
+    if( swapped )
+        linkType = __builtin_bswap32(linkType);
+    
+    while( pos + 16 <= size )
+    {
+        capLen = readLE32(data + pos + 8);
+        if( swapped )
+            capLen = __builtin_bswap32(capLen);
+        pkt = data + pos + 16;
+        pos += 16 + capLen;
+        if( pos > size )
+            break;
+        
+        // Down to the IP header
+        switch( linkType )
+        {
+            case 1:		// Ethernet, maybe with a VLAN tag
+                l3 = 14;
+                proto = (capLen >= 14) ? (pkt[12] << 8) | pkt[13] : 0;
+                if( proto == 0x8100 && capLen >= 18 )
+                {
+                    proto = (pkt[16] << 8) | pkt[17];
+                    l3 = 18;
+                }
+                break;
+            case 113:		// Linux cooked
+                l3 = 16;
+                proto = (capLen >= 16) ? (pkt[14] << 8) | pkt[15] : 0;
+                break;
+            case 276:		// Linux cooked v2
+                l3 = 20;
+                proto = (capLen >= 20) ? (pkt[0] << 8) | pkt[1] : 0;
+                break;
+            case 101:		// Raw IP
+            case 228:
+                l3 = 0;
+                proto = (capLen > 0 && (pkt[0] >> 4) == 6) ? 0x86dd : 0x0800;
+                break;
+            default:
+                printMessage(false, "%s: Unsupported pcap link type %u\n", path, linkType);
+                return -1;
+        }
+        
+        if( proto == 0x0800 && capLen >= (uint32_t)l3 + 20 && pkt[l3 + 9] == IPPROTO_TCP )
+        {
+            l4 = l3 + (pkt[l3] & 0x0f) * 4;
+            ipLen = l3 + ((pkt[l3 + 2] << 8) | pkt[l3 + 3]);
+            addrLen = 4;
+            src = pkt + l3 + 12;
+        }
+        else if( proto == 0x86dd && capLen >= (uint32_t)l3 + 40 && pkt[l3 + 6] == IPPROTO_TCP )
+        {
+            l4 = l3 + 40;
+            ipLen = l4 + ((pkt[l3 + 4] << 8) | pkt[l3 + 5]);
+            addrLen = 16;
+            src = pkt + l3 + 8;
+        }
+        else
+            continue;
+        
+        // Ethernet pads short frames, the IP length says where the data ends
+        if( ipLen > (int)capLen )
+            ipLen = capLen;
+        if( l4 + 20 > ipLen || ((pkt[l4] << 8) | pkt[l4 + 1]) != globalArgs.port )
+            continue;
+        
+        // Find the connection by the client's port
+        for( loopIdx=0;loopIdx<flowCount;loopIdx++ )
+        {
+            if( flows[loopIdx].port == ((pkt[l4 + 2] << 8) | pkt[l4 + 3]) && memcmp(flows[loopIdx].addr, src, addrLen) == 0 )
+                break;
+        }
+        flow = &flows[loopIdx];
+        seq = ((uint32_t)pkt[l4 + 4] << 24) | (pkt[l4 + 5] << 16) | (pkt[l4 + 6] << 8) | pkt[l4 + 7];
+        hdrLen = (pkt[l4 + 12] >> 4) * 4;
+        payload = ipLen - l4 - hdrLen;
+        
+        // A SYN starts the connection over, new or reusing the port
+        if( loopIdx == flowCount || (pkt[l4 + 13] & 0x02) )
+        {
+            if( loopIdx == flowCount )
+            {
+                if( flowCount == BATCH_MAX_FLOWS )
+                    continue;
+                flowCount++;
+            }
+            batchFlowReset(flow, rawChannel);
+            memcpy(flow->addr, src, addrLen);
+            flow->port = (pkt[l4 + 2] << 8) | pkt[l4 + 3];
+            flow->nextSeq = seq + ((pkt[l4 + 13] & 0x02) ? 1 : 0);
+        }
+        
+        if( payload <= 0 )
+            continue;
+        
+        ahead = (int32_t)(seq - flow->nextSeq);
+        if( ahead + payload <= 0 )
+            continue;			// Retransmitted
+        if( ahead < 0 )
+        {
+            l4 -= ahead;		// Partly retransmitted
+            payload += ahead;
+        }
+        else if( ahead > 0 )
+        {
+            flow->gaps += ahead;
+            flow->framer.hdrLen = 0;
+            flow->framer.remaining = 0;
+        }
+        batchFeed(flow, pkt + l4 + hdrLen, payload);
+        flow->nextSeq = seq + (ahead < 0 ? -ahead : 0) + payload;
+    }
+    
+    for( loopIdx=0;loopIdx<flowCount;loopIdx++ )
+    {
+        if( flows[loopIdx].gaps )
+            printMessage(false, "%s: Connection from port %i is missing %llu bytes\n", path, flows[loopIdx].port, (unsigned long long)flows[loopIdx].gaps);
+    }
+    return 0;
+}
+
+// Where the recordings and JPEGs of files[idx] go: <dir>/<file name>/, or
+// <dir>/<file name>-<n>/ if another of the files has the same name
+static void batchOutDir(char **files, int count, int idx, char *dir, size_t size)
+{
+    char name[256], other[256];
+    int loopIdx;
+    
+    snprintf(name, sizeof(name), "%s", files[idx]);
+    snprintf(dir, size, "%s/%s", globalArgs.batchDir, basename(name));
+    for( loopIdx=0;loopIdx<count;loopIdx++ )
+    {
+        snprintf(name, sizeof(name), "%s", files[idx]);
+        snprintf(other, sizeof(other), "%s", files[loopIdx]);
+        if( loopIdx != idx && strcmp(basename(name), basename(other)) == 0 )
+        {
+            snprintf(dir, size, "%s/%s-%i", globalArgs.batchDir, basename(name), idx+1);
+            break;
+        }
+    }
+}
+
+// Run one capture file through every channel's pipeline, from a clean start
+static int batchFile(char **files, int count, int idx, int rawChannel)
+{
+    const char *path = files[idx];
+    char *recordDir = globalArgs.recordDir;
+    struct batchFlow_t flow;
+    struct timespec start, end;
+    uint64_t bytes = 0, frames = 0, keyframes = 0;
+    char dir[300];
+    unsigned char *data;
+    struct stat st;
+    double secs;
+    int fd, loopIdx, ret = 0;
+    uint32_t magic;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if( fd == -1 || fstat(fd, &st) != 0 )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to open %.200s", path);
+        printError(g_errBuf);
+        if( fd != -1 )
+            close(fd);
+        return -1;
+    }
+    if( st.st_size < 24 )
+    {
+        close(fd);
+        printMessage(false, "%s: Too short to hold a stream\n", path);
+        return -1;
+    }
+    
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( data == MAP_FAILED )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to map %.200s", path);
+        printError(g_errBuf);
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    
+    batchOutDir(files, count, idx, dir, sizeof(dir));
+    if( mkdir(dir, 0777) != 0 && errno != EEXIST )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to create %.200s", dir);
+        printError(g_errBuf);
+        munmap(data, st.st_size);
+        return -1;
+    }
+    globalArgs.recordDir = dir;
+    
+    memset(&g_statsLocal, 0, sizeof(g_statsLocal));
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        channelInit(&g_channels[loopIdx], loopIdx);
+        nalFilterReset(&g_channels[loopIdx].nalFilt, globalArgs.keyframeInterval);
+    }
+    
+    g_now = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    magic = readLE32(data);
+    if( magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 || magic == 0xa1b23c4d || magic == 0x4d3cb2a1 )
+        ret = batchPcap(path, data, st.st_size, rawChannel);
+    else
+    {
+        // Bare H.264 is passed through from the first byte, not after DVR_SYNC_LIMIT
+        batchFlowReset(&flow, rawChannel);
+        flow.framer.raw = magic != 0x31313131;
+        batchFeed(&flow, data, st.st_size);
+    }
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        struct channel_t *ch = &g_channels[loopIdx];
+        
+        recordClose(&ch->rec);
+        free(ch->rec.buf);
+#ifdef BUILTIN_SNAPSHOT
+        snapshotClose(&ch->snap);
+        snapshotJpegRelease(ch->jpeg);
+#endif
+        bytes += ch->stats->bytes;
+        frames += ch->stats->frames;
+        keyframes += ch->stats->keyframes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    munmap(data, st.st_size);
+    globalArgs.recordDir = recordDir;
+    
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if( secs <= 0 )
+        secs = 1e-9;
+    printMessage(false, "%s: %llu frames (%llu keyframes), %.1f MB in %.2f s, %.0f frames/s, %.1f MB/s\n", path,
+                 (unsigned long long)frames, (unsigned long long)keyframes, bytes / 1e6, secs, frames / secs, bytes / 1e6 / secs);
+    
+    __atomic_add_fetch(&g_batch->files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_batch->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_batch->frames, frames, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_batch->keyframes, keyframes, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// -d: spread the files over a process per core, each taking the next file
+// left until none are. Returns non-zero if any file failed.
+int runBatch(char **files, int count)
+{
+    struct timespec start, end;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int rawChannel = 0;
+    int loopIdx, idx, status, failed = 0;
+    pid_t pid;
+    double secs;
+    
+    if( mkdir(globalArgs.batchDir, 0777) != 0 && errno != EEXIST )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to create %.200s", globalArgs.batchDir);
+        printError(g_errBuf);
+        return -1;
+    }
+    
+    // Streams without DVR headers are taken to be the first channel given
+    g_batch = mmap(NULL, sizeof(*g_batch), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if( g_batch == MAP_FAILED )
+    {
+        snprintf(g_errBuf, sizeof(g_errBuf), "Failed to map the batch totals");
+        printError(g_errBuf);
+        return -1;
+    }
+    memset(g_batch, 0, sizeof(*g_batch));
+    
+    for( loopIdx=MAX_CHANNELS-1;loopIdx>=0;loopIdx-- )
+    {
+        if( globalArgs.channel[loopIdx] )
+        {
+            rawChannel = loopIdx;
+            g_batch->picked = true;
+        }
+    }
+    
+    if( workers < 1 )
+        workers = 1;
+    if( workers > count )
+        workers = count;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for( loopIdx=0;loopIdx<workers;loopIdx++ )
+    {
+        pid = fork();
+        if( pid == -1 )
+        {
+            printMessage(false, "fork failed\n");
+            break;
+        }
+        if( pid == 0 )
+        {
+            logStart();
+            failed = 0;
+            while( (idx = __atomic_fetch_add(&g_batch->next, 1, __ATOMIC_RELAXED)) < count )
+            {
+                if( batchFile(files, count, idx, rawChannel) != 0 )
+                    failed = 1;
+            }
+            exit(failed);
+        }
+    }
+    
+    while( (pid = wait(&status)) > 0 )
+    {
+        if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+            failed = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if( secs <= 0 )
+        secs = 1e-9;
+    printMessage(false, "%llu of %i files on %i processes: %llu frames (%llu keyframes), %.1f MB in %.2f s, %.0f frames/s, %.1f MB/s\n",
+                 (unsigned long long)g_batch->files, count, workers, (unsigned long long)g_batch->frames, (unsigned long long)g_batch->keyframes,
+                 g_batch->bytes / 1e6, secs, g_batch->frames / secs, g_batch->bytes / 1e6 / secs);
+    return failed || g_batch->files != (uint64_t)count;
+}
+
+// Read the -C file into g_dvrs and g_chConfig, and mark its channels in
+// globalArgs.channel. Returns -1 once the first mistake in it is reported.
+int configLoad(const char *path)
+{
+    const char *space = " \t\r\n";
+    struct chConfig_t *cfg;
+    struct dvr_t *dvr = NULL;
+    char line[512];
+    char *word, *save;
+    int lineNo = 0, index = 0, loopIdx, w, h;
+    bool bad;
+    FILE *fp;
+    
+    if( (fp = fopen(path, "r")) == NULL )
+    {
+        printMessage(false, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    
+    while( fgets(line, sizeof(line), fp) )
+    {
+        lineNo++;
+        if( (word = strchr(line, '#')) )
+            *word = '\0';
+        if( (word = strtok_r(line, space, &save)) == NULL )
+            continue;
+        
+        bad = false;
+        if( strcmp(word, "workers") == 0 )
+        {
+            word = strtok_r(NULL, space, &save);
+            globalArgs.workers = word ? atoi(word) : -1;
+            bad = globalArgs.workers < 1;
+        }
+        else if( strcmp(word, "pipes") == 0 )
+        {
+            word = strtok_r(NULL, space, &save);
+            bad = !word || strlen(word) > 200;
+            if( !bad )
+                globalArgs.pipeDir = strdup(word);
+        }
+        else if( strcmp(word, "dvr") == 0 )
+        {
+            if( g_dvrCount == MAX_DVRS )
+            {
+                printMessage(false, "%s:%i: Only %i DVRs are supported\n", path, lineNo, MAX_DVRS);
+                break;
+            }
+            
+            word = strtok_r(NULL, space, &save);
+            bad = !word || strlen(word) >= sizeof(dvr->host);
+            if( !bad )
+            {
+                dvr = &g_dvrs[g_dvrCount++];
+                strcpy(dvr->host, word);
+                word = strtok_r(NULL, space, &save);
+                dvr->port = word ? atoi(word) : 9000;
+                bad = word && (atoi(word) < 1 || atoi(word) > 65535);
+            }
+        }
+        else if( strcmp(word, "channel") == 0 )
+        {
+            if( !dvr )
+            {
+                printMessage(false, "%s:%i: A channel has to come after its dvr line\n", path, lineNo);
+                break;
+            }
+            if( index == MAX_CHANNELS )
+            {
+                printMessage(false, "%s:%i: Only %i channels are supported\n", path, lineNo, MAX_CHANNELS);
+                break;
+            }
+            
+            cfg = &g_chConfig[index];
+            cfg->dvr = dvr - g_dvrs;
+            word = strtok_r(NULL, space, &save);
+            cfg->dvrChannel = word ? atoi(word) - 1 : -1;
+            if( cfg->dvrChannel < 0 || cfg->dvrChannel >= DVR_CHANNELS )
+            {
+                printMessage(false, "%s:%i: Channel must be between 1 and %i\n", path, lineNo, DVR_CHANNELS);
+                break;
+            }
+            
+            for( loopIdx=0;loopIdx<index;loopIdx++ )
+            {
+                if( g_chConfig[loopIdx].dvr == cfg->dvr && g_chConfig[loopIdx].dvrChannel == cfg->dvrChannel )
+                    break;
+            }
+            if( loopIdx < index )
+            {
+                printMessage(false, "%s:%i: Channel %i of %s is already channel %i\n", path, lineNo, cfg->dvrChannel+1, dvr->host, loopIdx+1);
+                break;
+            }
+            
+            while( !bad && (word = strtok_r(NULL, space, &save)) )
+            {
+                if( strcmp(word, "sub") == 0 )
+                    cfg->sub = true;
+                else if( strcmp(word, "jpeg") == 0 && (word = strtok_r(NULL, space, &save)) && strlen(word) < sizeof(cfg->jpeg) )
+                    strcpy(cfg->jpeg, word);
+                else if( strcmp(word, "size") == 0 && (word = strtok_r(NULL, space, &save)) && strlen(word) < sizeof(cfg->size) &&
+                         sscanf(word, "%ix%i", &w, &h) == 2 && w > 0 && h > 0 )
+                    strcpy(cfg->size, word);
+                else
+                    bad = true;
+            }
+            
+            globalArgs.channel[index++] = true;
+            dvr->channels++;
+        }
+        else
+            bad = true;
+        
+        if( bad )
+        {
+            printMessage(false, "%s:%i: Don't know what to make of this line\n", path, lineNo);
+            break;
+        }
+    }
+    
+    if( feof(fp) && index == 0 )
+        printMessage(false, "%s: No channels to stream\n", path);
+    
+    bad = !feof(fp) || index == 0;
+    fclose(fp);
+    return bad ? -1 : 0;
+}
+
+// Look up the address of the DVR's host
+int dvrResolve(struct dvr_t *dvr)
+{
+    struct addrinfo hints, *server;
+    int retval;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_protocol = IPPROTO_TCP;
+    retval = getaddrinfo(dvr->host, NULL, &hints, &server);
+    if( retval != 0 )
+    {
+        printMessage(false, "getaddrinfo failed for %s: %s\n", dvr->host, gai_strerror(retval));
+        return -1;
+    }
+    
+    memset(&dvr->addr, 0, sizeof(dvr->addr));
+    dvr->addr.sin_family = AF_INET;
+    dvr->addr.sin_addr = ((struct sockaddr_in*)server->ai_addr)->sin_addr;
+    dvr->addr.sin_port = htons(dvr->port);
+    freeaddrinfo(server);
+    return 0;
+}
+
+// Start -C worker 'worker', pinned to 'cpu'. Returns its pid to the parent, and
+// 0 in the worker with globalArgs.channel narrowed to the channels of its DVRs.
+static pid_t workerStart(int worker, int cpu)
+{
+    cpu_set_t set;
+    pid_t pid;
+    int loopIdx;
+    
+    if( (pid = fork()) != 0 )
+        return pid;
+    
+    // Each worker jitters its reconnects differently
+    srand(time(0) ^ getpid());
+    g_worker = worker;
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+        globalArgs.channel[loopIdx] = g_chConfig[loopIdx].streamed && g_dvrs[g_chConfig[loopIdx].dvr].worker == worker;
+    
+    if( cpu >= 0 )
+    {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    
+    // The worker has its core to itself, keyframes are decoded in its event loop unless -y says otherwise
+    if( globalArgs.snapshotWorkers < 0 )
+        globalArgs.snapshotWorkers = 0;
+    
+    logStart();
+    return 0;
+}
+
+// -C: share the DVRs out between worker processes, each pinned to a core of
+// its own, so the channels stay where they were put however many there are.
+// A DVR's channels all go to the same worker, as -x needs, and each DVR goes to
+// the worker with the fewest channels so far, the largest first. Returns 0 in
+// a worker, which goes on to run the event loop. The parent restarts workers
+// that die and passes SIGUSR1/2 on, returning 1 once told to quit or -1 if
+// none could be started.
+int runWorkers(void)
+{
+    pid_t pids[CONFIG_WORKERS_MAX];
+    int load[CONFIG_WORKERS_MAX] = {0};
+    int cpus[CONFIG_WORKERS_MAX];
+    int workers = globalArgs.workers;
+    int cpuCount = 0, loopIdx, idx, worker, dvr, status;
+    char pipename[256];
+    struct sigaction sa;
+    pid_t pid;
+    
+    if( sched_getaffinity(0, sizeof(g_cpusAllowed), &g_cpusAllowed) == 0 )
+    {
+        for( loopIdx=0;loopIdx<CPU_SETSIZE && cpuCount<CONFIG_WORKERS_MAX;loopIdx++ )
+        {
+            if( CPU_ISSET(loopIdx, &g_cpusAllowed) )
+                cpus[cpuCount++] = loopIdx;
+        }
+    }
+    
+    if( workers <= 0 )
+        workers = cpuCount;
+    if( workers > g_dvrCount )
+        workers = g_dvrCount;
+    if( workers > CONFIG_WORKERS_MAX )
+        workers = CONFIG_WORKERS_MAX;
+    if( workers < 1 )
+        workers = 1;
+    
+    for( loopIdx=0;loopIdx<g_dvrCount;loopIdx++ )
+        g_dvrs[loopIdx].worker = -1;
+    
+    for( loopIdx=0;loopIdx<g_dvrCount;loopIdx++ )
+    {
+        // Largest DVR left
+        dvr = -1;
+        for( idx=0;idx<g_dvrCount;idx++ )
+        {
+            if( g_dvrs[idx].worker == -1 && (dvr == -1 || g_dvrs[idx].channels > g_dvrs[dvr].channels) )
+                dvr = idx;
+        }
+        
+        // Least loaded worker
+        worker = 0;
+        for( idx=1;idx<workers;idx++ )
+        {
+            if( load[idx] < load[worker] )
+                worker = idx;
+        }
+        
+        g_dvrs[dvr].worker = worker;
+        load[worker] += g_dvrs[dvr].channels;
+    }
+    
+    g_workerParent = getpid();
+    for( worker=0;worker<workers;worker++ )
+    {
+        printMessage(true, "Starting worker %i for %i channels on CPU %i\n", worker+1, load[worker], cpuCount ? cpus[worker % cpuCount] : -1);
+        pids[worker] = workerStart(worker, cpuCount ? cpus[worker % cpuCount] : -1);
+        if( pids[worker] == 0 )
+            return 0;
+        if( pids[worker] == -1 )
+        {
+            printMessage(false, "fork failed\n");
+            if( worker == 0 )
+                return -1;
+        }
+    }
+    
+    // Resetting every channel means resetting every worker
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigHandler;
+    sigaction(SIGUSR1, &sa, NULL);
+    
+    while( g_cleanUp != 1 )
+    {
+        pid = wait(&status);
+        
+        if( g_cleanUp > 1 )
+        {
+            for( worker=0;worker<workers;worker++ )
+            {
+                if( pids[worker] > 0 )
+                    kill(pids[worker], SIGUSR1);
+            }
+            g_cleanUp = false;
+        }
+        
+        for( worker=0;worker<workers && pid > 0;worker++ )
+        {
+            if( pids[worker] != pid )
+                continue;
+            
+            printMessage(false, "Worker %i returned: %i, restarting it\n", worker+1, status);
+            
+            // It didn't get to remove its FIFOs
+            for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+            {
+                if( g_chConfig[loopIdx].streamed && g_dvrs[g_chConfig[loopIdx].dvr].worker == worker )
+                {
+                    workerPipeName(pipename, sizeof(pipename), worker, loopIdx);
+                    unlink(pipename);
+                }
+            }
+            sleep(1);
+            if( g_cleanUp == 1 )
+                break;
+            pids[worker] = workerStart(worker, cpuCount ? cpus[worker % cpuCount] : -1);
+            if( pids[worker] == 0 )
+                return 0;
+        }
+        
+        // A worker that couldn't be started is tried again a second later
+        for( worker=0;worker<workers && g_cleanUp != 1;worker++ )
+        {
+            if( pids[worker] != -1 )
+                continue;
+            sleep(1);
+            if( (pids[worker] = workerStart(worker, cpuCount ? cpus[worker % cpuCount] : -1)) == 0 )
+                return 0;
+        }
+    }
+    
+    for( worker=0;worker<workers;worker++ )
+    {
+        if( pids[worker] > 0 )
+            kill(pids[worker], SIGTERM);
+    }
+    while( wait(&status) > 0 )
+        ;
+    
+    if( globalArgs.verbose )
+        printMessage(true, "Exiting program: %i\n", g_cleanUp);
+    return 1;
+}
+
+int runEventLoop(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    struct itimerspec its;
+    struct channel_t *ch;
+    uint64_t expirations;
+    bool tick = true;		// Run the timers straight away to start connecting
+    int timerFd;
+    int loopIdx, n, status;
+    pid_t pid;
+    
+    g_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if( g_epollFd == -1 )
+    {
+        printError("Failed to create epoll instance\n");
+        return 1;
+    }
+    
+    // One timer drives every timeout and health check, whatever the packet rate
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if( timerFd == -1 )
+    {
+        printError("Failed to create timer\n");
+        close(g_epollFd);
+        return 1;
+    }
+    
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = WATCHDOG_INTERVAL;
+    its.it_interval.tv_sec = WATCHDOG_INTERVAL;
+    timerfd_settime(timerFd, 0, &its, NULL);
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;		// NULL marks the timer, everything else is a connection
+    epoll_ctl(g_epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+    
+    g_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    g_now = time(NULL);
+    
+    if( globalArgs.uring )
+        uringOpen();
+    
+    connSetup();
+    handoffAdopt();
+    
+    if( globalArgs.httpPort && httpOpen() != 0 )
+    {
+        close(timerFd);
+        close(g_epollFd);
+        return 1;
+    }
+    
+    if( globalArgs.handoffPath )
+        handoffListen();
+
+#ifdef BUILTIN_SNAPSHOT
+    snapshotPoolStart();
+#endif
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        ch = &g_channels[loopIdx];
+        
+        if( globalArgs.channel[loopIdx] != true )
+            continue;
+        
+        channelWatchSnapshot(ch);
+        
+        if( globalArgs.zeroCopy && openSplicePipe(ch->spliceFds) != 0 )
+        {
+            sprintf(g_errBuf, "Ch %i: %s", loopIdx+1, "Failed to create splice pipe, copying data instead\n");
+            printError(g_errBuf);
+        }
+    }
+    
+    while( g_cleanUp != 1 )
+    {
+        if( !tick )
+        {
+            n = epoll_wait(g_epollFd, events, MAX_EVENTS, -1);
+            
+            if( n == -1 && errno != EINTR )
+            {
+                printError("epoll_wait failed\n");
+                break;
+            }
+            
+            g_now = time(NULL);
+            
+            for( loopIdx=0;loopIdx<n;loopIdx++ )
+            {
+                void *ptr = events[loopIdx].data.ptr;
+                
+                if( ptr == NULL )
+                {
+                    if( read(timerFd, &expirations, sizeof(expirations)) > 0 )
+                        tick = true;
+                    continue;
+                }
+                
+                switch( *(enum pollType_t*)ptr )
+                {
+                    case POLL_DVR:
+                        connEvent((struct dvrConn_t*)ptr, events[loopIdx].events);
+                        break;
+                    case POLL_HTTP_LISTEN:
+                        httpAccept();
+                        break;
+                    case POLL_HTTP_CLIENT:
+                        httpEvent((struct httpClient_t*)ptr, events[loopIdx].events);
+                        break;
+                    case POLL_HANDOFF:
+                        handoffSend();
+                        break;
+                    case POLL_SNAPSHOT:
+#ifdef BUILTIN_SNAPSHOT
+                        snapshotPoolEvent();
+#endif
+                        break;
+                    case POLL_URING:
+                        uringEvent();
+                        break;
+                }
+            }
+            
+            // The pipes and recordings filled by those events, in one go
+            if( g_uring.active )
+                uringFlush();
+        }
+        
+        // Handed over or told to quit, nothing new is started
+        if( g_cleanUp == 1 )
+            break;
+        
+        // SIGUSR1/SIGUSR2 reset the pipe and connection of every channel
+        if( g_cleanUp > 1 )
+        {
+            for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+                channelRestart(&g_channels[loopIdx]);
+            for( loopIdx=0;loopIdx<g_connCount;loopIdx++ )
+                connDisconnect(&g_conns[loopIdx], 0);
+            g_cleanUp = false;
+        }
+        
+        if( !tick )
+            continue;
+        tick = false;
+        
+        // Reap ffmpeg processes that exited on their own
+        while( (pid = waitpid(-1, &status, WNOHANG)) > 0 )
+        {
+            printMessage(true, "Child %i returned: %i\n", pid, status);
+            for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+            {
+                if( g_channels[loopIdx].ffmpegPid == pid )
+                    g_channels[loopIdx].ffmpegPid = -1;
+            }
+        }
+        
+        // An ffmpeg taken over with -i belongs to init now, check it's still there
+        for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+        {
+            ch = &g_channels[loopIdx];
+            if( ch->ffmpegAdopted && ch->ffmpegPid > 0 && kill(ch->ffmpegPid, 0) == -1 && errno == ESRCH )
+            {
+                printMessage(true, "Ch %i: ffmpeg %i has gone\n", loopIdx+1, (int)ch->ffmpegPid);
+                ch->ffmpegPid = -1;
+            }
+        }
+        
+        readSnapshotEvents();
+        statsWrite();
+        httpTimers();
+        
+        for( loopIdx=0;loopIdx<g_connCount;loopIdx++ )
+            connTimers(&g_conns[loopIdx]);
+        
+        for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+        {
+            if( globalArgs.channel[loopIdx] == true )
+                channelTimers(&g_channels[loopIdx]);
+        }
+    }
+    
+    printMessage(true, "Cleaning up\n");
+
+#ifdef BUILTIN_SNAPSHOT
+    snapshotPoolStop();
+#endif
+    
+    for( loopIdx=0;loopIdx<MAX_CHANNELS;loopIdx++ )
+    {
+        ch = &g_channels[loopIdx];
+        channelRestart(ch);
+        recordClose(&ch->rec);
+        if( ch->spliceFds[0] != -1 )
+        {
+            close(ch->spliceFds[0]);
+            close(ch->spliceFds[1]);
+        }
+    }
+    
+    for( loopIdx=0;loopIdx<g_connCount;loopIdx++ )
+        connDisconnect(&g_conns[loopIdx], 0);
+    uringClose();
+    
+    if( g_httpFd != -1 )
+    {
+        for( loopIdx=0;loopIdx<HTTP_MAX_CLIENTS;loopIdx++ )
+            httpClose(&g_clients[loopIdx]);
+        close(g_httpFd);
+        g_httpFd = -1;
+    }
+    
+    // The socket file now belongs to the instance that took over, if any
+    if( g_handoffFd != -1 )
+    {
+        close(g_handoffFd);
+        unlink(globalArgs.handoffPath);
+        g_handoffFd = -1;
+    }
+    
+    if( g_inotifyFd != -1 )
+        close(g_inotifyFd);
+    g_inotifyFd = -1;
+    close(timerFd);
+    close(g_epollFd);
+    g_epollFd = -1;
+    return 0;
+}
+
+int sendLoginRequest(int sockFd)
+{
+    int retval;
+    char aloginBuf[] = { /* Packet 182 */
+        0x31, 0x31, 0x31, 0x31, 0x88, 0x00, 0x00, 0x00,
+        0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
         0x00, 0x00, 0x00, 0x00, 0x78, 0x00, 0x00, 0x00,
         0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
         0x61, 0x64, 0x6d, 0x69, 0x6e, 0x00, 0x00, 0x00,
@@ -585,9 +7082,11 @@ int connectStream(int sockFd, int channel)
         0x00, 0x00, 0x00, 0x00, 0xcd, 0xb8, 0x12, 0x7a,
         0x3a, 0x76, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00  };
     
-    retval = send(sockFd, (char*)(&aloginBuf), sizeof(aloginBuf), 0);
+    // MSG_MORE lets the login and stream request share packets
+    retval = send(sockFd, (char*)(&aloginBuf), sizeof(aloginBuf), MSG_MORE);
     
-    printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
+    if( retval != sizeof(aloginBuf) )
+        return -1;
     
     char bloginBuf[]  = { /* Packet 186 */
         0x31, 0x31, 0x31, 0x31, 0x28, 0x00, 0x00, 0x00,
@@ -597,48 +7096,60 @@ int connectStream(int sockFd, int channel)
         0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
         0x03, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
     
-    retval = send(sockFd, (char*)(&bloginBuf), sizeof(bloginBuf), 0);
-    
-    retval = recv(sockFd, &recvBuf, sizeof(recvBuf), 0);
-    retval = recv(sockFd, &recvBuf, sizeof(recvBuf), 0);
-    
-    if (channel ==0){
-        printMessage(true, "logging on 1\n");
-        char cloginBuf[] =  {
-            0x31, 0x31, 0x31, 0x31, 0x34, 0x00, 0x00, 0x00,
-            0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x01, 0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00  };
-        retval = send(sockFd, (char*)(&cloginBuf), sizeof(cloginBuf), 0);
-    }else if (channel ==1){
-        printMessage(true, "Logging on 2\n");
-        char cloginBuf[] =  {
-            0x31, 0x31, 0x31, 0x31, 0x34, 0x00, 0x00, 0x00,
-            0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x01, 0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00 };
-        retval = send(sockFd, (char*)(&cloginBuf), sizeof(cloginBuf), 0);
-    }
-    else if (channel ==2){
-        printMessage(true, "Logging on 3\n");
-        char cloginBuf[] =  {
-            0x31, 0x31, 0x31, 0x31, 0x34, 0x00, 0x00, 0x00,
-            0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x01, 0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-            0x00, 0x00, 0x00, 0x00 };
-        retval = send(sockFd, (char*)(&cloginBuf), sizeof(cloginBuf), 0);
-    }
+    retval = send(sockFd, (char*)(&bloginBuf), sizeof(bloginBuf), MSG_MORE);
+    
+    if( retval != sizeof(bloginBuf) )
+        return -1;
+    
     return 0;
 }
+
+int sendStreamRequest(int sockFd, uint32_t channelMask, uint32_t subMask)
+{
+    int retval;
+    unsigned char cloginBuf[] =  {
+        0x31, 0x31, 0x31, 0x31, 0x34, 0x00, 0x00, 0x00,
+        0x01, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x01, 0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00  };
+    
+    // Bytes 36-39 are a little endian mask of the channels to stream
+    cloginBuf[36] = channelMask & 0xff;
+    cloginBuf[37] = (channelMask >> 8) & 0xff;
+    cloginBuf[38] = (channelMask >> 16) & 0xff;
+    cloginBuf[39] = (channelMask >> 24) & 0xff;
+    
+    // Bytes 40-43 pick the sub stream instead, for the channels set in both
+    cloginBuf[40] = subMask & 0xff;
+    cloginBuf[41] = (subMask >> 8) & 0xff;
+    cloginBuf[42] = (subMask >> 16) & 0xff;
+    cloginBuf[43] = (subMask >> 24) & 0xff;
+    
+    if( subMask )
+        printMessage(true, "Requesting channel mask 0x%x, sub stream 0x%x\n", channelMask, subMask);
+    else
+        printMessage(true, "Requesting channel mask 0x%x\n", channelMask);
+    
+    retval = send(sockFd, (char*)(&cloginBuf), sizeof(cloginBuf), 0);
+    return (retval < 0) ? -1 : 0;
+}
+
+// The stream request goes out right behind the login, the login replies are
+// left in the socket for the framer to drop instead of waiting for them here
+int connectStream(int sockFd, int channel)
+{
+    int retval;
+    
+    retval = sendLoginRequest(sockFd);
+    
+    printMessage(true, "Ch %i: Send result: %i\n", channel+1, retval);
+    
+    if( retval != 0 )
+        return -1;
+    
+    return sendStreamRequest(sockFd, 1u << channel, 0);
+}
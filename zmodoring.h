@@ -0,0 +1,236 @@
+// Shared-memory frame ring written by zmodopipe -q, one per channel.
+//
+// zmodopipe is the only writer. Any number of local processes can attach
+// with zmRingOpen() and read the frames in place, each with its own cursor.
+// Readers never block the writer, a reader that falls more than the ring
+// behind is moved on to the latest keyframe.
+//
+//     struct zmRing_t ring;
+//     struct zmFrame_t frame;
+//
+//     if( zmRingOpen(&ring, 1) != 0 ) ...
+//     for( ;; )
+//     {
+//         int ret = zmRingNext(&ring, &frame);
+//         if( ret == 0 )
+//             ret = zmRingWait(&ring, 1000);	// -1 once the ring has gone, reopen it
+//         if( ret == 1 )
+//         {
+//             use(frame.data, frame.len);
+//             if( !zmRingValid(&ring, &frame) )
+//                 ...				// Overwritten while in use, drop it
+//         }
+//     }
+//
+// A frame is one DVR message, usually one picture. If the DVR doesn't frame
+// its stream, each received chunk is a frame and keyframes aren't flagged.
+
+#ifndef ZMODORING_H
+#define ZMODORING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define ZMRING_MAGIC 0x315a4d52		// "RMZ1"
+#define ZMRING_NAME "/zmodopipe-ch%i"	// shm_open() name, %i is the channel from 1
+#define ZMRING_SLOTS 1024		// Frames described at a time, a power of two
+#define ZMRING_KEY 1			// Frame starts with a SPS or IDR slice
+
+struct zmRingSlot_t {
+    uint64_t seq;		// Frame number, 0 while the slot is being rewritten
+    uint64_t pos;		// Stream position of the first byte
+    uint32_t len;
+    uint32_t flags;
+    int64_t usec;		// Wall clock time the frame arrived, in microseconds
+};
+
+struct zmRingHdr_t {
+    uint32_t magic;		// Set once the rest of the header is valid
+    uint32_t slotCount;
+    uint64_t dataSize;		// A power of two, multiple of the page size
+    uint64_t dataOffset;	// Where the data starts in the object, page aligned
+    uint64_t writeSeq __attribute__ ((aligned(64)));	// Last frame published, frames count from 1
+    uint64_t writePos;		// Data below writePos - dataSize may have been overwritten
+    uint64_t keySeq;		// Latest keyframe, 0 if none
+    uint32_t futex;		// Bumped with every frame, readers sleep on it
+    struct zmRingSlot_t slots[ZMRING_SLOTS] __attribute__ ((aligned(64)));
+};
+
+struct zmRing_t {
+    struct zmRingHdr_t *hdr;
+    unsigned char *data;	// dataSize bytes mapped twice in a row, so no frame wraps
+    size_t mapSize;
+    int fd;
+    uint64_t cursor;		// Next frame to read
+};
+
+struct zmFrame_t {
+    const unsigned char *data;	// Points into the ring
+    uint32_t len;
+    bool key;
+    int64_t usec;
+    uint64_t seq;
+    uint64_t pos;
+};
+
+// Map the header and the data, with a second copy of the data right behind
+// the first. Also used by zmodopipe itself.
+static inline int zmRingMap(int fd, size_t dataOffset, size_t dataSize, int prot, struct zmRingHdr_t **hdr, unsigned char **data)
+{
+    unsigned char *base;
+    
+    base = mmap(NULL, dataOffset + 2 * dataSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( base == MAP_FAILED )
+        return -1;
+    
+    if( mmap(base, dataOffset + dataSize, prot, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + dataOffset + dataSize, dataSize, prot, MAP_SHARED | MAP_FIXED, fd, dataOffset) == MAP_FAILED )
+    {
+        munmap(base, dataOffset + 2 * dataSize);
+        return -1;
+    }
+    
+    *hdr = (struct zmRingHdr_t*)base;
+    *data = base + dataOffset;
+    return 0;
+}
+
+// Move the cursor to the latest keyframe, or past everything if it's gone.
+// A long GOP can outlast the data of its keyframe while the slot is still
+// there, going back to it would only fail again.
+static inline void zmRingResync(struct zmRing_t *r)
+{
+    uint64_t head = __atomic_load_n(&r->hdr->writeSeq, __ATOMIC_ACQUIRE);
+    uint64_t key = __atomic_load_n(&r->hdr->keySeq, __ATOMIC_ACQUIRE);
+    struct zmRingSlot_t *slot = &r->hdr->slots[key % ZMRING_SLOTS];
+    uint64_t pos = slot->pos;
+    
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if( key && head - key < ZMRING_SLOTS / 2 && __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == key &&
+        __atomic_load_n(&r->hdr->writePos, __ATOMIC_RELAXED) - pos <= r->hdr->dataSize )
+        r->cursor = key;
+    else
+        r->cursor = head + 1;
+}
+
+// Attach to a channel's ring, reading starts at its latest keyframe
+static inline int zmRingOpen(struct zmRing_t *r, int channel)
+{
+    struct zmRingHdr_t hdr;
+    char name[64];
+    
+    memset(r, 0, sizeof(*r));
+    snprintf(name, sizeof(name), ZMRING_NAME, channel);
+    
+    r->fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if( r->fd == -1 )
+        return -1;
+    
+    if( pread(r->fd, &hdr, offsetof(struct zmRingHdr_t, writeSeq), 0) != offsetof(struct zmRingHdr_t, writeSeq) ||
+        hdr.magic != ZMRING_MAGIC || hdr.slotCount != ZMRING_SLOTS ||
+        zmRingMap(r->fd, hdr.dataOffset, hdr.dataSize, PROT_READ, &r->hdr, &r->data) != 0 )
+    {
+        close(r->fd);
+        errno = EPROTO;
+        return -1;
+    }
+    
+    r->mapSize = hdr.dataOffset + 2 * hdr.dataSize;
+    zmRingResync(r);
+    return 0;
+}
+
+static inline void zmRingClose(struct zmRing_t *r)
+{
+    if( r->hdr )
+        munmap(r->hdr, r->mapSize);
+    if( r->fd != -1 )
+        close(r->fd);
+    r->hdr = NULL;
+    r->fd = -1;
+}
+
+// True while nothing has overwritten the frame. Check after using its data.
+static inline bool zmRingValid(const struct zmRing_t *r, const struct zmFrame_t *f)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->hdr->writePos, __ATOMIC_RELAXED) - f->pos <= r->hdr->dataSize;
+}
+
+// Get the next frame. Returns 1 with a frame, 0 if there is none yet, and -1
+// if frames were lost because the reader fell behind; the cursor has then
+// been moved to the latest keyframe.
+static inline int zmRingNext(struct zmRing_t *r, struct zmFrame_t *f)
+{
+    struct zmRingSlot_t *slot;
+    uint64_t head = __atomic_load_n(&r->hdr->writeSeq, __ATOMIC_ACQUIRE);
+    uint64_t seq;
+    
+    if( r->cursor > head )
+        return 0;
+    
+    slot = &r->hdr->slots[r->cursor % ZMRING_SLOTS];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    
+    if( head - r->cursor < ZMRING_SLOTS && seq == r->cursor )
+    {
+        f->seq = seq;
+        f->pos = slot->pos;
+        f->len = slot->len;
+        f->key = (slot->flags & ZMRING_KEY) != 0;
+        f->usec = slot->usec;
+        f->data = r->data + (f->pos & (r->hdr->dataSize - 1));
+        
+        // The slot wasn't reused while it was read, and the data is still there
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if( __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq && zmRingValid(r, f) )
+        {
+            r->cursor++;
+            return 1;
+        }
+    }
+    
+    zmRingResync(r);
+    return -1;
+}
+
+// Sleep until a frame is published or 'timeoutMs' passes. Returns 1 if there
+// may be a frame, 0 on timeout and -1 if zmodopipe replaced the ring.
+static inline int zmRingWait(struct zmRing_t *r, int timeoutMs)
+{
+    struct timespec ts = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+    struct stat st;
+    uint32_t val;
+    long ret = 0;
+    
+    // The ring is mapped read-only, so the writer wakes the futex for every
+    // frame rather than counting sleepers. A frame published after 'val' was
+    // read makes FUTEX_WAIT return straight away.
+    val = __atomic_load_n(&r->hdr->futex, __ATOMIC_SEQ_CST);
+    
+    if( r->cursor > __atomic_load_n(&r->hdr->writeSeq, __ATOMIC_SEQ_CST) )
+        ret = syscall(SYS_futex, &r->hdr->futex, FUTEX_WAIT, val, &ts, NULL, 0);
+    
+    if( ret == -1 && errno == ETIMEDOUT )
+    {
+        // Unlinked by zmodopipe, a new ring has taken its place
+        if( fstat(r->fd, &st) == 0 && st.st_nlink == 0 )
+            return -1;
+        return 0;
+    }
+    return 1;
+}
+
+#endif